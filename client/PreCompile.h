@@ -19,6 +19,7 @@
 #include <QtCore/QDataStream>
 #include <QtCore/QDateTime>
 #include <QtCore/QDir>
+#include <QtCore/QDirIterator>
 #include <QtCore/QFile>
 #include <QtCore/QFileInfo>
 #include <QtCore/QMap>
@@ -28,8 +29,11 @@
 #include <QtCore/QString>
 #include <QtCore/QStringList>
 #include <QtCore/QTimer>
+#include <QtCore/QUuid>
 #include <QtCore/QAbstractTableModel>
 #include <QtCore/QThread>
+#include <QtCore/QThreadPool>
+#include <QtCore/QRunnable>
 #include <QtCore/QMutex>
 #include <QtCore/QHash>
 #include <QtCore/QBuffer>
@@ -69,8 +73,11 @@
 #include <QtWidgets/QTreeWidgetItem>
 #include <QtWidgets/QTableWidget>
 
-#define PCRE_STATIC
-#include "pcre.h"
+#define PCRE2_CODE_UNIT_WIDTH 8
+#ifdef WINDOWS
+#define PCRE2_STATIC
+#endif
+#include <pcre2.h>
 
 #ifdef WINDOWS
 #include "syncrules.h"
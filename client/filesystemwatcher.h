@@ -10,6 +10,7 @@ public:
 
   void setWatchDir(const QString& dir) { fDirToWatch = dir; }
   void setRelativeDir(const QString& dir) { fRelativeDir = dir; }
+  const QString& relativeDir() const { return fRelativeDir; }
   void run();
   void stop() { fThreadRunning = false; }
 
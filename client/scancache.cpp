@@ -0,0 +1,170 @@
+#include "PreCompile.h"
+#include "scancache.h"
+#include "utils.h"
+#include <QtCore/QSaveFile>
+
+static const quint32 s_Magic = 0x51534331; //QSC1
+static const qint32 s_Version = 1;
+
+ScanCache::ScanCache() :
+  m_Dirty(false)
+{
+}
+
+void ScanCache::load(const QString& branch, const QString& server, const QString& sourcePath, const QString& destinationPath)
+{
+  m_Entries.clear();
+  m_Dirty = false;
+  m_Server = server;
+  m_SourcePath = sourcePath;
+  m_DestinationPath = destinationPath;
+  QByteArray name = QCryptographicHash::hash(branch.toUtf8(), QCryptographicHash::Sha1).toHex();
+  m_FilePath = joinPath(GetDataDir(), "scancache_" + QString::fromLatin1(name) + ".dat");
+
+  QFile file(m_FilePath);
+  if(!file.open(QIODevice::ReadOnly))
+    return;
+
+  QDataStream stream(&file);
+  stream.setVersion(QDataStream::Qt_5_0);
+  quint32 magic;
+  qint32 version;
+  QString fileServer, fileSource, fileDestination;
+  qint32 count;
+  stream >> magic >> version >> fileServer >> fileSource >> fileDestination >> count;
+  if(stream.status() != QDataStream::Ok || magic != s_Magic || version != s_Version)
+  {
+    qWarning() << "[ScanCache.Warning] Ignoring unreadable scan cache " << m_FilePath;
+    return;
+  }
+  if(fileServer != server || fileSource != sourcePath || fileDestination != destinationPath)
+  {
+    //The branch points somewhere else now, nothing in the cache can be trusted
+    m_Dirty = true;
+    return;
+  }
+
+  m_Entries.reserve(count);
+  for(qint32 i = 0; i < count && stream.status() == QDataStream::Ok; ++i)
+  {
+    QString fileName;
+    Entry entry;
+    stream >> fileName >> entry.m_LocalMtime >> entry.m_Size >> entry.m_ServerMtime;
+    m_Entries.insert(fileName, entry);
+  }
+  if(stream.status() != QDataStream::Ok)
+  {
+    qWarning() << "[ScanCache.Warning] Scan cache " << m_FilePath << " is truncated, ignoring it";
+    m_Entries.clear();
+    return;
+  }
+  qInformation() << "[ScanCache.load] " << m_Entries.size() << " files were in sync at the end of the last session";
+}
+
+void ScanCache::save(const QSet<QString>& files)
+{
+  if(m_FilePath.isEmpty())
+    return;
+
+  //Files that are gone locally are dropped
+  for(QHash<QString, Entry>::iterator i = m_Entries.begin(); i != m_Entries.end();)
+  {
+    if(files.contains(i.key()))
+    {
+      ++i;
+    }
+    else
+    {
+      i = m_Entries.erase(i);
+      m_Dirty = true;
+    }
+  }
+  if(!m_Dirty)
+    return;
+
+  QDir().mkpath(GetDataDir());
+  //Written to a temporary file and renamed, a crash never leaves a half written cache behind
+  QSaveFile file(m_FilePath);
+  if(!file.open(QIODevice::WriteOnly))
+  {
+    qWarning() << "[ScanCache.Warning] Could not write scan cache " << m_FilePath;
+    return;
+  }
+  QDataStream stream(&file);
+  stream.setVersion(QDataStream::Qt_5_0);
+  stream << s_Magic << s_Version << m_Server << m_SourcePath << m_DestinationPath << qint32(m_Entries.size());
+  for(QHash<QString, Entry>::const_iterator i = m_Entries.begin(); i != m_Entries.end(); ++i)
+  {
+    stream << i.key() << i.value().m_LocalMtime << i.value().m_Size << i.value().m_ServerMtime;
+  }
+  if(file.commit())
+    m_Dirty = false;
+  else
+    qWarning() << "[ScanCache.Warning] Could not write scan cache " << m_FilePath;
+}
+
+void ScanCache::clear()
+{
+  m_Dirty = m_Dirty || !m_Entries.isEmpty();
+  m_Entries.clear();
+}
+
+bool ScanCache::lookup(const QString& fileName, qint64 localMtime, qint64 size, qint64& serverMtime) const
+{
+  QHash<QString, Entry>::const_iterator i = m_Entries.find(fileName);
+  if(i == m_Entries.end() || i.value().m_LocalMtime != localMtime || i.value().m_Size != size)
+    return false;
+  serverMtime = i.value().m_ServerMtime;
+  return true;
+}
+
+void ScanCache::insert(const QString& fileName, qint64 localMtime, qint64 size, qint64 serverMtime)
+{
+  Entry& entry = m_Entries[fileName];
+  entry.m_LocalMtime = localMtime;
+  entry.m_Size = size;
+  entry.m_ServerMtime = serverMtime;
+  m_Dirty = true;
+}
+
+void ScanCache::remove(const QString& fileName)
+{
+  if(m_Entries.remove(fileName))
+    m_Dirty = true;
+}
+
+void ScanCache::rename(const QString& oldName, const QString& newName, bool directory)
+{
+  if(!directory)
+  {
+    QHash<QString, Entry>::iterator i = m_Entries.find(oldName);
+    if(i != m_Entries.end())
+    {
+      Entry entry = i.value();
+      m_Entries.erase(i);
+      m_Entries.insert(newName, entry);
+      m_Dirty = true;
+    }
+    return;
+  }
+
+  QString prefix = oldName + '/';
+  QList<QPair<QString, Entry> > moved;
+  for(QHash<QString, Entry>::iterator i = m_Entries.begin(); i != m_Entries.end();)
+  {
+    if(i.key().startsWith(prefix))
+    {
+      moved.append(qMakePair(newName + i.key().mid(oldName.length()), i.value()));
+      i = m_Entries.erase(i);
+    }
+    else
+    {
+      ++i;
+    }
+  }
+  for(int i = 0; i < moved.size(); ++i)
+  {
+    m_Entries.insert(moved.at(i).first, moved.at(i).second);
+  }
+  m_Dirty = m_Dirty || !moved.isEmpty();
+}
@@ -0,0 +1,37 @@
+#ifndef SCANCACHE_H
+#define SCANCACHE_H
+
+//! What was in sync at the end of the last session of a branch. A restart only asks the server
+//! about files whose local mtime or size changed since then, the others are checked against the
+//! server mtime recorded here
+class ScanCache
+{
+public:
+  ScanCache();
+
+  //! Loads the cache of a branch, it starts empty when there is none or it was written for other paths
+  void load(const QString& branch, const QString& server, const QString& sourcePath, const QString& destinationPath);
+  //! Writes the entries of the given files if anything changed since the last load or save
+  void save(const QSet<QString>& files);
+  //! Forgets all entries, also the ones on disk when the cache is saved next time
+  void clear();
+  bool isEmpty() const { return m_Entries.isEmpty(); }
+
+  //! The server mtime of a file that is still as it was when the server last confirmed it
+  bool lookup(const QString& fileName, qint64 localMtime, qint64 size, qint64& serverMtime) const;
+  void insert(const QString& fileName, qint64 localMtime, qint64 size, qint64 serverMtime);
+  void remove(const QString& fileName);
+  //! Moves the entries of a renamed file or directory
+  void rename(const QString& oldName, const QString& newName, bool directory);
+
+private:
+  struct Entry { qint64 m_LocalMtime; qint64 m_Size; qint64 m_ServerMtime; };
+  QHash<QString, Entry> m_Entries;
+  QString m_FilePath;
+  QString m_Server;
+  QString m_SourcePath;
+  QString m_DestinationPath;
+  bool m_Dirty;
+};
+
+#endif //SCANCACHE_H
@@ -11,13 +11,29 @@ INCLUDEPATH += ..
 
 win32 {
   RC_FILE = resources/client.rc
+  INCLUDEPATH += $$(PCRE2DIR)/include
+  LIBS += -L$$(PCRE2DIR)/lib -lpcre2-8
+}
+unix {
+  CONFIG += link_pkgconfig
+  PKGCONFIG += libpcre2-8
 }
 
 FORMS = resources/copiedfilesdialog.ui resources/rulevisualizer.ui resources/rulevisualizer.ui resources/rulewidget.ui resources/settings.ui resources/sync.ui
-INCLUDEPATH = ../pcre/include ../shared
+INCLUDEPATH += ../shared
 HEADERS	= clientapp.h clientsettings.h clientwindow.h exceptionhandler.h filestabledialog.h filesystemwatcher.h \
           ruletreewidget.h rulevisualizerwidget.h rulevisualizerworker.h rulewidget.h syncrules.h syncruleviewmodel.h \
-          syncsystem.h ../shared/filescanner.h ../shared/remoteobjectconnection.h ../shared/scannerbase.h ../shared/utils.h
+          syncsystem.h ../shared/filescanner.h ../shared/remoteobjectconnection.h ../shared/scannerbase.h ../shared/utils.h \
+          ../shared/deltasync.h \
+          ../shared/contenthash.h \
+          ../shared/wireformat.h \
+          scancache.h \
+          ../shared/parallelfilescanner.h
 SOURCES	= clientapp.cpp clientsettings.cpp clientwindow.cpp exceptionhandler.cpp filestabledialog.cpp filesystemwatcher.cpp \
           ruletreewidget.cpp rulevisualizerwidget.cpp rulevisualizerworker.cpp rulewidget.cpp syncrules.cpp syncruleviewmodel.cpp \
-          syncsystem.cpp ../shared/filescanner.cpp ../shared/remoteobjectconnection.cpp ../shared/scannerbase.cpp ../shared/utils.cpp
+          syncsystem.cpp ../shared/filescanner.cpp ../shared/remoteobjectconnection.cpp ../shared/scannerbase.cpp ../shared/utils.cpp \
+          ../shared/deltasync.cpp \
+          ../shared/contenthash.cpp \
+          ../shared/wireformat.cpp \
+          scancache.cpp \
+          ../shared/parallelfilescanner.cpp
@@ -1,10 +1,59 @@
 #include "PreCompile.h"
 #include "syncrules.h"
 #include "utils.h"
+#include <QtCore/QRegularExpression>
+#include <QtCore/QThreadStorage>
 
 const QString RulesFileHeader("QuickSync Rules");
 QString defaultFile(joinPath(GetDataDir(), "syncrules.xml"));
 
+//Match data and JIT stack of one thread. The compiled rules are shared, pcre2_match needs
+//these per thread and they are kept to not allocate them for every path
+class MatchContext
+{
+public:
+  MatchContext() :
+    fMatchData(pcre2_match_data_create(1, NULL)),
+    fContext(pcre2_match_context_create(NULL)),
+    fJitStack(pcre2_jit_stack_create(32*1024, 512*1024, NULL))
+  {
+    //long paths against the combined rules need more than the default 32K
+    if(fJitStack != NULL)
+      pcre2_jit_stack_assign(fContext, NULL, fJitStack);
+  }
+
+  ~MatchContext()
+  {
+    pcre2_jit_stack_free(fJitStack);
+    pcre2_match_context_free(fContext);
+    pcre2_match_data_free(fMatchData);
+  }
+
+  pcre2_match_data* fMatchData;
+  pcre2_match_context* fContext;
+  pcre2_jit_stack* fJitStack;
+};
+
+static QThreadStorage<MatchContext*> s_MatchContexts;
+
+//Rule syntax that can't go into the combined pattern. QRegularExpression::match() is const so the
+//scanner threads can share it
+static const QRegularExpression s_UnsafeRule("\\\\[gQK]|\\\\k|\\(\\*|\\(\\?([0-9R+&-]|P>|P=)|\\(\\?[a-zA-Z^-]*x");
+
+static MatchContext* matchContext()
+{
+  if(!s_MatchContexts.hasLocalData())
+    s_MatchContexts.setLocalData(new MatchContext);
+  return s_MatchContexts.localData();
+}
+
+static QString errorMessage(int errorcode)
+{
+  PCRE2_UCHAR buffer[256];
+  pcre2_get_error_message(errorcode, buffer, sizeof(buffer));
+  return QString::fromUtf8(reinterpret_cast<const char*>(buffer));
+}
+
 SyncRule::SyncRule() : 
   fExclude(false), 
   fFlags(e_NoFlags),
@@ -35,7 +84,7 @@ SyncRule::~SyncRule()
 {
   if(fRegex != NULL)
   {
-    pcre_free(fRegex);
+    pcre2_code_free(fRegex);
     fRegex = NULL;
   }
 }
@@ -43,19 +92,25 @@ SyncRule::~SyncRule()
 
 bool SyncRule::compile(QString& error)
 {
+  if(fRegex != NULL)
+  {
+    pcre2_code_free(fRegex);
+    fRegex = NULL;
+  }
+
   QByteArray pattern = fPattern.toLower().toUtf8();
-  const char* cpattern = pattern.constData();
-  int erroffset;
-  const char *cerror;
-  fRegex = pcre_compile(cpattern, 0, &cerror, &erroffset, NULL);
+  int errorcode;
+  PCRE2_SIZE erroffset;
+  fRegex = pcre2_compile(reinterpret_cast<PCRE2_SPTR>(pattern.constData()), pattern.length(), 0, &errorcode, &erroffset, NULL);
 
   if(fRegex != NULL)
   {
-    fRegexExtra = pcre_study(fRegex, 0, &cerror);
+    //without JIT support in the library pcre2_match interprets the pattern instead
+    pcre2_jit_compile(fRegex, PCRE2_JIT_COMPLETE);
     return true;
   }
 
-  error = QString("%1 at col %2\n").arg(cerror).arg(erroffset);
+  error = QString("%1 at col %2\n").arg(errorMessage(errorcode)).arg(erroffset);
   return false;
 }
 
@@ -91,6 +146,7 @@ bool SyncRules::loadRules()
 void SyncRules::load()
 {
   m_Rules.clear();
+  invalidateMatcher();
 
   QSettings settings;
   int size = settings.beginReadArray("IgnoreRules");
@@ -132,6 +188,7 @@ void SyncRules::clear()
   }
   m_Rules.clear();
   m_LoadErrors.clear();
+  invalidateMatcher();
 }
 
 int SyncRules::createRule(const QString& pattern, bool exclude, int flags, QString& error)
@@ -148,6 +205,7 @@ int SyncRules::appendRule(SyncRule* rule)
 {
   int pos = m_Rules.size();
   m_Rules.push_back(rule);
+  invalidateMatcher();
   return pos;
 }
 
@@ -189,37 +247,176 @@ bool SyncRules::CheckFile(const QString& match, SyncRuleFlags_e& flags, int& rul
   flags = e_NoFlags;
   ruleIndex = -1;
   QByteArray str = match.toUtf8();
-  const char* pstr = str.constData();
-  for(int i=0;i<m_Rules.size();i++)
+  QSharedPointer<const RuleMatcher> rules = matcher();
+  int i = rules->match(str.constData(), str.length());
+  if(i < rules->count())
   {
-    SyncRule *rule = m_Rules[i];
-    int res = pcre_exec(rule->fRegex, rule->fRegexExtra, pstr, str.length(), 0,0,0,0);
-    if(res >= 0)
+    const RuleMatcher::Rule *rule = &rules->rule(i);
+    ruleIndex = i;
+    if(rule->fExclude)
     {
-
-      ruleIndex = i;
-      if(rule->fExclude)
-      {
-        //qDebug() << "[SyncRules.CheckFile] Excluding " << match;
-        return false;
-      }
-      else
-      {
-        flags = rule->fFlags;
-        //qDebug() << "[SyncRules.CheckFile] Including " << match;
-        return true; 
-      }
+      //qDebug() << "[SyncRules.CheckFile] Excluding " << match;
+      return false;
+    }
+    else
+    {
+      flags = rule->fFlags;
+      //qDebug() << "[SyncRules.CheckFile] Including " << match;
+      return true; 
     }
-
   }
-  if(!m_Rules.isEmpty())
-    ruleIndex = m_Rules.size();
+  if(rules->count() > 0)
+    ruleIndex = rules->count();
 
   //No rule to exclude, so we allow
   //qDebug() << "[SyncRules.CheckFile] Default Including " << match;
   return true;
 }
 
+//////////////////////////////////////////////////////////////////////////
+/// The rules as they were when the matcher was built. A matcher is shared
+/// by the threads that check paths against it and is replaced as a whole
+/// when the rules change, a thread still using the old one keeps it alive.
+//////////////////////////////////////////////////////////////////////////
+RuleMatcher::RuleMatcher(const QVector<SyncRule*>& rules) :
+  m_Combinable(!rules.isEmpty())
+{
+  for(int i=0;i<rules.size();i++)
+  {
+    const SyncRule* syncRule = rules[i];
+    Rule rule;
+    rule.fExclude = syncRule->fExclude;
+    rule.fFlags = syncRule->fFlags;
+    rule.fPattern = syncRule->fPattern.toLower().toUtf8();
+    rule.fRegex = syncRule->fRegex != NULL ? compile(rule.fPattern, 0) : NULL;
+    m_Rules.append(rule);
+
+    //group numbers change inside the alternation, verbs, \Q, \K and (?x) comments would leak into the other branches
+    uint32_t backRefs = 0;
+    if(rule.fRegex == NULL || pcre2_pattern_info(rule.fRegex, PCRE2_INFO_BACKREFMAX, &backRefs) != 0 || backRefs > 0 ||
+       s_UnsafeRule.match(syncRule->fPattern.toLower()).hasMatch())
+      m_Combinable = false;
+  }
+
+  m_Combined.resize(m_Rules.size() + 1);
+  if(m_Combinable && combined(m_Rules.size()) == NULL)
+    m_Combinable = false;
+}
+
+RuleMatcher::~RuleMatcher()
+{
+  for(int i=0;i<m_Rules.size();i++)
+  {
+    if(m_Rules[i].fRegex != NULL)
+      pcre2_code_free(m_Rules[i].fRegex);
+  }
+  for(int i=0;i<m_Combined.size();i++)
+  {
+    pcre2_code* code = m_Combined.at(i).loadAcquire();
+    if(code != NULL)
+      pcre2_code_free(code);
+  }
+}
+
+pcre2_code* RuleMatcher::compile(const QByteArray& pattern, uint32_t options)
+{
+  int errorcode;
+  PCRE2_SIZE erroffset;
+  pcre2_code* code = pcre2_compile(reinterpret_cast<PCRE2_SPTR>(pattern.constData()), pattern.length(), options, &errorcode, &erroffset, NULL);
+  if(code != NULL)
+    pcre2_jit_compile(code, PCRE2_JIT_COMPLETE);
+  else
+    qWarning() << "[SyncRules.Warning] Could not compile rule pattern: " << errorMessage(errorcode);
+  return code;
+}
+
+//The alternation of the first count rules, branch i is rule i followed by (*MARK:i). Built when it
+//is first needed
+pcre2_code* RuleMatcher::combined(int count) const
+{
+  pcre2_code* code = m_Combined.at(count).loadAcquire();
+  if(code != NULL)
+    return code;
+
+  QMutexLocker lock(&m_Mutex);
+  code = m_Combined.at(count).loadAcquire();
+  if(code == NULL)
+  {
+    QByteArray pattern;
+    for(int i=0;i<count;i++)
+    {
+      if(i > 0)
+        pattern += '|';
+      pattern += "(?:" + m_Rules[i].fPattern + ")(*MARK:" + QByteArray::number(i) + ")";
+    }
+    code = compile(pattern, 0);
+    m_Combined[count].storeRelease(code);
+  }
+  return code;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Returns the index of the first rule matching str, count() if none does
+///
+/// An unanchored match of the alternation finds the leftmost position any
+/// rule matches at, and the mark names the first rule matching there. A 
+/// rule before it can only match further right, so the search goes on 
+/// after that position with the alternation of the rules before it. Each
+/// round lowers the rule index, a path no rule matches takes one round. 
+/// In a round PCRE walks the path once and tries the branches that can 
+/// start at each position, the start-character filter it builds for the
+/// alternation skips most positions. A rule like .* that can start 
+/// anywhere is tried at every position. When the rules can't be combined
+/// or a match runs out of JIT stack they are matched one by one.
+//////////////////////////////////////////////////////////////////////////
+int RuleMatcher::match(const char* str, int length) const
+{
+  MatchContext* context = matchContext();
+  PCRE2_SPTR subject = reinterpret_cast<PCRE2_SPTR>(str);
+  int best = m_Rules.size();
+  PCRE2_SIZE start = 0;
+  while(m_Combinable && best > 0)
+  {
+    pcre2_code* code = combined(best);
+    if(code == NULL)
+      break;
+    int res = start <= PCRE2_SIZE(length) ? pcre2_match(code, subject, length, start, 0, context->fMatchData, context->fContext) : PCRE2_ERROR_NOMATCH;
+    if(res == PCRE2_ERROR_NOMATCH)
+      return best;
+    PCRE2_SPTR mark = pcre2_get_mark(context->fMatchData);
+    if(res < 0 || mark == NULL)
+      break;
+    best = atoi(reinterpret_cast<const char*>(mark));
+    start = pcre2_get_ovector_pointer(context->fMatchData)[0] + 1;
+  }
+  if(best == 0)
+    return 0;
+
+  for(int i=0;i<best;i++)
+  {
+    const Rule& rule = m_Rules[i];
+    if(rule.fRegex != NULL && pcre2_match(rule.fRegex, subject, length, 0, 0, context->fMatchData, context->fContext) >= 0)
+      return i;
+  }
+  return best;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+QSharedPointer<const RuleMatcher> SyncRules::matcher() const
+{
+  QMutexLocker lock(&m_MatcherMutex);
+  if(!m_Matcher)
+    m_Matcher = QSharedPointer<const RuleMatcher>(new RuleMatcher(m_Rules));
+  return m_Matcher;
+}
+
+void SyncRules::invalidateMatcher()
+{
+  QMutexLocker lock(&m_MatcherMutex);
+  m_Matcher.clear();
+}
+
 // This function will check each step of the path before checking the result, this was done to prevent
 // different result in full scan and in autoscan.
 bool SyncRules::CheckFileAndPath(const QString& match, SyncRuleFlags_e& flags) const 
@@ -283,6 +480,7 @@ void SyncRules::operator=(const SyncRules& other)
 {
   //Assign another set of rules to this object, clear the current rules, copy the others into this and compile all the rules
   m_Rules.clear();
+  invalidateMatcher();
   SyncRule* rule;
   foreach(rule, other.m_Rules)
   {
@@ -405,6 +603,7 @@ bool SyncRules::processRule(const QDomElement& element)
   if(rule->compile(m_XmlLoadingError))
   {
     m_Rules.append(rule);
+    invalidateMatcher();
     return true;
   }
   return false;
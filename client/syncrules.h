@@ -1,6 +1,8 @@
 #ifndef QUICKSYNC_SYNCRULES_H
 #define QUICKSYNC_SYNCRULES_H
 
+#include <QtCore/QAtomicPointer>
+
 extern QString defaultFile;
 
 enum SyncRuleFlags_e
@@ -47,8 +49,40 @@ public:
   QString fPattern;
   SyncRuleFlags_e fFlags;
   SyncRuleOrigin fOrigin;
-  pcre* fRegex;
-  pcre_extra* fRegexExtra;
+  pcre2_code* fRegex;
+};
+
+//The rules compiled for matching, see SyncRules::matcher()
+class RuleMatcher
+{
+public:
+  struct Rule
+  {
+    bool fExclude;
+    SyncRuleFlags_e fFlags;
+    QByteArray fPattern;
+    pcre2_code* fRegex;
+  };
+
+  RuleMatcher(const QVector<SyncRule*>& rules);
+  ~RuleMatcher();
+
+  int count() const { return m_Rules.size(); }
+  const Rule& rule(int index) const { return m_Rules[index]; }
+  int match(const char* str, int length) const;
+
+private:
+  RuleMatcher(const RuleMatcher&);
+  void operator=(const RuleMatcher&);
+
+  static pcre2_code* compile(const QByteArray& pattern, uint32_t options);
+  pcre2_code* combined(int count) const;
+
+  QVector<Rule> m_Rules;
+  bool m_Combinable;
+  //The alternations of the first n rules by n, built when they are first needed
+  mutable QMutex m_Mutex;
+  mutable QVector<QAtomicPointer<pcre2_code> > m_Combined;
 };
 
 class SyncRules : public QXmlDefaultHandler
@@ -94,6 +128,15 @@ protected:
   QVector<SyncRule*> m_Rules;
   QString m_LoadErrors;
   QString m_RuleLocation;
+
+private:
+  void invalidateMatcher();
+  QSharedPointer<const RuleMatcher> matcher() const;
+
+  //The rules compiled for matching, built on the first check after the rules changed. The scanner
+  //threads each take a reference, so a change never frees a matcher that is still in use
+  mutable QMutex m_MatcherMutex;
+  mutable QSharedPointer<const RuleMatcher> m_Matcher;
 };
 
 #endif //QUICKSYNC_SYNCRULES_H
@@ -6,15 +6,22 @@
 
 //Wait for 5 seconds of disk inactivity before restarting the full sync
 static quint32 s_ResyncTimeout = 5000;
+//Binary files at least this big are sent as a delta against the server's copy
+static qint64 s_DeltaMinSize = 1<<20;
+//Files at least this big are compared by content hash before they are sent
+static qint64 s_HashCheckMinSize = 1<<16;
 
 SyncSystem::SyncSystem(QSharedPointer<SyncRules> syncRules) :
   m_Connection(NULL),
+  m_JoinTimer(NULL),
   m_SyncState(e_Unconnected),
+  m_NextStatBatchId(0),
+  m_UseManifest(false),
+  m_ManifestComplete(false),
+  m_Scanner(NULL),
   m_SyncRules(syncRules),
   m_ReconnectTimer(NULL),
-  m_Scanner(NULL),
-  m_RestartSyncOnReconnect(false),
-  m_BytesInTransit(0)
+  m_RestartSyncOnReconnect(false)
 {
   resetStats();
 }
@@ -26,6 +33,7 @@ SyncSystem::~SyncSystem()
   Q_ASSERT(m_Scanner == NULL);
   Q_ASSERT(m_NameToInfo.empty());
   Q_ASSERT(m_Files.empty());
+  Q_ASSERT(m_Streams.empty());
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -33,6 +41,8 @@ SyncSystem::~SyncSystem()
 //////////////////////////////////////////////////////////////////////////
 void SyncSystem::slotSettingsChanged()
 {
+  //the rules may have been edited in the settings
+  clearDirVerdicts();
   reconnect();
 }
 
@@ -49,6 +59,7 @@ void SyncSystem::slotStartSync()
     return;
   resetStats();
   setSyncState(e_Syncing);
+  clearDirVerdicts();
 
   //Get the name of the current sync target
   QString currentBranch = m_Settings.value("CurrentlySelectedBranch").toString();
@@ -83,7 +94,8 @@ void SyncSystem::slotStartSync()
   }
 
   //Get the scanner and check that it is valid
-  m_Scanner = ScannerBase::selectScannerForFolder( m_CurrentSourcePath, m_SyncRules );
+  int scanThreads = m_Settings.value("scanner/threads", QThread::idealThreadCount()).toInt();
+  m_Scanner = ScannerBase::selectScannerForFolder( m_CurrentSourcePath, m_SyncRules, scanThreads );
   if(m_Scanner == NULL)
   {
     emit signalError("Information", QString("Could not find scanner for source directory: ").arg(currentBranch));
@@ -98,6 +110,20 @@ void SyncSystem::slotStartSync()
 
   m_Connection->sendTargetDirectory(m_CurrentDestinationPath);
 
+  QString server = QString("%1:%2").arg(m_Settings.value("server/hostname").toString()).arg(m_Settings.value("server/port").toInt());
+  m_ScanCache.load(currentBranch, server, m_CurrentSourcePath, m_CurrentDestinationPath);
+  if(!m_Settings.value("client/scanCache", true).toBool())
+    m_ScanCache.clear();
+
+  //Let the server walk the destination tree once instead of asking about each file. Files the scan
+  //cache knows are checked against it as well, to find the ones changed on the server since
+  m_Manifest.clear();
+  m_CachedFiles.clear();
+  m_ManifestComplete = false;
+  m_UseManifest = m_Connection->peerSupportsManifest();
+  if(m_UseManifest)
+    m_Connection->sendManifestReq();
+
   m_ScanDirTimer->start();
 }
 
@@ -113,6 +139,7 @@ void SyncSystem::scanComplete()
 {
   delete m_Scanner;
   m_Scanner = NULL;
+  finishManifest();
   updateSyncState();
   m_ScanDirTimer->stop();
 }
@@ -133,21 +160,66 @@ void SyncSystem::slotScanDir()
   {
     if(m_Scanner->scanStep())
     {
+      //Files are grouped per directory when the server can take batched stat requests
+      bool batch = !m_UseManifest && m_Connection->peerSupportsStatBatch();
+      QMap<QString, QStringList> dirToFiles;
+
       //Loop over each file in this directory
       for( ScannerBase::const_iterator fileIterator = m_Scanner->allFiles().begin(); fileIterator != m_Scanner->allFiles().end(); fileIterator++ )
       {
+        //The scanner stat'ed the file just now, a file deleted since then is picked up by the watcher
         QString fileName(fileIterator.key());
-        QFileInfo fileInfo(joinPath(m_CurrentSourcePath,fileName));
-        if(!fileInfo.exists())
-          continue; //File has been locally deleted since the sync was pressed
 
-        m_UnresolvedFiles[fileName] = fileIterator.value();
-        m_Connection->sendStatFileReq(fileName);
-        m_FilesPendingStat++;
         //Add to the known files list, this is used to find files to delete
         m_Files.insert(fileName);
+        m_FilesPendingStat++;
+
+        qint64 serverMtime;
+        if(m_ScanCache.lookup(fileName, fileIterator.value().mtime.toMSecsSinceEpoch(), fileIterator.value().size, serverMtime))
+        {
+          //Unchanged since the server last confirmed it, unless the server copy changed since then
+          m_FilesResolved++;
+          if(m_UseManifest)
+          {
+            if(m_ManifestComplete)
+            {
+              checkCachedFile(fileName, serverMtime, fileIterator.value().binary, fileIterator.value().executable);
+            }
+            else
+            {
+              CachedFile cached = { serverMtime, fileIterator.value().binary, fileIterator.value().executable };
+              m_CachedFiles.insert(fileName, cached);
+            }
+          }
+          continue;
+        }
+
+        m_UnresolvedFiles[fileName] = fileIterator.value();
+        if(m_UseManifest)
+        {
+          //resolved when the manifest is complete
+          if(m_ManifestComplete)
+            resolveFromManifest(fileName);
+        }
+        else if(batch)
+          dirToFiles[fileName.section('/', 0, -2)].append(fileName);
+        else
+          m_Connection->sendStatFileReq(fileName);
       }
-      m_DirsFinished++;
+
+      for(QMap<QString, QStringList>::const_iterator dir = dirToFiles.begin(); dir != dirToFiles.end(); ++dir)
+      {
+        QStringList names;
+        foreach(const QString& fileName, dir.value())
+        {
+          names.append(fileName.section('/', -1));
+        }
+        quint32 id = m_NextStatBatchId++;
+        m_PendingStatBatches[id] = dir.value();
+        m_Connection->sendStatFileBatchReq(id, dir.key(), names);
+      }
+      //a step of the parallel scanner can cover any number of directories
+      m_DirsFinished = m_Scanner->dirNumber();
       m_DirsKnown = m_Scanner->dirCount();
       m_DirsIgnored = m_Scanner->dirIgnored();
       emit signalDirsScanned(m_DirsFinished, m_DirsKnown, m_DirsIgnored);
@@ -183,6 +255,9 @@ void SyncSystem::slotReSync()
 //////////////////////////////////////////////////////////////////////////
 void SyncSystem::slotStopSync()
 {
+  //Only a complete sync knows all files, a stop in the middle of a scan keeps the cache as it was
+  if(m_SyncState == e_NodeWatching)
+    m_ScanCache.save(m_Files);
   setSyncState(e_Idle);
   stopFullSync();
   stopNodeWatching();
@@ -222,6 +297,7 @@ void SyncSystem::slotStartNodeWatching(const QString& dir)
 void SyncSystem::slotSyncRuleFile(const QString& path, QSharedPointer<SyncRules> rules)
 {
   m_PathRules[path] = rules;
+  clearDirVerdicts();
 }
 //////////////////////////////////////////////////////////////////////////
 /// A FileSystemWatcher notification when a file is added
@@ -234,10 +310,8 @@ void SyncSystem::slotFileAdded(QString file)
     m_LostSyncTimer->setInterval(s_ResyncTimeout);
   }
 
-  QSharedPointer<SyncRules> rules = GetSyncRulesForPath(file);
-
   SyncRuleFlags_e eFlags;
-  if(rules->CheckFileAndPath(file.toLower(), eFlags))
+  if(checkPathRules(file, eFlags))
   {
     if(checkForRescan(file))
     {
@@ -260,10 +334,8 @@ void SyncSystem::slotFileDeleted(QString file)
     m_LostSyncTimer->setInterval(s_ResyncTimeout);
   }
 
-  QSharedPointer<SyncRules> rules = GetSyncRulesForPath(file);
-
   SyncRuleFlags_e eFlags;
-  if(rules->CheckFileAndPath(file.toLower(), eFlags))
+  if(checkPathRules(file, eFlags))
   {
     bool binary = ((eFlags & e_Binary) == e_Binary);
     bool executable = ((eFlags & e_Executable) == e_Executable);
@@ -282,10 +354,8 @@ void SyncSystem::slotFileChanged(QString file)
     m_LostSyncTimer->setInterval(s_ResyncTimeout);
   }
 
-  QSharedPointer<SyncRules> rules = GetSyncRulesForPath(file);
-
   SyncRuleFlags_e eFlags;
-  if(rules->CheckFileAndPath(file.toLower(), eFlags))
+  if(checkPathRules(file, eFlags))
   {
     bool binary = ((eFlags & e_Binary) == e_Binary);
     bool executable = ((eFlags & e_Executable) == e_Executable);
@@ -304,15 +374,17 @@ void SyncSystem::slotFileRenamed(QString oldName, QString newName)
     m_LostSyncTimer->setInterval(s_ResyncTimeout);
   }
 
-  QSharedPointer<SyncRules> oldPathRules = GetSyncRulesForPath(oldName);
-  QSharedPointer<SyncRules> newPathRules = GetSyncRulesForPath(newName);
-
   SyncRuleFlags_e eOldFlags;
   SyncRuleFlags_e eFlags;
-  if(oldPathRules->CheckFileAndPath(oldName.toLower(), eOldFlags) )
+  if(checkPathRules(oldName, eOldFlags) )
   {
-    if(checkForRescan(newName))
+    if(QFileInfo(joinPath(m_CurrentSourcePath, newName)).isDir())
     {
+      //Move the directory on the server when every file below it keeps its rules, otherwise rescan
+      if(!(canRenameDirectory(oldName, newName) && sendRename(oldName, newName, true)))
+      {
+        slotReSync();
+      }
       return;
     }
 
@@ -320,13 +392,17 @@ void SyncSystem::slotFileRenamed(QString oldName, QString newName)
     bool oldExecutable = ((eOldFlags & e_Executable) == e_Executable);
 
     //old name should be synced
-    if(newPathRules->CheckFileAndPath(newName.toLower(), eFlags))
+    if(checkPathRules(newName, eFlags))
     {
       bool binary = ((eFlags & e_Binary) == e_Binary);
       bool executable = ((eFlags & e_Executable) == e_Executable);
-      //new file should also be synced, delete the old sync the new (to avoid the need for new server protocol)
-      addTodo(oldName, oldBinary, oldExecutable, true);
-      addTodo(newName, binary, executable, false);
+      //new file should also be synced. The server copy can be moved as long as it is stored the same way,
+      //otherwise delete the old and sync the new
+      if(binary != oldBinary || executable != oldExecutable || !sendRename(oldName, newName, false))
+      {
+        addTodo(oldName, oldBinary, oldExecutable, true);
+        addTodo(newName, binary, executable, false);
+      }
     }
     else
     {
@@ -334,7 +410,7 @@ void SyncSystem::slotFileRenamed(QString oldName, QString newName)
       addTodo(oldName, oldBinary, oldExecutable, true);
     }
   }
-  else if(newPathRules->CheckFileAndPath(newName.toLower(), eFlags))
+  else if(checkPathRules(newName, eFlags))
   {
     if(checkForRescan(newName))
     {
@@ -349,6 +425,149 @@ void SyncSystem::slotFileRenamed(QString oldName, QString newName)
   }
 }
 
+//////////////////////////////////////////////////////////////////////////
+/// Ask the server to move a file or directory instead of sending it again
+/// 
+/// Returns false when the rename has to be done the slow way: the server
+/// does not support it or there are changes to the paths that have not
+/// reached the server yet.
+//////////////////////////////////////////////////////////////////////////
+bool SyncSystem::sendRename(const QString& oldName, const QString& newName, bool directory)
+{
+  if(m_Connection == NULL || m_Scanner != NULL || !m_Connection->peerSupportsRename())
+    return false;
+
+  QString oldPrefix = oldName + '/';
+  QString newPrefix = newName + '/';
+  for(QMap<QString, FileTodo>::const_iterator i = m_NameToInfo.begin(); i != m_NameToInfo.end(); ++i)
+  {
+    const QString& name = i.key();
+    if(name == oldName || name == newName || name.startsWith(oldPrefix) || name.startsWith(newPrefix))
+      return false;
+  }
+  if(isRenamePending(oldName) || isRenamePending(newName))
+    return false;
+  if(directory && m_Streams.size() > 1)
+  {
+    foreach(const QString& name, m_SentDeletes)
+    {
+      if(name.startsWith(oldPrefix) || name.startsWith(newPrefix))
+        return false;
+    }
+  }
+
+  qInformation() << "[SyncSystem.sendRename] " << oldName << " to " << newName;
+  m_PendingRenames.append(qMakePair(oldName, newName));
+  //A file is moved on the connection of its new name, behind a delete of that name that was sent before
+  RemoteObjectConnection* connection = directory ? m_Connection : connectionFor(newName);
+  connection->sendRename(oldName, newName, directory);
+
+  if(!directory)
+  {
+    m_Files.remove(oldName);
+    m_Files.insert(newName);
+    return true;
+  }
+
+  QSet<QString> moved;
+  for(QSet<QString>::iterator i = m_Files.begin(); i != m_Files.end();)
+  {
+    if(i->startsWith(oldPrefix))
+    {
+      moved.insert(newPrefix + i->mid(oldPrefix.size()));
+      i = m_Files.erase(i);
+    }
+    else
+    {
+      ++i;
+    }
+  }
+  m_Files.unite(moved);
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// True when every file in the renamed directory gets the same rules at
+/// its new path, so the server copy can be moved as it is
+//////////////////////////////////////////////////////////////////////////
+bool SyncSystem::canRenameDirectory(const QString& oldName, const QString& newName)
+{
+  QString oldPrefix = oldName + '/';
+  //Rule files and watched reparse points below the directory are found by the scanner, leave them to a rescan
+  for(QMap<QString, QSharedPointer<SyncRules> >::const_iterator i = m_PathRules.begin(); i != m_PathRules.end(); ++i)
+  {
+    if(i.key() == oldName || i.key().startsWith(oldPrefix))
+      return false;
+  }
+  foreach(FileSystemWatcher* watcher, m_FileSystemWatchers)
+  {
+    if(watcher->relativeDir() == oldName || watcher->relativeDir().startsWith(oldPrefix))
+      return false;
+  }
+
+  QString newPath = joinPath(m_CurrentSourcePath, newName);
+  QDirIterator it(newPath, QDir::Files | QDir::Hidden | QDir::System, QDirIterator::Subdirectories);
+  while(it.hasNext())
+  {
+    it.next();
+    QString relative = it.filePath().mid(newPath.size() + 1);
+    if(relative.endsWith("syncrules.xml"))
+      return false;
+
+    QString oldFile = joinPath(oldName, relative);
+    QString newFile = joinPath(newName, relative);
+    SyncRuleFlags_e eOldFlags = e_NoFlags;
+    SyncRuleFlags_e eFlags = e_NoFlags;
+    bool oldSynced = checkPathRules(oldFile, eOldFlags);
+    bool newSynced = checkPathRules(newFile, eFlags);
+    if(oldSynced != newSynced || (newSynced && eOldFlags != eFlags))
+      return false;
+  }
+  return true;
+}
+
+bool SyncSystem::isRenamePending(const QString& name) const
+{
+  for(int i=0; i<m_PendingRenames.size(); ++i)
+  {
+    const QPair<QString, QString>& rename = m_PendingRenames.at(i);
+    if(name == rename.first || name == rename.second ||
+       name.startsWith(rename.first + '/') || name.startsWith(rename.second + '/'))
+      return true;
+  }
+  return false;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// The server has applied a rename, or could not and it is done the slow way
+//////////////////////////////////////////////////////////////////////////
+void SyncSystem::recvRenameResult(const QString &oldName, const QString &newName, bool directory, bool result)
+{
+  m_PendingRenames.removeOne(qMakePair(oldName, newName));
+  if(result)
+    m_ScanCache.rename(oldName, newName, directory);
+
+  //sync has been stopped, ignore what the server is sending
+  if(m_SyncState == e_Idle || result)
+    return;
+
+  qWarning() << "[SyncSystem.recvRenameResult] Server could not rename " << oldName << " to " << newName;
+  if(directory)
+  {
+    slotReSync();
+    return;
+  }
+
+  SyncRuleFlags_e eFlags = e_NoFlags;
+  if(checkPathRules(newName, eFlags))
+  {
+    bool binary = ((eFlags & e_Binary) == e_Binary);
+    bool executable = ((eFlags & e_Executable) == e_Executable);
+    addTodo(oldName, binary, executable, true);
+    addTodo(newName, binary, executable, false);
+  }
+}
+
 //////////////////////////////////////////////////////////////////////////
 /// A FileSystemWatcher notification about some error
 //////////////////////////////////////////////////////////////////////////
@@ -376,6 +595,10 @@ void SyncSystem::started()
   m_LostSyncTimer = new QTimer;
   m_LostSyncTimer->setSingleShot(true);
   connect(m_LostSyncTimer, SIGNAL(timeout()), this, SLOT(slotReSync()));
+  m_JoinTimer = new QTimer;
+  m_JoinTimer->setSingleShot(true);
+  m_JoinTimer->setInterval(5000);
+  connect(m_JoinTimer, SIGNAL(timeout()), this, SLOT(slotJoinTimeout()));
   //Initial connect
   reconnect(0);
 }
@@ -385,14 +608,9 @@ void SyncSystem::finished()
   //cleanup after the event loop is finished
   stopFullSync();
   stopNodeWatching();
-  if(m_Connection != NULL)
-  {
-    m_Connection->fSocket->disconnect( this );
-    m_Connection->disconnect( this );
-    m_Connection->fSocket->close();
-    m_Connection->deleteLater();
-    m_Connection = NULL;
-  }
+  closeSession();
+  delete m_JoinTimer;
+  m_JoinTimer = NULL;
   delete m_ReconnectTimer;
   m_ReconnectTimer = NULL;
   delete m_ScanDirTimer;
@@ -403,14 +621,35 @@ void SyncSystem::finished()
   m_LostSyncTimer = NULL;
 }
 
+//////////////////////////////////////////////////////////////////////////
+/// Remove all 0x0d bytes, turning \r\n into \n
+//////////////////////////////////////////////////////////////////////////
+static void stripCarriageReturns(QByteArray& data)
+{
+  // 0d 0a -> 0a
+  char *src = data.data();
+  char *dst = data.data();
+  char *srcend = src + data.size();
+  while( src != srcend )
+  {
+    if( *src != 0x0d )
+    {
+      *dst++ = *src;
+    }
+    src++;
+  }
+  data.resize( static_cast<int>(dst-data.data()) );
+}
+
 //////////////////////////////////////////////////////////////////////////
 /// Send a file to the server, replacing \r\n with \n for text files.
 /// 
-/// Creates the timers and connects the signals.
-/// Does the initial connection to the server before entering the event 
-/// loop.
+/// Large binary files are diffed against the server's copy when allowDelta
+/// is set, the rest of the work is done in recvSignatureReply.
+/// Files larger than one stream chunk are queued for streaming when the
+/// server supports it, smaller files are sent in a single packet.
 //////////////////////////////////////////////////////////////////////////
-void SyncSystem::sendFile( const QString &filename, bool binary, bool executable )
+void SyncSystem::sendFile( const QString &filename, bool binary, bool executable, bool allowDelta )
 {
   //Get the source and destination directory from the branch information
   if(m_CurrentSourcePath.isEmpty())
@@ -422,36 +661,398 @@ void SyncSystem::sendFile( const QString &filename, bool binary, bool executable
 
   QString path = joinPath(m_CurrentSourcePath,filename);
   QFile file( path );
+  SyncStream* stream = streamFor(filename);
 
   if( file.open(QIODevice::ReadOnly) )
   {
+    if( allowDelta && binary && stream->m_Connection->peerSupportsDelta() && file.size() >= s_DeltaMinSize )
+    {
+      m_DeltaPending[filename] = StreamTodo(filename, binary, executable);
+      stream->m_Connection->sendSignatureReq(filename, deltaBlockSize(file.size()));
+      return;
+    }
+
+    if( stream->m_Connection->peerSupportsStreaming() && file.size() > RemoteObjectConnection::streamChunkSize )
+    {
+      //slotSyncUpdate starts the stream when it is done with the todo list
+      stream->m_StreamQueue.append(StreamTodo(filename, binary, executable));
+      return;
+    }
+
     QFileInfo fileinfo( file );
 
     QByteArray data = file.readAll();
     if( !binary )
     {
-      // 0d 0a -> 0a
-      char *src = data.data();
-      char *dst = data.data();
-      char *srcend = src + data.size();
-      //int state = 0;
-      while( src != srcend )
+      stripCarriageReturns(data);
+    }
+    stream->m_Connection->sendSendFile( filename, fileinfo.lastModified(), data, executable );
+  }
+  else
+  {
+    qWarning() << "[SyncSystem.sendFile] Could not open file " << filename;
+    addTodo(filename, binary, executable, false, true);
+  }
+}
+
+HashJob::HashJob(const QString& filename, const QString& path, bool binary, const QDateTime& todoMtime) :
+  m_Filename(filename), m_Path(path), m_Binary(binary), m_TodoMtime(todoMtime), m_Mtime(0), m_Size(0)
+{
+  setAutoDelete(false);
+  connect(this, SIGNAL(finished()), SLOT(deleteLater()));
+}
+
+void HashJob::run()
+{
+  QFileInfo fileinfo(m_Path);
+  m_Mtime = fileinfo.lastModified().toMSecsSinceEpoch();
+  m_Size = fileinfo.size();
+  qint64 hashedSize;
+  m_Hash = ContentHasher::hashFile(m_Path, !m_Binary, hashedSize);
+  emit finished();
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Ask the server to compare the content hash of a file with its copy
+/// 
+/// A touch or a checkout that restores the same content only changes the
+/// mtime, in that case the server updates its mtime and nothing is sent.
+/// Servers with a content store also create the file from another copy
+/// with the same hash, so switching branches sends little data.
+/// Files that are not in the hash cache are hashed on the thread pool and
+/// the request is sent from slotFileHashed().
+//////////////////////////////////////////////////////////////////////////
+void SyncSystem::startHashCheck(const FileTodo &todo)
+{
+  QString path = joinPath(m_CurrentSourcePath, todo.m_Filename);
+  QFileInfo fileinfo(path);
+  QByteArray hash;
+  if(m_HashCache.lookup(path, fileinfo.lastModified().toMSecsSinceEpoch(), fileinfo.size(), hash))
+  {
+    sendHashCheck(todo, fileinfo.size(), hash);
+    return;
+  }
+
+  HashJob* job = new HashJob(todo.m_Filename, path, todo.m_Binary, todo.m_Mtime);
+  connect(job, SIGNAL(finished()), SLOT(slotFileHashed()));
+  m_HashJobs.insert(todo.m_Filename, job);
+  QThreadPool::globalInstance()->start(job);
+}
+
+void SyncSystem::sendHashCheck(const FileTodo &todo, qint64 size, const QByteArray &hash)
+{
+  //text files lose their \r on the server so only the size of binary files can be compared
+  if(!todo.m_Binary)
+    size = -1;
+  RemoteObjectConnection* connection = connectionFor(todo.m_Filename);
+  if(connection->peerSupportsMaterialize())
+  {
+    //the server can also copy the content from another branch that has it
+    connection->sendMaterializeReq(todo.m_Filename, todo.m_Mtime, size, hash, todo.m_Executable);
+  }
+  else
+  {
+    connection->sendHashCheckReq(todo.m_Filename, todo.m_Mtime, size, hash);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// A file of a hash check was hashed on the thread pool
+/// 
+/// Sends the hash check unless the todo changed in the meantime, files that
+/// could not be hashed are sent as usual.
+//////////////////////////////////////////////////////////////////////////
+void SyncSystem::slotFileHashed()
+{
+  HashJob* job = qobject_cast<HashJob*>(sender());
+  if(!job)
+    return;
+  if(!job->hash().isEmpty())
+    m_HashCache.insert(job->path(), job->mtime(), job->size(), job->hash());
+  if(m_HashJobs.value(job->filename()) != job)
+    return;
+  m_HashJobs.remove(job->filename());
+
+  QMap<QString, FileTodo>::iterator i = m_NameToInfo.find(job->filename());
+  if(m_SyncState == e_Idle || m_Connection == NULL || i == m_NameToInfo.end() || i.value().m_Delete || !i.value().m_Started)
+    return;
+
+  if(job->hash().isEmpty() || i.value().m_Mtime.secsTo(job->todoMtime()) != 0)
+  {
+    //the file changed while it was hashed or it could not be read, the next sync update takes care of it
+    i.value().m_Started = false;
+    m_SyncUpdateTimer->start(100);
+    return;
+  }
+  sendHashCheck(i.value(), job->size(), job->hash());
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// The server compared the content hash with its copy of the file
+/// 
+/// On a match the server has taken over the mtime and the todo is done,
+/// otherwise the file is sent on the next sync update.
+//////////////////////////////////////////////////////////////////////////
+void SyncSystem::recvHashCheckReply(const QString &filename, const QDateTime &mtime, bool match)
+{
+  QMap<QString, FileTodo>::iterator i = m_NameToInfo.find(filename);
+  if(m_SyncState == e_Idle || i == m_NameToInfo.end() || i.value().m_Delete)
+    return;
+
+  //the file changed again while the server was hashing, check the new content
+  if(i.value().m_Mtime.secsTo(mtime) != 0)
+  {
+    i.value().m_HashChecked = false;
+    match = false;
+  }
+
+  if(match)
+  {
+    qInformation() << "[SyncSystem.recvHashCheckReply] " << filename << " already has this content on the server";
+    m_FilesCopied++;
+    m_ScanCache.insert(filename, i.value().m_Mtime.toMSecsSinceEpoch(), i.value().m_Size, mtime.toMSecsSinceEpoch());
+    m_NameToInfo.erase(i);
+    emit signalFileStatus(filename, mtime, true);
+    emit signalFilesCopied(m_FilesCopied, m_FilesPendingCopy, m_FileErrors);
+  }
+  else
+  {
+    i.value().m_Started = false;
+    m_SyncUpdateTimer->start(100);
+  }
+  updateSyncState();
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// The server sent the block signatures of its copy of a file
+/// 
+/// Sends the delta against those blocks, or the whole file if the server
+/// has no copy or the delta would be mostly literal data anyway. Servers
+/// that take the delta in pieces get it from feedStream while it is
+/// computed.
+//////////////////////////////////////////////////////////////////////////
+void SyncSystem::recvSignatureReply(const QString &filename, const DeltaSignature &signature)
+{
+  QMap<QString, StreamTodo>::iterator iPending = m_DeltaPending.find(filename);
+  if(m_SyncState == e_Idle || iPending == m_DeltaPending.end())
+    return;
+  StreamTodo todo = iPending.value();
+  m_DeltaPending.erase(iPending);
+
+  if(signature.blockCount() > 0 && connectionFor(filename)->peerSupportsDeltaStream())
+  {
+    //feedStream computes and sends the delta as the socket drains
+    streamFor(filename)->m_DeltaQueue.append(qMakePair(todo, signature));
+    slotStreamFiles();
+    return;
+  }
+
+  QFile file(joinPath(m_CurrentSourcePath, filename));
+  uchar* data = NULL;
+  if(signature.blockCount() > 0 && file.open(QIODevice::ReadOnly))
+    data = file.map(0, file.size());
+
+  if(data == NULL)
+  {
+    sendFile(filename, todo.m_Binary, todo.m_Executable, false);
+    slotStreamFiles();
+    return;
+  }
+
+  qint64 size = file.size();
+  qint64 literalBytes = 0;
+  QByteArray delta = computeDelta(data, size, signature, literalBytes);
+  file.unmap(data);
+
+  if(literalBytes > size / 2 || delta.size() > connectionFor(filename)->peerMaxPacketSize())
+  {
+    //Most of the file changed, a plain transfer is cheaper than the delta
+    sendFile(filename, todo.m_Binary, todo.m_Executable, false);
+    slotStreamFiles();
+    return;
+  }
+
+  qInformation() << "[SyncSystem.recvSignatureReply] Sending delta of " << filename << " " << GetHumanReadableSize(literalBytes) << " of " << GetHumanReadableSize(size) << " changed";
+  connectionFor(filename)->sendSendDelta(filename, QFileInfo(file).lastModified(), signature.fBlockSize, delta, todo.m_Executable);
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Feed the streamed files to the sockets of the session
+//////////////////////////////////////////////////////////////////////////
+void SyncSystem::slotStreamFiles()
+{
+  foreach(SyncStream* stream, m_Streams)
+  {
+    feedStream(stream);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Feed the streamed files of one connection to its socket
+/// 
+/// Called when the socket has written data or the server granted more
+/// credit. Keeps at most a couple of chunks in the socket buffer so memory
+/// use is bounded by the chunk size and not by the size of the file, and
+/// stays within the send window of the connection.
+/// Binary files that would not be compressed are handed to the connection
+/// as a whole instead, it sends them without copying them through packets.
+/// Deltas are computed one chunk at a time in the same way.
+//////////////////////////////////////////////////////////////////////////
+void SyncSystem::feedStream(SyncStream* stream)
+{
+  RemoteObjectConnection* connection = stream->m_Connection;
+  while(connection->fSocket->bytesToWrite() < 2*RemoteObjectConnection::streamChunkSize && connection->sendWindow() > 0 && !connection->isSendingRaw())
+  {
+    if(stream->m_Delta == NULL && stream->m_StreamFile == NULL && !stream->m_DeltaQueue.isEmpty())
+    {
+      startDelta(stream);
+      continue;
+    }
+
+    if(stream->m_Delta != NULL)
+    {
+      StreamTodo current = stream->m_DeltaCurrent;
+      qint64 size = stream->m_DeltaFile->size();
+      QByteArray ops = stream->m_Delta->next(RemoteObjectConnection::streamChunkSize);
+      if(stream->m_Delta->literalBytes() > size / 2)
+      {
+        //Most of the file changed, a plain transfer is cheaper than the rest of the delta
+        connection->sendSendDeltaEnd(false);
+        finishDelta(stream);
+        sendFile(current.m_Filename, current.m_Binary, current.m_Executable, false);
+        continue;
+      }
+      if(ops.isEmpty())
+      {
+        qInformation() << "[SyncSystem.feedStream] Sent delta of " << current.m_Filename << " " << GetHumanReadableSize(stream->m_Delta->literalBytes()) << " of " << GetHumanReadableSize(size) << " changed";
+        connection->sendSendDeltaEnd(true);
+        finishDelta(stream);
+        continue;
+      }
+      connection->sendSendDeltaChunk(ops);
+      continue;
+    }
+
+    if(stream->m_StreamFile == NULL)
+    {
+      if(stream->m_StreamQueue.isEmpty())
+        return;
+
+      StreamTodo& current = stream->m_StreamCurrent;
+      current = stream->m_StreamQueue.takeFirst();
+      if(current.m_Binary && connection->peerSupportsRawSend() && !connection->compressesFile(current.m_Filename))
       {
-        if( *src != 0x0d )
+        //slotStreamFiles is called again from sendFileRawDone
+        if(!connection->sendSendFileRaw(current.m_Filename, joinPath(m_CurrentSourcePath, current.m_Filename), current.m_Executable))
         {
-          *dst++ = *src;
+          qWarning() << "[SyncSystem.feedStream] Could not open file " << current.m_Filename;
+          addTodo(current.m_Filename, current.m_Binary, current.m_Executable, false, true);
         }
-        src++;
+        continue;
       }
-      data.resize( static_cast<int>(dst-data.data()) );
+      stream->m_StreamFile = new QFile(joinPath(m_CurrentSourcePath, current.m_Filename));
+      if(!stream->m_StreamFile->open(QIODevice::ReadOnly))
+      {
+        qWarning() << "[SyncSystem.feedStream] Could not open file " << current.m_Filename;
+        delete stream->m_StreamFile;
+        stream->m_StreamFile = NULL;
+        addTodo(current.m_Filename, current.m_Binary, current.m_Executable, false, true);
+        continue;
+      }
+      connection->sendSendFileBegin(current.m_Filename, QFileInfo(*stream->m_StreamFile).lastModified(), current.m_Executable);
     }
-    m_Connection->sendSendFile( filename, fileinfo.lastModified(), data, executable );
+
+    QByteArray data = stream->m_StreamFile->read(RemoteObjectConnection::streamChunkSize);
+    if(data.isEmpty())
+    {
+      //Either the end of the file or a read error, the server reports a failed result for incomplete files and we retry
+      bool complete = stream->m_StreamFile->error() == QFile::NoError;
+      if(!complete)
+        qWarning() << "[SyncSystem.feedStream] Could not read file " << stream->m_StreamCurrent.m_Filename;
+      connection->sendSendFileEnd(complete);
+      delete stream->m_StreamFile;
+      stream->m_StreamFile = NULL;
+      continue;
+    }
+
+    if(!stream->m_StreamCurrent.m_Binary)
+    {
+      stripCarriageReturns(data);
+    }
+    connection->sendSendFileChunk(data);
   }
-  else
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Map the file of the next queued delta and announce it to the server
+/// 
+/// Files that can no longer be mapped are sent whole instead.
+//////////////////////////////////////////////////////////////////////////
+bool SyncSystem::startDelta(SyncStream* stream)
+{
+  QPair<StreamTodo, DeltaSignature> next = stream->m_DeltaQueue.takeFirst();
+  StreamTodo& current = stream->m_DeltaCurrent;
+  current = next.first;
+
+  stream->m_DeltaFile = new QFile(joinPath(m_CurrentSourcePath, current.m_Filename));
+  if(stream->m_DeltaFile->open(QIODevice::ReadOnly))
+    stream->m_DeltaData = stream->m_DeltaFile->map(0, stream->m_DeltaFile->size());
+  if(stream->m_DeltaData == NULL)
   {
-    qWarning() << "[SyncSystem.sendFile] Could not open file " << filename;
-    addTodo(filename, binary, executable, false, true);
+    finishDelta(stream);
+    sendFile(current.m_Filename, current.m_Binary, current.m_Executable, false);
+    return false;
   }
+
+  stream->m_Delta = new DeltaComputer(stream->m_DeltaData, stream->m_DeltaFile->size(), next.second);
+  stream->m_Connection->sendSendDeltaBegin(current.m_Filename, QFileInfo(*stream->m_DeltaFile).lastModified(), next.second.fBlockSize, current.m_Executable);
+  return true;
+}
+
+void SyncSystem::finishDelta(SyncStream* stream)
+{
+  delete stream->m_Delta;
+  stream->m_Delta = NULL;
+  if(stream->m_DeltaData != NULL)
+    stream->m_DeltaFile->unmap(stream->m_DeltaData);
+  stream->m_DeltaData = NULL;
+  delete stream->m_DeltaFile;
+  stream->m_DeltaFile = NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Drop all queued streams, aborting the ones in progress
+//////////////////////////////////////////////////////////////////////////
+void SyncSystem::resetStreams()
+{
+  foreach(SyncStream* stream, m_Streams)
+  {
+    stream->m_Connection->abortSendFileRaw();
+    if(stream->m_StreamFile != NULL)
+    {
+      stream->m_Connection->sendSendFileEnd(false);
+      delete stream->m_StreamFile;
+      stream->m_StreamFile = NULL;
+    }
+    stream->m_StreamQueue.clear();
+    if(stream->m_Delta != NULL)
+      stream->m_Connection->sendSendDeltaEnd(false);
+    finishDelta(stream);
+    stream->m_DeltaQueue.clear();
+  }
+  m_DeltaPending.clear();
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// The stream a file is sent on, all packets about one file use the same
+/// connection so the server sees them in order
+//////////////////////////////////////////////////////////////////////////
+SyncStream* SyncSystem::streamFor(const QString& filename) const
+{
+  Q_ASSERT(!m_Streams.empty());
+  if(m_Streams.size() == 1)
+    return m_Streams.first();
+  return m_Streams.at(static_cast<int>(qHash(filename) % static_cast<uint>(m_Streams.size())));
 }
 
 void SyncSystem::reconnect( int delay )
@@ -468,19 +1069,75 @@ void SyncSystem::reconnect( int delay )
   {
     stopFullSync();
     stopNodeWatching();
-    m_BytesInTransit = 0;
-
-    m_Connection->fSocket->disconnect( this );
-    m_Connection->disconnect( this );
-    m_Connection->fSocket->close();
-    m_Connection->deleteLater();
-    m_Connection = NULL;
+    closeSession();
     setSyncState(e_Unconnected);
   }
 
   m_ReconnectTimer->start( delay );
 }
 
+//////////////////////////////////////////////////////////////////////////
+/// Close and delete all connections of the session
+//////////////////////////////////////////////////////////////////////////
+void SyncSystem::closeSession()
+{
+  m_JoinTimer->stop();
+  foreach(RemoteObjectConnection* connection, m_JoiningConnections)
+  {
+    destroyConnection(connection);
+  }
+  m_JoiningConnections.clear();
+  foreach(SyncStream* stream, m_Streams)
+  {
+    destroyConnection(stream->m_Connection);
+    delete stream->m_StreamFile;
+    finishDelta(stream);
+  }
+  qDeleteAll(m_Streams);
+  m_Streams.clear();
+  m_Connection = NULL;
+}
+
+void SyncSystem::destroyConnection(RemoteObjectConnection* connection)
+{
+  connection->fSocket->disconnect( this );
+  connection->disconnect( this );
+  connection->fSocket->close();
+  connection->deleteLater();
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Create a connection to the server with all signals hooked up
+//////////////////////////////////////////////////////////////////////////
+RemoteObjectConnection* SyncSystem::createConnection()
+{
+  RemoteObjectConnection* connection = new RemoteObjectConnection();
+  connection->setCompressionEnabled( m_Settings.value("server/compression", true).toBool() );
+  connect( connection->fSocket, SIGNAL(disconnected()), SLOT(disconnected()) );
+  connect( connection->fSocket, SIGNAL(error(QAbstractSocket::SocketError)), SLOT(error(QAbstractSocket::SocketError)) );
+  connect( connection->fSocket, SIGNAL(bytesWritten(qint64)), SLOT(slotStreamFiles()) );
+  connect( connection, SIGNAL(sendFileRawDone()), SLOT(slotStreamFiles()) );
+  connect( connection, SIGNAL(recvCredit()), SLOT(slotStreamFiles()) );
+  connect( connection, SIGNAL(recvVersion()), SLOT(slotVersionKnown()) );
+  connect( connection, SIGNAL(recvStatFileReply(const QString &, const QDateTime &)), SLOT(recvStatFileReply(const QString &, const QDateTime &)) );
+  connect( connection, SIGNAL(recvManifestEntries(const QStringList &, const QVector<qint64> &, const QVector<qint64> &)), SLOT(recvManifestEntries(const QStringList &, const QVector<qint64> &, const QVector<qint64> &)) );
+  connect( connection, SIGNAL(recvManifestEnd(qint64)), SLOT(recvManifestEnd(qint64)) );
+  connect( connection, SIGNAL(recvStatFileBatchReply(quint32, const QVector<qint64> &, const QVector<qint64> &)), SLOT(recvStatFileBatchReply(quint32, const QVector<qint64> &, const QVector<qint64> &)) );
+  connect( connection, SIGNAL(recvSendFileResult(const QString &, const QDateTime &, int)), SLOT(recvSendFileResult(const QString &, const QDateTime &, int)) );
+  connect( connection, SIGNAL(recvSignatureReply(const QString &, const DeltaSignature &)), SLOT(recvSignatureReply(const QString &, const DeltaSignature &)) );
+  connect( connection, SIGNAL(recvHashCheckReply(const QString &, const QDateTime &, bool)), SLOT(recvHashCheckReply(const QString &, const QDateTime &, bool)) );
+  connect( connection, SIGNAL(recvRenameResult(const QString &, const QString &, bool, bool)), SLOT(recvRenameResult(const QString &, const QString &, bool, bool)) );
+  connect( connection, SIGNAL(recvVersionMismatch()), SIGNAL(signalVersionMismatch()) );
+  connect( connection, SIGNAL(recvUnknownPacket()), SIGNAL(signalUnknownPacket()) );
+
+  QString host = m_Settings.value("server/hostname").toString();
+  qint16 port = static_cast<quint16>(m_Settings.value("server/port").toInt());
+
+  qDebug() << "[SyncSystem.Debug] connecting to" << host << port;
+  connection->fSocket->connectToHost( host, port );
+  return connection;
+}
+
 void SyncSystem::reconnectTimer()
 {
   qDebug() << "[SyncSystem.Debug] SyncSystem::reconnectTimer";
@@ -488,26 +1145,85 @@ void SyncSystem::reconnectTimer()
   Q_ASSERT( m_Connection == NULL );
 
   //fWasConnected = false;
-  m_Connection = new RemoteObjectConnection();
-  connect( m_Connection->fSocket, SIGNAL(connected()), SLOT(connected()) );
-  connect( m_Connection->fSocket, SIGNAL(disconnected()), SLOT(disconnected()) );
-  connect( m_Connection->fSocket, SIGNAL(error(QAbstractSocket::SocketError)), SLOT(error(QAbstractSocket::SocketError)) );
-  connect( m_Connection, SIGNAL(recvStatFileReply(const QString &, const QDateTime &)), SLOT(recvStatFileReply(const QString &, const QDateTime &)) );
-  connect( m_Connection, SIGNAL(recvSendFileResult(const QString &, const QDateTime &, int)), SLOT(recvSendFileResult(const QString &, const QDateTime &, int)) );
-  connect( m_Connection, SIGNAL(recvVersionMismatch()), SIGNAL(signalVersionMismatch()) );
-  connect( m_Connection, SIGNAL(recvUnknownPacket()), SIGNAL(signalUnknownPacket()) );
+  m_Connection = createConnection();
+  m_Streams.append(new SyncStream(m_Connection));
+}
 
-  QString host = m_Settings.value("server/hostname").toString();
-  qint16 port = static_cast<quint16>(m_Settings.value("server/port").toInt());
+//////////////////////////////////////////////////////////////////////////
+/// A connection has agreed on the protocol version with the server
+/// 
+/// For the first connection this opens the extra streams of the session
+/// when the server supports them. The sync can start once they have all
+/// joined or given up.
+//////////////////////////////////////////////////////////////////////////
+void SyncSystem::slotVersionKnown()
+{
+  RemoteObjectConnection* connection = qobject_cast<RemoteObjectConnection*>(sender());
+  if(connection != NULL && connection == m_Connection)
+  {
+    int streams = qBound(1, m_Settings.value("server/streams", 4).toInt(), m_Connection->peerMaxStreams());
+    if(streams > 1 && m_Connection->peerSupportsSessions())
+    {
+      m_SessionId = QUuid::createUuid().toRfc4122();
+      m_Connection->sendJoinSession(m_SessionId);
+      for(int i=1; i<streams; ++i)
+      {
+        m_JoiningConnections.append(createConnection());
+      }
+      m_JoinTimer->start();
+      return;
+    }
+    sessionReady();
+  }
+  else if(connection != NULL && m_JoiningConnections.removeOne(connection))
+  {
+    connection->sendJoinSession(m_SessionId);
+    m_Streams.append(new SyncStream(connection));
+    if(m_JoiningConnections.empty())
+      sessionReady();
+  }
+}
 
-  qDebug() << "[SyncSystem.Debug] connecting to" << host << port;
-  m_Connection->fSocket->connectToHost( host, port );
+//////////////////////////////////////////////////////////////////////////
+/// Give up on the extra streams that did not join in time
+//////////////////////////////////////////////////////////////////////////
+void SyncSystem::slotJoinTimeout()
+{
+  if(m_JoiningConnections.empty())
+    return;
+  qWarning() << "[SyncSystem.slotJoinTimeout] " << m_JoiningConnections.size() << " streams did not connect, continuing with " << m_Streams.size();
+  foreach(RemoteObjectConnection* connection, m_JoiningConnections)
+  {
+    destroyConnection(connection);
+  }
+  m_JoiningConnections.clear();
+  sessionReady();
 }
 
-void SyncSystem::connected()
+//////////////////////////////////////////////////////////////////////////
+/// A stream that fails before joining is dropped, the session goes on
+/// without it. Returns true if socket belonged to such a stream
+//////////////////////////////////////////////////////////////////////////
+bool SyncSystem::dropJoiningConnection(QObject* socket)
 {
+  foreach(RemoteObjectConnection* connection, m_JoiningConnections)
+  {
+    if(connection->fSocket == socket)
+    {
+      m_JoiningConnections.removeOne(connection);
+      destroyConnection(connection);
+      if(m_JoiningConnections.empty())
+        sessionReady();
+      return true;
+    }
+  }
+  return false;
+}
+
+void SyncSystem::sessionReady()
+{
+  m_JoinTimer->stop();
   setSyncState(e_Idle);
-  m_BytesInTransit = 0;
 
   if(m_RestartSyncOnReconnect)
   {
@@ -518,12 +1234,16 @@ void SyncSystem::connected()
 
 void SyncSystem::disconnected()
 {
+  if(dropJoiningConnection(sender()))
+    return;
   m_RestartSyncOnReconnect = m_SyncState == e_NodeWatching || m_SyncState == e_Syncing;
   reconnect();
 }
 
 void SyncSystem::error(QAbstractSocket::SocketError)
 {
+  if(dropJoiningConnection(sender()))
+    return;
   m_RestartSyncOnReconnect = m_SyncState == e_NodeWatching || m_SyncState == e_Syncing;
   reconnect();
 }
@@ -533,6 +1253,161 @@ void SyncSystem::recvStatFileReply(const QString &filename, const QDateTime &mti
   //sync has been stopped, ignore what the server is sending
   if(m_SyncState == e_Idle)
     return;
+  resolveFile(filename, mtime, -1);
+  emit signalFileStats(m_FilesResolved, m_FilesPendingStat);
+  updateSyncState();
+}
+
+void SyncSystem::recvStatFileBatchReply(quint32 id, const QVector<qint64> &mtimes, const QVector<qint64> &sizes)
+{
+  //sync has been stopped, ignore what the server is sending
+  if(m_SyncState == e_Idle)
+    return;
+  QMap<quint32, QStringList>::iterator iBatch = m_PendingStatBatches.find(id);
+  if(iBatch == m_PendingStatBatches.end())
+  {
+    qWarning() << "[SyncSystem.Warning] Stat batch " << id << " is not pending, ignoring it";
+    return;
+  }
+  const QStringList& files = iBatch.value();
+  if(mtimes.size() != files.size() || sizes.size() != files.size())
+  {
+    qCritical() << "[SyncSystem.Error]  *** Internal error: stat batch " << id << " has " << mtimes.size() << " replies for " << files.size() << " files";
+    //ask about each file on its own so none of them stays unresolved
+    foreach(const QString& fileName, files)
+    {
+      m_Connection->sendStatFileReq(fileName);
+    }
+    m_PendingStatBatches.erase(iBatch);
+    return;
+  }
+
+  for(int i = 0; i < files.size(); ++i)
+  {
+    QDateTime mtime;
+    if(mtimes.at(i) >= 0)
+      mtime = QDateTime::fromMSecsSinceEpoch(mtimes.at(i));
+    resolveFile(files.at(i), mtime, sizes.at(i));
+  }
+  m_PendingStatBatches.erase(iBatch);
+  emit signalFileStats(m_FilesResolved, m_FilesPendingStat);
+  updateSyncState();
+}
+
+void SyncSystem::recvManifestEntries(const QStringList &paths, const QVector<qint64> &mtimes, const QVector<qint64> &sizes)
+{
+  //sync has been stopped, ignore what the server is sending
+  if(m_SyncState == e_Idle || !m_UseManifest)
+    return;
+  if(mtimes.size() != paths.size() || sizes.size() != paths.size())
+  {
+    qCritical() << "[SyncSystem.Error]  *** Internal error: manifest batch has " << mtimes.size() << " entries for " << paths.size() << " paths";
+    return;
+  }
+  for(int i = 0; i < paths.size(); ++i)
+  {
+    ManifestEntry& entry = m_Manifest[paths.at(i)];
+    entry.m_Mtime = mtimes.at(i);
+    entry.m_Size = sizes.at(i);
+  }
+}
+
+void SyncSystem::recvManifestEnd(qint64 count)
+{
+  //sync has been stopped, ignore what the server is sending
+  if(m_SyncState == e_Idle || !m_UseManifest)
+    return;
+  qInformation() << "[SyncSystem.recvManifestEnd] Server has " << count << " files in " << m_CurrentDestinationPath;
+  m_ManifestComplete = true;
+
+  //Resolve everything scanned so far, the rest is resolved as it is scanned
+  QStringList scanned = m_UnresolvedFiles.keys();
+  foreach(const QString& fileName, scanned)
+  {
+    resolveFromManifest(fileName);
+  }
+  for(QHash<QString, CachedFile>::const_iterator iCached = m_CachedFiles.begin(); iCached != m_CachedFiles.end(); ++iCached)
+  {
+    checkCachedFile(iCached.key(), iCached.value().m_ServerMtime, iCached.value().m_Binary, iCached.value().m_Executable);
+  }
+  m_CachedFiles.clear();
+  finishManifest();
+  emit signalFileStats(m_FilesResolved, m_FilesPendingStat);
+  updateSyncState();
+}
+
+void SyncSystem::resolveFromManifest(const QString &fileName)
+{
+  QHash<QString, ManifestEntry>::const_iterator iEntry = m_Manifest.find(fileName);
+  if(iEntry == m_Manifest.end())
+    resolveFile(fileName, QDateTime(), -1);
+  else
+    resolveFile(fileName, QDateTime::fromMSecsSinceEpoch(iEntry.value().m_Mtime), iEntry.value().m_Size);
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Checks a file the scan cache resolved against the manifest. The file 
+/// is sent again when the server no longer has it or its mtime is not 
+/// the one the server confirmed last session.
+//////////////////////////////////////////////////////////////////////////
+void SyncSystem::checkCachedFile(const QString &fileName, qint64 serverMtime, bool binary, bool executable)
+{
+  QHash<QString, ManifestEntry>::const_iterator iEntry = m_Manifest.find(fileName);
+  if(iEntry != m_Manifest.end() && qAbs(iEntry.value().m_Mtime - serverMtime) <= 1000)
+    return;
+
+  qDebug() << "[SyncSystem.checkCachedFile] Changed on the server since the last session: " << fileName;
+  m_ScanCache.remove(fileName);
+  addTodo(fileName, binary, executable, false);
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Called when either the manifest or the scan completes. When both are
+/// done the files only the server has are reported, and deleted if the 
+/// server/deleteServerOnlyFiles setting is set and the rules include them.
+//////////////////////////////////////////////////////////////////////////
+void SyncSystem::finishManifest()
+{
+  if(!m_UseManifest || !m_ManifestComplete || m_Scanner != NULL)
+    return;
+
+  bool deleteServerOnly = m_Settings.value("server/deleteServerOnlyFiles", false).toBool();
+  int serverOnly = 0;
+  for(QHash<QString, ManifestEntry>::const_iterator iEntry = m_Manifest.begin(); iEntry != m_Manifest.end(); ++iEntry)
+  {
+    const QString& fileName = iEntry.key();
+    if(m_Files.contains(fileName) || fileName.endsWith("syncrules.xml"))
+      continue;
+
+    SyncRuleFlags_e eFlags;
+    if(!checkPathRules(fileName, eFlags))
+      continue; //Not something we sync, leave it alone
+
+    serverOnly++;
+    if(deleteServerOnly)
+    {
+      bool binary = ((eFlags & e_Binary) == e_Binary);
+      bool executable = ((eFlags & e_Executable) == e_Executable);
+      addTodo(fileName, binary, executable, true);
+    }
+    else
+    {
+      qDebug() << "[SyncSystem.finishManifest] Only on server: " << fileName;
+    }
+  }
+  qInformation() << "[SyncSystem.finishManifest] " << serverOnly << " files only exist on the server";
+
+  m_Manifest.clear();
+  m_CachedFiles.clear();
+  m_UseManifest = false;
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Compare what the server has with the scanned file and add a todo if it
+/// needs to be sent. A size of -1 means the server did not report it.
+//////////////////////////////////////////////////////////////////////////
+void SyncSystem::resolveFile(const QString &filename, const QDateTime &mtime, qint64 size)
+{
   //find the unresolved file in the map
   QMap<QString,ScannerBase::FileInfo>::iterator iUnresolved = m_UnresolvedFiles.find( filename );
   if( iUnresolved == m_UnresolvedFiles.end() )
@@ -542,15 +1417,20 @@ void SyncSystem::recvStatFileReply(const QString &filename, const QDateTime &mti
   }
 
   //check if the mtimes are similar (cant do exact comparison due to different OSes having somewhat different resolutions)
-  if(!mtime.isValid() ||  abs(iUnresolved.value().mtime.secsTo(mtime)) > 1 ) 
+  //the size can only be compared for binary files, text files lose their \r on the way
+  bool sizeDiffers = size >= 0 && iUnresolved.value().binary && size != iUnresolved.value().size;
+  if(!mtime.isValid() ||  abs(iUnresolved.value().mtime.secsTo(mtime)) > 1 || sizeDiffers)
   {
+    m_ScanCache.remove(filename);
     addTodo(filename, iUnresolved.value().binary, iUnresolved.value().executable, false);
   }
+  else
+  {
+    m_ScanCache.insert(filename, iUnresolved.value().mtime.toMSecsSinceEpoch(), iUnresolved.value().size, mtime.toMSecsSinceEpoch());
+  }
 
   m_UnresolvedFiles.erase( iUnresolved );
   m_FilesResolved++;
-  emit signalFileStats(m_FilesResolved, m_FilesPendingStat);
-  updateSyncState();
 }
 
 void SyncSystem::recvSendFileResult(const QString &filename, const QDateTime &mtime, int result)
@@ -562,6 +1442,7 @@ void SyncSystem::recvSendFileResult(const QString &filename, const QDateTime &mt
   if( !result )
   {
     m_FileErrors++;
+    m_ScanCache.remove(filename);
     qWarning() << "[SyncSystem.sendFile] copy of file failed: " << filename;
     SyncRuleFlags_e flags = e_NoFlags;
     if(GetSyncRulesForPath(filename)->CheckFile(filename.toLower(), flags))
@@ -578,7 +1459,7 @@ void SyncSystem::recvSendFileResult(const QString &filename, const QDateTime &mt
     Q_ASSERT(erase != m_NameToInfo.end());
     if(erase != m_NameToInfo.end())
     {
-      m_BytesInTransit -= erase.value().m_Size;
+      m_ScanCache.insert(filename, erase.value().m_Mtime.toMSecsSinceEpoch(), erase.value().m_Size, mtime.toMSecsSinceEpoch());
       m_NameToInfo.erase(erase);
       emit signalFileStatus(filename, mtime, true);
     }
@@ -605,12 +1486,20 @@ void SyncSystem::stopNodeWatching()
   //Empty the list of deleted pointers
   m_FileSystemWatchers.clear();
 
+  resetStreams();
   m_NameToInfo.clear();
+  m_HashJobs.clear();
   m_Files.clear();
+  m_PendingRenames.clear();
+  m_SentDeletes.clear();
 }
 
 void SyncSystem::stopFullSync()
 {
+  m_PendingStatBatches.clear();
+  m_Manifest.clear();
+  m_CachedFiles.clear();
+  m_UseManifest = false;
   m_ScanDirTimer->stop();
   m_SyncUpdateTimer->stop();
   delete m_Scanner;
@@ -635,6 +1524,8 @@ void SyncSystem::setSyncState(SyncSystemState state)
     break;
   }
   m_SyncState = state;
+  if(m_SyncState == e_NodeWatching)
+    m_ScanCache.save(m_Files);
   emit signalStateChanged(m_SyncState);
 }
 
@@ -699,7 +1590,7 @@ void SyncSystem::addTodo(const QString& fileName, bool binary, bool executable,
     }
     else
     {
-      m_Files.erase(m_Files.find(fileName));
+      m_Files.remove(fileName);
     }
   }
   else
@@ -722,6 +1613,8 @@ void SyncSystem::addTodo(const QString& fileName, bool binary, bool executable,
       i.value().m_Delete = deletefile;
       i.value().m_Time = syncTime;
       i.value().m_Mtime = lastModified;
+      i.value().m_Size = fileinfo.size();
+      i.value().m_HashChecked = false;
       if(retry)
       {
         i.value().m_Retries++;
@@ -739,38 +1632,50 @@ void SyncSystem::slotSyncUpdate()
   if(m_Scanner)
     return; //Dont start copying files until the stats are done
 
-  static int maxSize = 1<<25; //32MB
-  if(m_BytesInTransit >= maxSize)
-    return; //Too much data in memory already, lets not add more
-
   QTime currentTime = QTime::currentTime();
   QMap<QString, FileTodo>::iterator todo = m_NameToInfo.begin();
   for(; todo != m_NameToInfo.end();)
   {
     if(currentTime >= todo.value().m_Time)
     {
-      if(todo.value().m_Delete)
+      if(!todo.value().m_Started && isRenamePending(todo.key()))
+      {
+        //Wait for the server to move the path so the change is applied after the rename
+        ++todo;
+      }
+      else if(todo.value().m_Delete)
       {
         todo.value().m_Started = true;
-        m_Connection->sendDeleteFile(todo.key());
+        m_ScanCache.remove(todo.key());
+        connectionFor(todo.key())->sendDeleteFile(todo.key());
+        m_SentDeletes.insert(todo.key());
         emit signalFileAction(todo.key(), todo.value().m_Mtime, true);
         todo = m_NameToInfo.erase(todo);
 
         m_FilesDeleted++;
         emit signalFilesDeleted(m_FilesDeleted);
       }
+      else if(!todo.value().m_Started && !todo.value().m_HashChecked && todo.value().m_Retries == 0 &&
+              todo.value().m_Size >= s_HashCheckMinSize && m_Connection->peerSupportsHashCheck())
+      {
+        //recvHashCheckReply either finishes the todo or clears m_Started so it is sent
+        todo.value().m_Started = true;
+        todo.value().m_HashChecked = true;
+        startHashCheck(todo.value());
+        ++todo;
+      }
+      else if(!todo.value().m_Started && connectionFor(todo.key())->sendWindow() <= 0)
+      {
+        //The connection of this file has a full window, the timer tries again
+        ++todo;
+      }
       else if(!todo.value().m_Started)
       {
         todo.value().m_Started = true;
         //sendFile can modify m_NameToInfo and cause a crash here, but im to lazy to handle it right now
-        sendFile(todo.key(), todo.value().m_Binary, todo.value().m_Executable);
+        //Retries are sent whole in case the delta is what failed
+        sendFile(todo.key(), todo.value().m_Binary, todo.value().m_Executable, todo.value().m_Retries == 0);
         emit signalFileAction(todo.key(), todo.value().m_Mtime, false);
-        if(todo.value().m_Retries == 0)
-        {
-          m_BytesInTransit += todo.value().m_Size;
-          if(m_BytesInTransit >= maxSize)
-            break; //With this file we went above max in memory size, so break out of the loop 
-        }
         ++todo;
       }
       else
@@ -783,6 +1688,8 @@ void SyncSystem::slotSyncUpdate()
       ++todo;
     }
   }
+  slotStreamFiles();
+
   if(m_NameToInfo.empty())
     m_SyncUpdateTimer->stop();
 
@@ -816,4 +1723,47 @@ QSharedPointer<SyncRules> SyncSystem::GetSyncRulesForPath(const QString& path)
     }
   }
   return m_SyncRules;
-}
\ No newline at end of file
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Same result as GetSyncRulesForPath(path)->CheckFileAndPath(path)
+/// 
+/// The checks of the parent directories are cached per directory, so an
+/// event in a deep directory costs one rule check for the file itself.
+//////////////////////////////////////////////////////////////////////////
+bool SyncSystem::checkPathRules(const QString& path, SyncRuleFlags_e& flags)
+{
+  //A rule file was touched, until the next scan loads it the rules are what they were but the
+  //verdicts are dropped to not keep any that were made against an old rule file
+  if(path.endsWith("syncrules.xml"))
+    clearDirVerdicts();
+
+  static const int s_MaxDirVerdicts = 4096;
+  int pos = path.lastIndexOf('/');
+  QString dir = pos > 0 ? path.left(pos) : QString();
+  auto i = m_DirVerdicts.find(dir);
+  if(i == m_DirVerdicts.end())
+  {
+    if(m_DirVerdicts.size() >= s_MaxDirVerdicts)
+      m_DirVerdicts.clear();
+
+    DirVerdict verdict;
+    verdict.m_Rules = GetSyncRulesForPath(path);
+    //CheckFileAndPath checks every prefix of the path after the "./"
+    SyncRuleFlags_e dirFlags;
+    verdict.m_Included = pos < 2 || verdict.m_Rules->CheckFileAndPath(dir.toLower(), dirFlags);
+    i = m_DirVerdicts.insert(dir, verdict);
+  }
+
+  if(!i.value().m_Included)
+  {
+    flags = e_NoFlags;
+    return false;
+  }
+  return i.value().m_Rules->CheckFile(path.toLower(), flags);
+}
+
+void SyncSystem::clearDirVerdicts()
+{
+  m_DirVerdicts.clear();
+}
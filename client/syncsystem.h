@@ -4,14 +4,16 @@
 #include "scannerbase.h"
 #include "remoteobjectconnection.h"
 #include "syncrules.h"
+#include "contenthash.h"
+#include "scancache.h"
 
 class FileSystemWatcher;
 
 struct FileTodo
 {
-  FileTodo() : m_Binary(false), m_Executable(false), m_Delete(false), m_Retries(0), m_Started(false), m_Size(0) {}
+  FileTodo() : m_Binary(false), m_Executable(false), m_Delete(false), m_Retries(0), m_Started(false), m_HashChecked(false), m_Size(0) {}
   FileTodo(const QString file, bool binary, bool executable, QTime time, bool deletefile, QDateTime mtime, qint64 size) :
-  m_Filename(file), m_Binary(binary), m_Executable(executable), m_Time(time), m_Delete(deletefile), m_Mtime(mtime), m_Retries(0), m_Started(false), m_Size(size) {}
+  m_Filename(file), m_Binary(binary), m_Executable(executable), m_Time(time), m_Delete(deletefile), m_Mtime(mtime), m_Retries(0), m_Started(false), m_HashChecked(false), m_Size(size) {}
   QString m_Filename;
   bool m_Binary;
   bool m_Executable;
@@ -21,9 +23,72 @@ struct FileTodo
   bool m_Delete;
   int m_Retries;
   bool m_Started;
+  // true once the server has been asked to compare content hashes, a mismatch sends the file as usual
+  bool m_HashChecked;
   qint64 m_Size;
 };
 
+//A file waiting to be streamed to the server in chunks or for the signature to diff against
+struct StreamTodo
+{
+  StreamTodo() : m_Binary(false), m_Executable(false) {}
+  StreamTodo(const QString& file, bool binary, bool executable) : m_Filename(file), m_Binary(binary), m_Executable(executable) {}
+  QString m_Filename;
+  bool m_Binary;
+  bool m_Executable;
+};
+
+//One connection of the session. Each file is sent on the stream picked from its name so the packets for a file stay in order
+struct SyncStream
+{
+  SyncStream(RemoteObjectConnection* connection) : m_Connection(connection), m_StreamFile(NULL), m_DeltaFile(NULL), m_DeltaData(NULL), m_Delta(NULL) {}
+  RemoteObjectConnection* m_Connection;
+
+  //Large files are streamed one at a time per connection, chunks are read from disk as the socket drains
+  QList<StreamTodo> m_StreamQueue;
+  StreamTodo m_StreamCurrent;
+  QFile* m_StreamFile;
+
+  //Deltas are computed a chunk at a time as the socket drains, in between the streamed files
+  QList<QPair<StreamTodo, DeltaSignature> > m_DeltaQueue;
+  StreamTodo m_DeltaCurrent;
+  QFile* m_DeltaFile;
+  uchar* m_DeltaData;
+  DeltaComputer* m_Delta;
+};
+
+//Hashes a file on the global thread pool for a hash check, finished() arrives on the thread that started it
+class HashJob : public QObject, public QRunnable
+{
+  Q_OBJECT
+public:
+  HashJob(const QString& filename, const QString& path, bool binary, const QDateTime& todoMtime);
+
+  const QString& filename() const { return m_Filename; }
+  const QString& path() const { return m_Path; }
+  //mtime of the todo when the job was started, the todo may have changed since
+  const QDateTime& todoMtime() const { return m_TodoMtime; }
+  //mtime in ms and size of the file that was hashed
+  qint64 mtime() const { return m_Mtime; }
+  qint64 size() const { return m_Size; }
+  //empty when the file could not be hashed
+  const QByteArray& hash() const { return m_Hash; }
+
+  virtual void run();
+
+signals:
+  void finished();
+
+private:
+  QString m_Filename;
+  QString m_Path;
+  bool m_Binary;
+  QDateTime m_TodoMtime;
+  qint64 m_Mtime;
+  qint64 m_Size;
+  QByteArray m_Hash;
+};
+
 class SyncSystem : public QObject
 {
   Q_OBJECT
@@ -36,8 +101,12 @@ public:
 protected:
 
   void reconnect(int delay=1000);
-  void sendFile(const QString &filename, bool binary, bool executable);
+  void sendFile(const QString &filename, bool binary, bool executable, bool allowDelta);
+  void startHashCheck(const FileTodo &todo);
+  void sendHashCheck(const FileTodo &todo, qint64 size, const QByteArray &hash);
   void scanComplete();
+  bool startDelta(SyncStream* stream);
+  void finishDelta(SyncStream* stream);
 
 signals:
   void signalDirsScanned(int dirsFinished, int dirsKnown, int dirsIgnored); 
@@ -70,15 +139,24 @@ private slots:
   void slotFilewatchError(QString file);
 
   void reconnectTimer();
-  void connected();
+  void slotVersionKnown();
+  void slotJoinTimeout();
   void disconnected();
   void error(QAbstractSocket::SocketError);
 
   void recvStatFileReply(const QString &, const QDateTime &);
+  void recvStatFileBatchReply(quint32, const QVector<qint64> &, const QVector<qint64> &);
+  void recvManifestEntries(const QStringList &, const QVector<qint64> &, const QVector<qint64> &);
+  void recvManifestEnd(qint64);
   void recvSendFileResult(const QString &, const QDateTime &, int);
+  void recvRenameResult(const QString &oldName, const QString &newName, bool directory, bool result);
+  void recvSignatureReply(const QString &, const DeltaSignature &);
+  void recvHashCheckReply(const QString &, const QDateTime &, bool);
+  void slotFileHashed();
 
   void slotScanDir();
   void slotSyncUpdate();
+  void slotStreamFiles();
 
 public slots:
   void started();
@@ -90,16 +168,53 @@ private:
   void setSyncState(SyncSystemState state);
   void updateSyncState();
   void resetStats();
+  void resetStreams();
+  void feedStream(SyncStream* stream);
+  RemoteObjectConnection* createConnection();
+  void destroyConnection(RemoteObjectConnection* connection);
+  void closeSession();
+  void sessionReady();
+  bool dropJoiningConnection(QObject* socket);
+  SyncStream* streamFor(const QString& filename) const;
+  RemoteObjectConnection* connectionFor(const QString& filename) const { return streamFor(filename)->m_Connection; }
   void addTodo(const QString& fileName, bool binary, bool executable, bool deletefile, bool retry=false);
+  void resolveFile(const QString& fileName, const QDateTime& mtime, qint64 size);
+  void resolveFromManifest(const QString& fileName);
+  void checkCachedFile(const QString& fileName, qint64 serverMtime, bool binary, bool executable);
+  void finishManifest();
   void writeFileList();
   bool checkForRescan(const QString& name);
+  bool sendRename(const QString& oldName, const QString& newName, bool directory);
+  bool canRenameDirectory(const QString& oldName, const QString& newName);
+  bool isRenamePending(const QString& name) const;
   QSharedPointer<SyncRules> GetSyncRulesForPath(const QString& path);
+  bool checkPathRules(const QString& path, SyncRuleFlags_e& flags);
+  void clearDirVerdicts();
+  //The first connection of the session, it carries everything that is not tied to a single file
   RemoteObjectConnection *m_Connection;
+  //All connections of the session including m_Connection, files are spread over them
+  QList<SyncStream*> m_Streams;
+  //Extra connections that have not agreed on the version and joined the session yet
+  QList<RemoteObjectConnection*> m_JoiningConnections;
+  QByteArray m_SessionId;
+  QTimer* m_JoinTimer;
 
   SyncSystemState m_SyncState;
 
   QList<FileSystemWatcher*> m_FileSystemWatchers;
   QMap<QString, ScannerBase::FileInfo> m_UnresolvedFiles;
+  //Batched stat requests waiting for a reply, the full file names in the order they were sent
+  QMap<quint32, QStringList> m_PendingStatBatches;
+  quint32 m_NextStatBatchId;
+
+  //The destination tree as reported by the server, replaces the stat requests when the server supports it
+  struct ManifestEntry { qint64 m_Mtime; qint64 m_Size; };
+  QHash<QString, ManifestEntry> m_Manifest;
+  //Files the scan cache resolved before the manifest was complete, with the server mtime it had for them
+  struct CachedFile { qint64 m_ServerMtime; bool m_Binary; bool m_Executable; };
+  QHash<QString, CachedFile> m_CachedFiles;
+  bool m_UseManifest;
+  bool m_ManifestComplete;
 
   ScannerBase* m_Scanner;
 
@@ -107,6 +222,10 @@ private:
   QSet<QString> m_Files;
   QSharedPointer<SyncRules> m_SyncRules;
   QMap<QString, QSharedPointer<SyncRules> > m_PathRules;
+  //Directories files were checked in, with the rules that apply to their files and whether the
+  //directory and all its parents are synced. Cleared when the rules may have changed
+  struct DirVerdict { QSharedPointer<SyncRules> m_Rules; bool m_Included; };
+  QHash<QString, DirVerdict> m_DirVerdicts;
   QSettings m_Settings;
 
   QTimer* m_ReconnectTimer;
@@ -133,7 +252,22 @@ private:
   int m_FileErrors;
   int m_FilesDeleted;
 
-  quint64 m_BytesInTransit;
+  //Renames sent to the server and not answered yet, todos below these paths wait for the result
+  QList<QPair<QString, QString> > m_PendingRenames;
+  //Deletes sent since the sync started, the server does not confirm them so a directory rename on another
+  //connection could overtake them
+  QSet<QString> m_SentDeletes;
+
+  //Modified binary files waiting for the server's block signatures
+  QMap<QString, StreamTodo> m_DeltaPending;
+
+  //Content hashes of local files, keyed by mtime and size so they are recomputed when the file changes
+  ContentHashCache m_HashCache;
+  //The hash job running for a todo, results of jobs that are no longer here are ignored
+  QHash<QString, HashJob*> m_HashJobs;
+
+  //What was in sync when the branch was last watched, files that did not change locally since are not asked about
+  ScanCache m_ScanCache;
 
 };
 
@@ -0,0 +1,382 @@
+#include "diskqueue.h"
+#include "shared/contenthash.h"
+#include "metadataindex.h"
+#include <QtCore/QAtomicInt>
+#include <QtCore/QDirIterator>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+//-----------------------------------------------------------------------------
+
+static const char s_TempPrefix[] = ".qstemp-";
+
+//! Removes what crashed servers left behind in a target directory
+class SweepJob : public DiskJob
+{
+public:
+  SweepJob( const QString &dir ) : DiskJob( dir, QString(), QDateTime() ) {}
+
+protected:
+  virtual bool changesFiles() const { return false; }
+
+  virtual bool execute()
+  {
+    QDirIterator it( path(), QStringList() << QString(s_TempPrefix) + "*", QDir::Files | QDir::Hidden | QDir::System, QDirIterator::Subdirectories );
+    while( it.hasNext() )
+    {
+      it.next();
+      //.qstemp-<pid>-<n>, the files of running servers are still being written
+      pid_t pid = it.fileName().section( '-', 1, 1 ).toInt();
+      if( pid <= 0 || pid == ::getpid() || ::kill(pid, 0) == 0 || errno == EPERM )
+        continue;
+      qDebug() << "Removing the leftover " << it.filePath();
+      QFile::remove( it.filePath() );
+    }
+    return true;
+  }
+};
+
+//! Runs the group commits of the queue
+class GroupCommitThread : public QThread
+{
+protected:
+  virtual void run() { DiskQueue::instance()->runGroupCommits(); }
+};
+
+// Renames a committed temporary file to its target
+static bool renameFile( const QString &temp, const QString &path )
+{
+  if( ::rename(QFile::encodeName(temp).constData(), QFile::encodeName(path).constData()) != 0 )
+  {
+    qWarning() << "Could not rename \"" << temp << "\" to \"" << path << "\": " << strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+//-----------------------------------------------------------------------------
+
+DiskJob::DiskJob( const QString &path, const QString &filename, const QDateTime &mtime ) :
+  fPath( path ),
+  fPaths( path ),
+  fDirectory( false ),
+  fFilename( filename ),
+  fMtime( mtime ),
+  fResult( false ),
+  fHashedMtime( 0 ),
+  fHashedSize( 0 ),
+  fBlockers( 0 ),
+  fCommitFd( -1 )
+{
+  setAutoDelete( false );
+  connect( this, SIGNAL(finished()), SLOT(deleteLater()) );
+}
+
+void DiskJob::run()
+{
+  fResult = execute();
+  if( fCommitFd >= 0 )
+  {
+    if( fResult )
+    {
+      //finished by the group commit once the file is synced and renamed
+      DiskQueue::instance()->queueGroupCommit( this );
+      return;
+    }
+    ::close( fCommitFd );
+    fCommitFd = -1;
+    QFile::remove( fCommitTemp );
+  }
+  finish();
+}
+
+void DiskJob::finish()
+{
+  //the index has the change before the result goes out, the inotify event may come later
+  if( changesFiles() )
+    MetadataIndex::instance()->refresh( fPath );
+  //the jobs waiting for this one start after finished() so the results stay in order, the job
+  //may be deleted as soon as finished() is delivered
+  QList<DiskJob*> ready = DiskQueue::instance()->jobDone( this );
+  emit finished();
+  DiskQueue::instance()->startJobs( ready );
+}
+
+void DiskJob::hashContent( const QString &file, qint64 minSize )
+{
+  QFileInfo fileInfo( file );
+  if( !fileInfo.isFile() || fileInfo.size() < minSize )
+    return;
+
+  qint64 hashedSize;
+  QByteArray hash = ContentHasher::hashFile( file, false, hashedSize );
+  if( !hash.isEmpty() && hashedSize == fileInfo.size() )
+  {
+    fHash = hash;
+    fHashedMtime = fileInfo.lastModified().toMSecsSinceEpoch();
+    fHashedSize = hashedSize;
+  }
+}
+
+void DiskJob::setHash( const QByteArray &hash, qint64 mtime, qint64 size )
+{
+  fHash = hash;
+  fHashedMtime = mtime;
+  fHashedSize = size;
+}
+
+bool DiskJob::commit( QFile &file )
+{
+  return DiskQueue::instance()->commit( this, file );
+}
+
+//-----------------------------------------------------------------------------
+
+DiskQueue::DiskQueue() :
+  fDurability( DurabilityNone ),
+  fGroupInterval( 0 ),
+  fSyncThread( NULL )
+{
+  //the threads mostly wait for the disk, more of them keep more requests in flight
+  fPool.setMaxThreadCount( qMax(4, QThread::idealThreadCount()) );
+}
+
+DiskQueue *DiskQueue::instance()
+{
+  static DiskQueue s_Queue;
+  return &s_Queue;
+}
+
+bool DiskQueue::setDurability( const QString &setting )
+{
+  if( setting == "none" || setting == "file" )
+  {
+    fDurability = setting == "none" ? DurabilityNone : DurabilityFile;
+  }
+  else if( setting.startsWith("group=") )
+  {
+    bool ok;
+    int interval = setting.mid( 6 ).toInt( &ok );
+    if( !ok || interval < 0 )
+      return false;
+    fDurability = DurabilityGroup;
+    fGroupInterval = interval;
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+// With group and file the data is synced before the rename, a crash then leaves either the old or
+// the complete new file. fdatasync() skips the mtime, if it is lost the client sees an old file and
+// sends it again. With none only the rename is atomic, the data may not have reached the disk
+bool DiskQueue::commit( DiskJob *job, QFile &file )
+{
+  file.flush();
+  if( fDurability == DurabilityGroup )
+  {
+    //the job keeps a descriptor of its own, the file is closed when execute() returns
+    job->fCommitFd = ::dup( file.handle() );
+    if( job->fCommitFd < 0 )
+    {
+      qWarning() << "Could not keep \"" << file.fileName() << "\" for the group commit: " << strerror(errno);
+      return false;
+    }
+    job->fCommitTemp = file.fileName();
+    return true;
+  }
+
+  if( fDurability == DurabilityFile && ::fdatasync(file.handle()) != 0 )
+  {
+    qWarning() << "Could not sync \"" << file.fileName() << "\": " << strerror(errno);
+    return false;
+  }
+  if( !renameFile(file.fileName(), job->path()) )
+    return false;
+
+  if( fDurability == DurabilityFile )
+  {
+    //the new directory entry, not needed for consistency but the client is told the file is safe
+    int dirfd = ::open( QFile::encodeName(job->path().section('/', 0, -2)).constData(), O_RDONLY | O_DIRECTORY );
+    if( dirfd >= 0 )
+    {
+      ::fsync( dirfd );
+      ::close( dirfd );
+    }
+  }
+  return true;
+}
+
+void DiskQueue::queueGroupCommit( DiskJob *job )
+{
+  QMutexLocker lock( &fSyncMutex );
+  if( !fSyncThread )
+  {
+    fSyncThread = new GroupCommitThread();
+    fSyncThread->start();
+  }
+  fSyncJobs.append( job );
+  fSyncWake.wakeOne();
+}
+
+// Group commit: the first file of a group waits for the interval so others can join, then one
+// syncfs() per file system covers all of them. Each file is renamed once its file system is synced
+// and its job finishes from here. Files arriving during the sync go to the next group
+void DiskQueue::runGroupCommits()
+{
+  QMutexLocker lock( &fSyncMutex );
+  for( ;; )
+  {
+    while( fSyncJobs.isEmpty() )
+      fSyncWake.wait( &fSyncMutex );
+    lock.unlock();
+    QThread::msleep( fGroupInterval );
+    lock.relock();
+    QList<DiskJob*> jobs;
+    jobs.swap( fSyncJobs );
+    lock.unlock();
+
+    QHash<dev_t, bool> synced;
+    foreach( DiskJob *job, jobs )
+    {
+      struct stat info;
+      if( ::fstat(job->fCommitFd, &info) != 0 || synced.contains(info.st_dev) )
+        continue;
+      synced.insert( info.st_dev, ::syncfs(job->fCommitFd) == 0 );
+    }
+
+    foreach( DiskJob *job, jobs )
+    {
+      struct stat info;
+      bool result = ::fstat(job->fCommitFd, &info) == 0 && synced.value(info.st_dev);
+      if( !result )
+        qWarning() << "Could not sync \"" << job->fCommitTemp << "\"";
+      result = result && renameFile( job->fCommitTemp, job->path() );
+      ::close( job->fCommitFd );
+      job->fCommitFd = -1;
+      if( !result )
+      {
+        QFile::remove( job->fCommitTemp );
+        job->fResult = false;
+      }
+      job->finish();
+    }
+    lock.relock();
+  }
+}
+
+QString DiskQueue::tempPath( const QString &path )
+{
+  static QAtomicInt s_Counter;
+  int slash = path.lastIndexOf( '/' );
+  return path.left( slash + 1 ) + s_TempPrefix + QString::number( ::getpid() ) + '-' + QString::number( s_Counter.fetchAndAddRelaxed(1) );
+}
+
+bool DiskQueue::isTempPath( const QString &path )
+{
+  return path.mid( path.lastIndexOf('/') + 1 ).startsWith( s_TempPrefix );
+}
+
+void DiskQueue::sweep( const QString &dir )
+{
+  QString absolute = QDir( dir ).absolutePath();
+  {
+    QMutexLocker lock( &fMutex );
+    if( fSwept.contains(absolute) )
+      return;
+    fSwept.insert( absolute );
+  }
+  start( new SweepJob(absolute) );
+}
+
+void DiskQueue::start( DiskJob *job )
+{
+  QMutexLocker lock( &fMutex );
+  QSet<DiskJob*> before;
+  foreach( DiskJob *directoryJob, fDirectoryJobs )
+  {
+    if( overlaps(job, directoryJob) )
+      before.insert( directoryJob );
+  }
+  foreach( const QString &path, job->paths() )
+  {
+    if( job->isDirectory() )
+    {
+      //everything queued below the directory, one scan when the job is queued
+      QString prefix = path + '/';
+      for( QHash<QString, DiskJob*>::const_iterator i = fTails.constBegin(); i != fTails.constEnd(); ++i )
+      {
+        if( i.key() == path || i.key().startsWith(prefix) )
+          before.insert( i.value() );
+      }
+    }
+    else
+    {
+      DiskJob *tail = fTails.value( path );
+      if( tail && tail != job )
+        before.insert( tail );
+      fTails.insert( path, job );
+    }
+  }
+  if( job->isDirectory() )
+    fDirectoryJobs.append( job );
+
+  job->fBlockers = before.size();
+  foreach( DiskJob *other, before )
+    other->fWaiters.append( job );
+  if( job->fBlockers == 0 )
+    fPool.start( job );
+}
+
+// Called on the pool thread when a job is done, returns the jobs that were only waiting for it
+QList<DiskJob*> DiskQueue::jobDone( DiskJob *job )
+{
+  QMutexLocker lock( &fMutex );
+  foreach( const QString &path, job->paths() )
+  {
+    QHash<QString, DiskJob*>::iterator i = fTails.find( path );
+    if( i != fTails.end() && i.value() == job )
+      fTails.erase( i );
+  }
+  fDirectoryJobs.removeOne( job );
+
+  QList<DiskJob*> ready;
+  foreach( DiskJob *waiter, job->fWaiters )
+  {
+    if( --waiter->fBlockers == 0 )
+      ready.append( waiter );
+  }
+  job->fWaiters.clear();
+  return ready;
+}
+
+void DiskQueue::startJobs( const QList<DiskJob*> &jobs )
+{
+  foreach( DiskJob *job, jobs )
+    fPool.start( job );
+}
+
+// True when one of the jobs works on a path of the other one or below one of its directories
+bool DiskQueue::overlaps( const DiskJob *a, const DiskJob *b )
+{
+  foreach( const QString &pathA, a->paths() )
+  {
+    foreach( const QString &pathB, b->paths() )
+    {
+      if( pathA == pathB ||
+          (a->isDirectory() && pathB.startsWith(pathA + '/')) ||
+          (b->isDirectory() && pathA.startsWith(pathB + '/')) )
+        return true;
+    }
+  }
+  return false;
+}
+
+//-----------------------------------------------------------------------------
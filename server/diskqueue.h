@@ -0,0 +1,154 @@
+#ifndef QUICKSYNC_DISKQUEUE_H
+#define QUICKSYNC_DISKQUEUE_H
+
+#include <QtCore/QRunnable>
+#include <QtCore/QSet>
+#include <QtCore/QThreadPool>
+#include <QtCore/QWaitCondition>
+
+//-----------------------------------------------------------------------------
+// Filesystem work of the server runs on a thread pool so the event loop keeps
+// answering while big files are written. Jobs on the same path run one after
+// the other in the order they were queued, a job on a directory is ordered
+// with everything below it.
+//-----------------------------------------------------------------------------
+
+//! A piece of filesystem work on one or more paths. finished() is emitted once execute() has
+//! returned, connected to the thread that created the job, and the job deletes itself after that.
+//! Results of jobs on the same path arrive in the order the jobs were queued
+class DiskJob : public QObject, public QRunnable
+{
+  Q_OBJECT
+public:
+  //! path is the absolute path the job works on, filename and mtime are what the client sent
+  DiskJob( const QString &path, const QString &filename, const QDateTime &mtime );
+
+  const QString &path() const { return fPath; }
+  //! All paths the job is ordered on, path() first
+  const QStringList &paths() const { return fPaths; }
+  bool isDirectory() const { return fDirectory; }
+  const QString &filename() const { return fFilename; }
+  const QDateTime &mtime() const { return fMtime; }
+  bool result() const { return fResult; }
+
+  //! Content hash of the file when the job hashed it, empty otherwise
+  const QByteArray &hash() const { return fHash; }
+  qint64 hashedMtime() const { return fHashedMtime; }
+  qint64 hashedSize() const { return fHashedSize; }
+
+  virtual void run();
+
+signals:
+  void finished();
+
+protected:
+  //! Does the work on a pool thread, the return value is result()
+  virtual bool execute() = 0;
+  //! False for jobs that only read, the metadata index is refreshed after the others
+  virtual bool changesFiles() const { return true; }
+  //! Orders the job with the jobs on path as well, called before the job is started
+  void addPath( const QString &path ) { fPaths.append( path ); }
+  //! The paths are directories. The job waits for the jobs queued below them and the jobs below
+  //! them that are queued later wait for it
+  void setDirectory( bool directory ) { fDirectory = directory; }
+  //! Hashes file when it is at least minSize bytes, the hash is recorded for path(). Called on the
+  //! temporary file before it is committed
+  void hashContent( const QString &file, qint64 minSize );
+  //! Records a hash that is already known
+  void setHash( const QByteArray &hash, qint64 mtime, qint64 size );
+  //! Makes the temporary file durable as configured and renames it to path(). With group commit
+  //! this only hands the file over, the job finishes once the group is synced and renamed
+  bool commit( QFile &file );
+
+private:
+  //! Refreshes the index, reports the result and starts the jobs waiting for this one
+  void finish();
+
+  QString fPath;
+  QStringList fPaths;
+  bool fDirectory;
+  QString fFilename;
+  QDateTime fMtime;
+  bool fResult;
+  QByteArray fHash;
+  qint64 fHashedMtime;
+  qint64 fHashedSize;
+
+  //Queue state, guarded by the mutex of DiskQueue
+  int fBlockers;
+  QList<DiskJob*> fWaiters;
+
+  //Temporary file handed to the group commit and a descriptor of it, -1 when there is none
+  QString fCommitTemp;
+  int fCommitFd;
+
+  friend class DiskQueue;
+};
+
+//-----------------------------------------------------------------------------
+
+class DiskQueue
+{
+public:
+  //! When the data of a received file has to be on disk. Files are always written to a temporary
+  //! file renamed over the target, so a lost connection never leaves a truncated file behind.
+  //! A crash only leaves the old or the complete new file when the data is synced before the
+  //! rename, that is group and file
+  enum Durability
+  {
+    DurabilityNone,   //!< Left to the kernel, a crash may leave recent files empty or truncated, the default
+    DurabilityGroup,  //!< Files finished within the group interval are synced together with syncfs()
+    DurabilityFile    //!< Every file is synced before it is renamed
+  };
+
+  static DiskQueue *instance();
+
+  //! A new name in the directory of path to write the file to before it is renamed to path. The
+  //! names are hidden and carry the pid of the server, so they don't collide with the files of the users
+  static QString tempPath( const QString &path );
+  //! True for the temporary files of any server process
+  static bool isTempPath( const QString &path );
+  //! Removes the temporary files that servers which are no longer running left below dir. Runs
+  //! once per directory on the pool
+  void sweep( const QString &dir );
+
+  //! Takes "none", "file" or "group=<ms>", false when the setting is none of them
+  bool setDurability( const QString &setting );
+  //! Syncs file as configured and renames it to the path of job, called on the pool threads
+  bool commit( DiskJob *job, QFile &file );
+
+  //! Runs the job after the ones queued before it on its paths. Connect to finished() before calling this
+  void start( DiskJob *job );
+
+private:
+  DiskQueue();
+  QList<DiskJob*> jobDone( DiskJob *job );
+  void startJobs( const QList<DiskJob*> &jobs );
+  static bool overlaps( const DiskJob *a, const DiskJob *b );
+  void queueGroupCommit( DiskJob *job );
+  void runGroupCommits();
+
+  QThreadPool fPool;
+  QMutex fMutex;
+  //The job queued last on each path, the next one on the path waits for it
+  QHash<QString, DiskJob*> fTails;
+  //Directory jobs queued or running, the jobs below them wait for them
+  QList<DiskJob*> fDirectoryJobs;
+  QSet<QString> fSwept;
+
+  Durability fDurability;
+  int fGroupInterval;
+  //Group commit, the jobs whose files wait for the next sync. A thread of its own collects them for
+  //the interval, syncs them and renames them, so no pool thread waits for it
+  QThread *fSyncThread;
+  QMutex fSyncMutex;
+  QWaitCondition fSyncWake;
+  QList<DiskJob*> fSyncJobs;
+
+  friend class DiskJob;
+  friend class GroupCommitThread;
+};
+
+//-----------------------------------------------------------------------------
+
+#endif //QUICKSYNC_DISKQUEUE_H
@@ -0,0 +1,319 @@
+#include "metadataindex.h"
+#include <QtCore/QSocketNotifier>
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//-----------------------------------------------------------------------------
+
+//Most directories kept, the ones after that are answered with stat() and not watched
+static const int s_MaxDirs = 1<<16;
+
+static const quint32 s_WatchMask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+  IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+static bool statFile( const QString &path, qint64 &mtime, qint64 &size )
+{
+  struct stat info;
+  if( ::stat(QFile::encodeName(path).constData(), &info) != 0 || !S_ISREG(info.st_mode) )
+    return false;
+  mtime = static_cast<qint64>( info.st_mtim.tv_sec ) * 1000 + info.st_mtim.tv_nsec / 1000000;
+  size = info.st_size;
+  return true;
+}
+
+static QString childPath( const QString &dir, const QString &name )
+{
+  return dir == "." ? name : dir + '/' + name;
+}
+
+static void splitPath( const QString &path, QString &dir, QString &name )
+{
+  int slash = path.lastIndexOf( '/' );
+  if( slash < 0 )
+    dir = ".";
+  else if( slash == 0 )
+    dir = "/";
+  else
+    dir = path.left( slash );
+  name = path.mid( slash + 1 );
+}
+
+//-----------------------------------------------------------------------------
+
+MetadataIndex::MetadataIndex()
+{
+  fNotifier = NULL;
+  fNotify = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+  if( fNotify < 0 )
+  {
+    qWarning() << "Could not start inotify, stat requests go to the file system: " << strerror(errno);
+    return;
+  }
+  fNotifier = new QSocketNotifier( fNotify, QSocketNotifier::Read, this );
+  connect( fNotifier, SIGNAL(activated(int)), SLOT(readEvents()) );
+}
+
+MetadataIndex::~MetadataIndex()
+{
+  delete fNotifier;
+  qDeleteAll( fDirs );
+  if( fNotify >= 0 )
+    ::close( fNotify );
+}
+
+MetadataIndex *MetadataIndex::instance()
+{
+  static MetadataIndex s_Index;
+  return &s_Index;
+}
+
+bool MetadataIndex::stat( const QString &path, qint64 &mtime, qint64 &size )
+{
+  QString cleanPath = QDir::cleanPath( path );
+  QString dir, name;
+  splitPath( cleanPath, dir, name );
+
+  {
+    QReadLocker lock( &fLock );
+    const Directory *directory = fDirs.value( dir );
+    if( directory )
+      return directory->find( name, mtime, size );
+  }
+
+  if( load(dir) )
+  {
+    QReadLocker lock( &fLock );
+    const Directory *directory = fDirs.value( dir );
+    if( directory )
+      return directory->find( name, mtime, size );
+  }
+  return statFile( cleanPath, mtime, size );
+}
+
+void MetadataIndex::refresh( const QString &path )
+{
+  QString dir, name;
+  splitPath( QDir::cleanPath(path), dir, name );
+
+  QWriteLocker lock( &fLock );
+  Directory *directory = fDirs.value( dir );
+  if( directory )
+    refresh( directory, dir, name );
+}
+
+void MetadataIndex::removeDirectory( const QString &dir )
+{
+  QWriteLocker lock( &fLock );
+  dropBelow( QDir::cleanPath(dir) );
+}
+
+//-----------------------------------------------------------------------------
+
+bool MetadataIndex::Directory::find( const QString &name, qint64 &mtime, qint64 &size ) const
+{
+  QHash<QString, Entry>::const_iterator i = fEntries.find( name );
+  if( i == fEntries.end() )
+    return false;
+  mtime = i.value().fMtime;
+  size = i.value().fSize;
+  return true;
+}
+
+// The watch is added before the directory is read, the events of changes made while it is read
+// are collected in fLoading. The directory is read without holding the lock
+bool MetadataIndex::load( const QString &dir )
+{
+  QByteArray encodedDir = QFile::encodeName( dir );
+  int watch;
+  {
+    QWriteLocker lock( &fLock );
+    if( fDirs.contains(dir) )
+      return true;
+    if( fNotify < 0 || fDirs.size() + fLoading.size() >= s_MaxDirs )
+      return false;
+
+    watch = inotify_add_watch( fNotify, encodedDir.constData(), s_WatchMask );
+    if( watch < 0 )
+      return false;
+    if( fWatches.contains(watch) || fLoading.contains(watch) )
+    {
+      //the same directory under another name or being read by another thread, the events can
+      //only be applied to one of them
+      return false;
+    }
+    Loading &loading = fLoading[watch];
+    loading.fDir = dir;
+    loading.fDropped = false;
+  }
+
+  Directory *directory = new Directory;
+  directory->fWatch = watch;
+  DIR *handle = ::opendir( encodedDir.constData() );
+  if( handle )
+  {
+    while( struct dirent *entry = ::readdir(handle) )
+    {
+      if( entry->d_type != DT_REG && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN )
+        continue;
+      Entry value;
+      QString name = QFile::decodeName( entry->d_name );
+      if( statFile(childPath(dir, name), value.fMtime, value.fSize) )
+        directory->fEntries.insert( name, value );
+    }
+    ::closedir( handle );
+  }
+
+  QWriteLocker lock( &fLock );
+  Loading loading = fLoading.take( watch );
+  if( !handle || loading.fDropped )
+  {
+    //gone or forgotten while it was read
+    inotify_rm_watch( fNotify, watch );
+    delete directory;
+    return false;
+  }
+  foreach( const QString &name, loading.fChanged )
+  {
+    refresh( directory, dir, name );
+  }
+  fDirs.insert( dir, directory );
+  fWatches.insert( watch, dir );
+  return true;
+}
+
+void MetadataIndex::drop( const QString &dir )
+{
+  Directory *directory = fDirs.take( dir );
+  if( !directory )
+    return;
+  fWatches.remove( directory->fWatch );
+  inotify_rm_watch( fNotify, directory->fWatch );
+  delete directory;
+}
+
+void MetadataIndex::dropBelow( const QString &dir )
+{
+  if( dir == "." )
+  {
+    reset();
+    return;
+  }
+  QString prefix = dir.endsWith('/') ? dir : dir + '/';
+  foreach( const QString &loaded, fDirs.keys() )
+  {
+    if( loaded == dir || loaded.startsWith(prefix) )
+      drop( loaded );
+  }
+  for( QHash<int, Loading>::iterator i = fLoading.begin(); i != fLoading.end(); ++i )
+  {
+    if( i.value().fDir == dir || i.value().fDir.startsWith(prefix) )
+      i.value().fDropped = true;
+  }
+}
+
+void MetadataIndex::refresh( Directory *directory, const QString &dir, const QString &name )
+{
+  Entry value;
+  if( statFile(childPath(dir, name), value.fMtime, value.fSize) )
+    directory->fEntries.insert( name, value );
+  else
+    directory->fEntries.remove( name );
+}
+
+// Applies the changes the kernel queued, the entries they name are read again once. Runs on the
+// main thread whenever there are events
+void MetadataIndex::readEvents()
+{
+  QWriteLocker lock( &fLock );
+  QSet<QPair<int, QString> > changed;
+  char buffer[1<<16] __attribute__((aligned(__alignof__(struct inotify_event))));
+  for( ;; )
+  {
+    ssize_t length = ::read( fNotify, buffer, sizeof(buffer) );
+    if( length <= 0 )
+      break;
+
+    for( char *pos = buffer; pos < buffer + length; )
+    {
+      const struct inotify_event *event = reinterpret_cast<const struct inotify_event*>( pos );
+      pos += sizeof(struct inotify_event) + event->len;
+
+      if( event->mask & IN_Q_OVERFLOW )
+      {
+        qWarning() << "The inotify queue overflowed, the metadata index is read again";
+        reset();
+        changed.clear();
+        continue;
+      }
+
+      QString dir;
+      QHash<int, Loading>::iterator loading = fLoading.end();
+      QHash<int, QString>::const_iterator watch = fWatches.find( event->wd );
+      if( watch != fWatches.end() )
+      {
+        dir = watch.value();
+      }
+      else
+      {
+        loading = fLoading.find( event->wd );
+        if( loading == fLoading.end() )
+          continue;
+        dir = loading.value().fDir;
+      }
+      if( event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED) )
+      {
+        dropBelow( dir );
+        continue;
+      }
+      if( event->len == 0 )
+        continue;
+
+      QString name = QFile::decodeName( event->name );
+      if( event->mask & IN_ISDIR )
+      {
+        //a directory that moved keeps its watch, it would report under the old path
+        if( event->mask & (IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE | IN_CREATE) )
+          dropBelow( childPath(dir, name) );
+        continue;
+      }
+      if( loading != fLoading.end() )
+        loading.value().fChanged.insert( name );
+      else
+        changed.insert( qMakePair(event->wd, name) );
+    }
+  }
+
+  typedef QPair<int, QString> Change;
+  foreach( const Change &change, changed )
+  {
+    QHash<int, QString>::const_iterator watch = fWatches.find( change.first );
+    if( watch == fWatches.end() )
+      continue;
+    Directory *directory = fDirs.value( watch.value() );
+    if( directory )
+      refresh( directory, watch.value(), change.second );
+  }
+}
+
+// Forgets everything, the directories are read again when they are asked for. Events still queued
+// for the old watches are ignored, the kernel does not hand out their numbers again soon
+void MetadataIndex::reset()
+{
+  foreach( Directory *directory, fDirs )
+  {
+    inotify_rm_watch( fNotify, directory->fWatch );
+  }
+  qDeleteAll( fDirs );
+  fDirs.clear();
+  fWatches.clear();
+  for( QHash<int, Loading>::iterator i = fLoading.begin(); i != fLoading.end(); ++i )
+  {
+    i.value().fDropped = true;
+  }
+}
+
+//-----------------------------------------------------------------------------
@@ -0,0 +1,69 @@
+#ifndef QUICKSYNC_METADATAINDEX_H
+#define QUICKSYNC_METADATAINDEX_H
+
+#include <QtCore/QReadWriteLock>
+
+class QSocketNotifier;
+
+//-----------------------------------------------------------------------------
+// Mtimes and sizes of the files in the target directories, so stat requests
+// are answered from memory. A directory is read the first time one of its
+// files is asked for and watched with inotify from then on, the changes the
+// kernel queues are applied on the main thread as they arrive. Lookups share
+// the index, a directory is read without holding it.
+//-----------------------------------------------------------------------------
+
+class MetadataIndex : public QObject
+{
+  Q_OBJECT
+public:
+  //! The first call has to be made on the main thread, the inotify events are handled there
+  static MetadataIndex *instance();
+
+  //! Mtime in ms and size of the file at path, false when it is not a regular file
+  bool stat( const QString &path, qint64 &mtime, qint64 &size );
+  //! Reads the entry of path again, called after the server changed the file itself
+  void refresh( const QString &path );
+  //! Forgets the directory dir and everything below it
+  void removeDirectory( const QString &dir );
+
+private slots:
+  void readEvents();
+
+private:
+  MetadataIndex();
+  ~MetadataIndex();
+
+  struct Entry { qint64 fMtime; qint64 fSize; };
+  struct Directory
+  {
+    int fWatch;
+    QHash<QString, Entry> fEntries;
+
+    bool find( const QString &name, qint64 &mtime, qint64 &size ) const;
+  };
+  //! A directory that is being read, the names its events report are read again once it is added
+  struct Loading
+  {
+    QString fDir;
+    QSet<QString> fChanged;
+    bool fDropped;
+  };
+
+  bool load( const QString &dir );
+  void drop( const QString &dir );
+  void dropBelow( const QString &dir );
+  void refresh( Directory *directory, const QString &dir, const QString &name );
+  void reset();
+
+  QReadWriteLock fLock;
+  int fNotify;
+  QSocketNotifier *fNotifier;
+  QHash<QString, Directory*> fDirs;
+  QHash<int, QString> fWatches;
+  QHash<int, Loading> fLoading;
+};
+
+//-----------------------------------------------------------------------------
+
+#endif //QUICKSYNC_METADATAINDEX_H
@@ -2,44 +2,195 @@
 // Content of this file is subject to the GPL v2
 #include "serverapp.h"
 #include "serverconnection.h"
+#include "diskqueue.h"
+#include "metadataindex.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <unistd.h>
 
 //-----------------------------------------------------------------------------
 
-SyncSocketServer::SyncSocketServer( int port, const QString &sourcedir ) : QTcpServer()
+SyncSocketServer::SyncSocketServer( const QString &sourcedir, const QList<ConnectionWorker*> &workers ) : QTcpServer()
 {
   fSourceDir = sourcedir;
+  fWorkers = workers;
+  fNextWorker = 0;
+}
+
+bool SyncSocketServer::listenShared( int port )
+{
+#ifdef SO_REUSEPORT
+  //dual stack like QHostAddress::Any, plain IPv4 when the host has no IPv6
+  int fd = ::socket( AF_INET6, SOCK_STREAM, 0 );
+  bool ipv6 = fd >= 0;
+  if( ipv6 )
+  {
+    int off = 0;
+    ::setsockopt( fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off) );
+  }
+  else
+  {
+    fd = ::socket( AF_INET, SOCK_STREAM, 0 );
+  }
+  if( fd < 0 )
+    return false;
+
+  int on = 1;
+  ::setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+  bool result = ::setsockopt( fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on) ) == 0;
+
+  struct sockaddr_storage address;
+  memset( &address, 0, sizeof(address) );
+  socklen_t length;
+  struct sockaddr_in6 *address6 = reinterpret_cast<struct sockaddr_in6*>( &address );
+  struct sockaddr_in *address4 = reinterpret_cast<struct sockaddr_in*>( &address );
+  if( ipv6 )
+  {
+    address6->sin6_family = AF_INET6;
+    address6->sin6_addr = in6addr_any;
+    address6->sin6_port = htons( port );
+    length = sizeof(*address6);
+  }
+  else
+  {
+    address4->sin_family = AF_INET;
+    address4->sin_addr.s_addr = htonl( INADDR_ANY );
+    address4->sin_port = htons( port );
+    length = sizeof(*address4);
+  }
+
+  result = result && ::bind( fd, reinterpret_cast<struct sockaddr*>(&address), length ) == 0 &&
+    ::listen( fd, SOMAXCONN ) == 0 && setSocketDescriptor( fd );
+  if( !result )
+    ::close( fd );
+  return result;
+#else
+  Q_UNUSED( port );
+  return false;
+#endif
+}
 
-  connect( this, SIGNAL(newConnection()), SLOT(newConnection()) );
-  
-  if( !listen(QHostAddress::Any, port) )
+void SyncSocketServer::incomingConnection( qintptr socketDescriptor )
+{
+  if( fWorkers.isEmpty() )
   {
-    qFatal( "SyncSocketServer: failed to bind to port" );
+    QTcpSocket *socket = new QTcpSocket();
+    socket->setSocketDescriptor( socketDescriptor );
+    qDebug() << "new connection: " << socket;
+
+    new ServerConnection( fSourceDir, socket );
+    return;
   }
+
+  //the socket is created on the thread of the worker so its events are handled there
+  ConnectionWorker *worker = fWorkers.at( fNextWorker );
+  fNextWorker = (fNextWorker + 1) % fWorkers.size();
+  QMetaObject::invokeMethod( worker, "createConnection", Qt::QueuedConnection, Q_ARG(qintptr, socketDescriptor) );
+}
+
+//-----------------------------------------------------------------------------
+
+ConnectionWorker::ConnectionWorker( const QString &sourcedir ) : QObject()
+{
+  fSourceDir = sourcedir;
+  fServer = NULL;
 }
 
-void SyncSocketServer::newConnection()
+ConnectionWorker::~ConnectionWorker()
 {
-  QTcpSocket *socket = nextPendingConnection();
-  qDebug() << "new connection: " << socket;
+  delete fServer;
+}
+
+void ConnectionWorker::createConnection( qintptr socketDescriptor )
+{
+  QTcpSocket *socket = new QTcpSocket();
+  socket->setSocketDescriptor( socketDescriptor );
+  qDebug() << "new connection: " << socket << " on " << QThread::currentThread();
 
   new ServerConnection( fSourceDir, socket );
 }
 
+void ConnectionWorker::listenShared( int port )
+{
+  fServer = new SyncSocketServer( fSourceDir, QList<ConnectionWorker*>() );
+  if( !fServer->listenShared(port) )
+  {
+    qFatal( "SyncSocketServer: failed to bind to port with SO_REUSEPORT" );
+  }
+}
+
 //-----------------------------------------------------------------------------
 
+// syncserver <port> [none|file|group=<ms>] [--threads=<n>] [--reuseport], the durability defaults to none
 ServerApp::ServerApp( int argc, char **argv ) : QCoreApplication( argc, argv )
 {
-  if( argc!=2 || atoi(argv[1])==0 )
+  int port = argc >= 2 ? atoi(argv[1]) : 0;
+  int threads = QThread::idealThreadCount();
+  bool reusePort = false;
+  bool valid = port != 0;
+  for( int i=2; i<argc && valid; ++i )
+  {
+    QString arg = argv[i];
+    if( arg.startsWith("--threads=") )
+      threads = arg.mid( 10 ).toInt( &valid );
+    else if( arg == "--reuseport" )
+      reusePort = true;
+    else
+      valid = DiskQueue::instance()->setDurability( arg );
+  }
+  if( !valid || threads < 1 )
+  {
+    qFatal( "Usage: syncserver <port> [none|file|group=<ms>] [--threads=<n>] [--reuseport]" );
+  }
+
+  //temporary files a crashed server left in the default target, the ones set by clients are swept when they are first used
+  DiskQueue::instance()->sweep( "." );
+  //created here so its inotify events are handled by this thread, the disk pool only looks things up
+  MetadataIndex::instance();
+
+  qRegisterMetaType<qintptr>( "qintptr" );
+  //manifest batches are posted from the disk pool to the connections
+  qRegisterMetaType<QVector<qint64> >( "QVector<qint64>" );
+  for( int i=0; i<threads; ++i )
+  {
+    QThread *thread = new QThread();
+    ConnectionWorker *worker = new ConnectionWorker( "." );
+    worker->moveToThread( thread );
+    thread->start();
+    fThreads.append( thread );
+    fWorkers.append( worker );
+  }
+
+  fServer = NULL;
+  if( reusePort )
   {
-    qFatal( "Usage: syncserver <port>" );
+    for( int i=0; i<fWorkers.size(); ++i )
+      QMetaObject::invokeMethod( fWorkers.at(i), "listenShared", Qt::QueuedConnection, Q_ARG(int, port) );
+  }
+  else
+  {
+    fServer = new SyncSocketServer( ".", fWorkers );
+    if( !fServer->listen(QHostAddress::Any, port) )
+    {
+      qFatal( "SyncSocketServer: failed to bind to port" );
+    }
   }
-  
-  fServer = new SyncSocketServer( atoi(argv[1]), "." );
 }
 
 ServerApp::~ServerApp()
 {
   delete fServer;
+  foreach( QThread *thread, fThreads )
+  {
+    thread->quit();
+    thread->wait();
+    delete thread;
+  }
+  //the event loops are gone, a deleteLater() would never run. The threads have stopped so the
+  //workers and their listeners can be deleted from here
+  qDeleteAll( fWorkers );
+  fWorkers.clear();
 }
 
 //-----------------------------------------------------------------------------
@@ -49,5 +200,3 @@ int main( int argc, char **argv )
   ServerApp app( argc, argv );
   return app.exec();
 }
-
-
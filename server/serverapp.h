@@ -3,19 +3,47 @@
 #ifndef QUICKSYNC_SERVERAPP_H
 #define QUICKSYNC_SERVERAPP_H
 
+class ConnectionWorker;
+
 //-----------------------------------------------------------------------------
 
+//! Accepts connections and hands them to the workers in turn, without workers it runs them itself
 class SyncSocketServer : public QTcpServer
 {
   Q_OBJECT
 public:
-  SyncSocketServer( int port, const QString &sourcedir );
-  
-private slots:
-  void newConnection(); 
+  SyncSocketServer( const QString &sourcedir, const QList<ConnectionWorker*> &workers );
+
+  //! Listens on a socket bound with SO_REUSEPORT, so several servers can accept on the same port
+  bool listenShared( int port );
+
+protected:
+  virtual void incomingConnection( qintptr socketDescriptor );
+
+private:
+  QString fSourceDir;
+  QList<ConnectionWorker*> fWorkers;
+  int fNextWorker;
+};
+
+//-----------------------------------------------------------------------------
+
+//! Lives on its own thread, the connections it creates run on the event loop of that thread
+class ConnectionWorker : public QObject
+{
+  Q_OBJECT
+public:
+  ConnectionWorker( const QString &sourcedir );
+  virtual ~ConnectionWorker();
+
+public slots:
+  void createConnection( qintptr socketDescriptor );
+  //! Accepts on the thread of the worker, the kernel spreads the connections between the workers
+  void listenShared( int port );
 
 private:
   QString fSourceDir;
+  SyncSocketServer *fServer;
 };
 
 //-----------------------------------------------------------------------------
@@ -28,6 +56,8 @@ public:
   
 private:
   SyncSocketServer *fServer;
+  QList<QThread*> fThreads;
+  QList<ConnectionWorker*> fWorkers;
 };
 
 //-----------------------------------------------------------------------------
@@ -2,7 +2,680 @@
 // Content of this file is subject to the GPL v2
 #include "serverconnection.h"
 #include "shared/utils.h"
+#include "shared/contenthash.h"
+#include "diskqueue.h"
+#include "metadataindex.h"
 #include <sys/time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+
+//-----------------------------------------------------------------------------
+
+//Hashes of files in the target directories, shared by all connections. Indexed by content it
+//is the store new files are copied from when another branch already has them
+static ContentHashCache s_HashCache;
+
+//Received files at least this big are hashed into the store, the client only asks for files of this size
+static const qint64 s_IndexMinSize = 1<<16;
+
+//Sessions by id, alive as long as one of their connections is
+static QHash<QByteArray, QWeakPointer<ServerSession> > s_Sessions;
+static QMutex s_SessionsMutex;
+
+// Drops the sessions whose connections are all gone, called with s_SessionsMutex held
+static void dropEndedSessions()
+{
+  for( QHash<QByteArray, QWeakPointer<ServerSession> >::iterator i = s_Sessions.begin(); i != s_Sessions.end(); )
+  {
+    if( i.value().isNull() )
+      i = s_Sessions.erase( i );
+    else
+      ++i;
+  }
+}
+
+//Most data a client may have on its way to one connection before it waits for credit
+static const qint64 s_ReceiveWindow = 1<<26;
+
+//-----------------------------------------------------------------------------
+
+// Files are opened unbuffered, the data arrives in big blocks and raw transfers write to the descriptor directly
+static bool openFile( QFile &file )
+{
+  if( !file.open(QIODevice::WriteOnly | QIODevice::Unbuffered) )
+  {
+    // maybe we are missing some directories
+    QString filedir = file.fileName().section( '/', 0, -2 );
+    QDir dir(filedir);
+    bool result = true;
+    if(!dir.exists())
+    {
+      result = dir.mkpath(filedir);
+    }
+
+    if( !result )
+    {
+      qWarning() << "Could not create path \"" << filedir << "\"";
+    }
+    else
+    {
+      file.open( QIODevice::WriteOnly | QIODevice::Unbuffered );
+    }
+  }
+  return file.isOpen();
+}
+
+static bool finishFile( QFile &file, const QDateTime &mtime, bool executable )
+{
+  if(executable)
+  {
+    file.setPermissions(file.permissions()|QFile::ExeOwner|QFile::ExeGroup|QFile::ExeOther);
+  }
+  file.flush();
+
+  // For some reason QFileInfo is lacking setLastModified()
+  struct timeval times[2];
+  times[0].tv_sec = times[1].tv_sec = mtime.toTime_t();
+  times[0].tv_usec = times[1].tv_usec = 0;
+  if( futimes(file.handle(), times) != 0 )
+  {
+    qWarning() << "Could not set times on file \"" << file.fileName() << "\"";
+    return false;
+  }
+  return true;
+}
+
+// Adds the hash a job computed to the store
+static void storeHash( const DiskJob *job )
+{
+  if( job->result() && !job->hash().isEmpty() )
+    s_HashCache.insert( job->path(), job->hashedMtime(), job->hashedSize(), job->hash() );
+}
+
+//-----------------------------------------------------------------------------
+
+//! Writes a whole received file
+class WriteFileJob : public DiskJob
+{
+public:
+  WriteFileJob( const QString &path, const QString &filename, const QDateTime &mtime, const QByteArray &data, bool executable ) :
+    DiskJob( path, filename, mtime ), fData( data ), fExecutable( executable ) {}
+
+protected:
+  virtual bool execute()
+  {
+    QFile file( DiskQueue::tempPath(path()) );
+    if( !openFile(file) )
+    {
+      qWarning() << "Could not create file \"" << filename() << "\"";
+      return false;
+    }
+    bool result = file.write( fData ) == fData.size() && finishFile( file, mtime(), fExecutable ) && commit( file );
+    file.close();
+    if( !result )
+    {
+      file.remove();
+    }
+    else if( fData.size() >= s_IndexMinSize )
+    {
+      //the data is still in memory, no need to read the file back
+      ContentHasher hasher;
+      hasher.update( fData );
+      setHash( hasher.result(), static_cast<qint64>(mtime().toTime_t()) * 1000, fData.size() );
+    }
+    fData.clear();
+    return result;
+  }
+
+private:
+  QByteArray fData;
+  bool fExecutable;
+};
+
+//! Builds the new file from the old one and a delta next to it and renames it over the old one,
+//! the old copy is the source of the blocks
+class DeltaJob : public DiskJob
+{
+public:
+  DeltaJob( const QString &path, const QString &filename, const QDateTime &mtime, int blockSize, const QByteArray &delta, bool executable ) :
+    DiskJob( path, filename, mtime ), fBlockSize( blockSize ), fDelta( delta ), fExecutable( executable ) {}
+
+protected:
+  virtual bool execute()
+  {
+    QFile base( path() );
+    QFile file( DiskQueue::tempPath(path()) );
+    bool result = false;
+    if( !base.open(QIODevice::ReadOnly) || !file.open(QIODevice::WriteOnly) )
+    {
+      qWarning() << "Could not open \"" << filename() << "\" for delta";
+    }
+    else if( !applyDelta(base, fBlockSize, fDelta, file) )
+    {
+      qWarning() << "Could not apply delta to \"" << filename() << "\"";
+    }
+    else if( finishFile(file, mtime(), fExecutable) )
+    {
+      //hashed before the commit, the rename may happen later
+      hashContent( file.fileName(), s_IndexMinSize );
+      result = commit( file );
+    }
+    base.close();
+    file.close();
+    fDelta.clear();
+
+    if( !result )
+      file.remove();
+    return result;
+  }
+
+private:
+  int fBlockSize;
+  QByteArray fDelta;
+  bool fExecutable;
+};
+
+//! A delta that is applied as its pieces arrive. The jobs on its file use it one after the other,
+//! the temporary file is removed with it unless it was committed
+class DeltaStream
+{
+public:
+  DeltaStream( const QString &path, int blockSize ) :
+    fBase( path ), fFile( DiskQueue::tempPath(path) ), fApplier( fBase, blockSize, fFile ), fOpened( false ), fFailed( false ), fCommitted( false ) {}
+  ~DeltaStream()
+  {
+    if( fOpened && !fCommitted )
+      fFile.remove();
+  }
+
+  bool open()
+  {
+    if( !fOpened )
+    {
+      fOpened = true;
+      fFailed = !fBase.open(QIODevice::ReadOnly) || !fFile.open(QIODevice::WriteOnly);
+      if( fFailed )
+        qWarning() << "Could not open \"" << fBase.fileName() << "\" for delta";
+    }
+    return !fFailed;
+  }
+
+  bool feed( const QByteArray &ops )
+  {
+    if( open() && !fApplier.feed(ops) )
+    {
+      qWarning() << "Could not apply delta to \"" << fBase.fileName() << "\"";
+      fFailed = true;
+    }
+    return !fFailed;
+  }
+
+  QFile fBase;
+  QFile fFile;
+  DeltaApplier fApplier;
+  bool fOpened;
+  bool fFailed;
+  bool fCommitted;
+};
+
+//! Applies one piece of a streamed delta
+class DeltaChunkJob : public DiskJob
+{
+public:
+  DeltaChunkJob( const QString &path, const QString &filename, const QSharedPointer<DeltaStream> &stream, const QByteArray &ops ) :
+    DiskJob( path, filename, QDateTime() ), fStream( stream ), fOps( ops ) {}
+
+protected:
+  virtual bool changesFiles() const { return false; }
+  virtual bool execute()
+  {
+    bool result = fStream->feed( fOps );
+    fOps.clear();
+    return result;
+  }
+
+private:
+  QSharedPointer<DeltaStream> fStream;
+  QByteArray fOps;
+};
+
+//! Renames the file built from a streamed delta over the old one, or drops it when the delta is incomplete
+class DeltaEndJob : public DiskJob
+{
+public:
+  DeltaEndJob( const QString &path, const QString &filename, const QDateTime &mtime, const QSharedPointer<DeltaStream> &stream, bool executable, bool complete ) :
+    DiskJob( path, filename, mtime ), fStream( stream ), fExecutable( executable ), fComplete( complete ) {}
+
+protected:
+  virtual bool execute()
+  {
+    bool result = fComplete && fStream->open() && fStream->fApplier.atOpBoundary() &&
+                  finishFile( fStream->fFile, mtime(), fExecutable );
+    if( result )
+    {
+      hashContent( fStream->fFile.fileName(), s_IndexMinSize );
+      result = commit( fStream->fFile );
+    }
+    fStream->fBase.close();
+    fStream->fFile.close();
+    fStream->fCommitted = result;
+    if( !result && fComplete )
+      qWarning() << "Could not apply delta to \"" << filename() << "\"";
+    return result;
+  }
+
+private:
+  QSharedPointer<DeltaStream> fStream;
+  bool fExecutable;
+  bool fComplete;
+};
+
+//! A file that is received in pieces. The jobs on its file write to it one after the other, the
+//! temporary file is removed with it unless it was committed
+class FileStream
+{
+public:
+  FileStream( const QString &path ) :
+    fFile( DiskQueue::tempPath(path) ), fOpened( false ), fFailed( false ), fCommitted( false ) {}
+  ~FileStream()
+  {
+    if( fOpened && !fCommitted )
+      fFile.remove();
+  }
+
+  bool open()
+  {
+    if( !fOpened )
+    {
+      fOpened = true;
+      fFailed = !openFile( fFile );
+      if( fFailed )
+        qWarning() << "Could not create file \"" << fFile.fileName() << "\"";
+    }
+    return !fFailed;
+  }
+
+  bool write( const QByteArray &data )
+  {
+    if( open() && fFile.write(data) != data.size() )
+    {
+      qWarning() << "Could not write to file \"" << fFile.fileName() << "\"";
+      fFailed = true;
+    }
+    return !fFailed;
+  }
+
+  QFile fFile;
+  bool fOpened;
+  bool fFailed;
+  bool fCommitted;
+};
+
+//! Writes one piece of a streamed file
+class FileChunkJob : public DiskJob
+{
+public:
+  FileChunkJob( const QString &path, const QString &filename, const QSharedPointer<FileStream> &stream, const QByteArray &data ) :
+    DiskJob( path, filename, QDateTime() ), fStream( stream ), fData( data ) {}
+
+protected:
+  virtual bool changesFiles() const { return false; }
+  virtual bool execute()
+  {
+    bool result = fStream->write( fData );
+    fData.clear();
+    return result;
+  }
+
+private:
+  QSharedPointer<FileStream> fStream;
+  QByteArray fData;
+};
+
+//! Commits a streamed file once its pieces are written and adds it to the store. hash is the one
+//! of the pieces as they arrived. An incomplete file is dropped and fails
+class CommitJob : public DiskJob
+{
+public:
+  CommitJob( const QString &path, const QString &filename, const QDateTime &mtime, const QSharedPointer<FileStream> &stream,
+             bool executable, bool complete, const QByteArray &hash, qint64 size ) :
+    DiskJob( path, filename, mtime ), fStream( stream ), fExecutable( executable ), fComplete( complete ), fContentHash( hash ), fSize( size ) {}
+
+protected:
+  virtual bool execute()
+  {
+    bool result = fComplete && fStream->open() && finishFile( fStream->fFile, mtime(), fExecutable );
+    if( result )
+    {
+      if( fSize >= s_IndexMinSize )
+        setHash( fContentHash, static_cast<qint64>(mtime().toTime_t()) * 1000, fSize );
+      result = commit( fStream->fFile );
+    }
+    fStream->fFile.close();
+    fStream->fCommitted = result;
+    return result;
+  }
+
+private:
+  QSharedPointer<FileStream> fStream;
+  bool fExecutable;
+  bool fComplete;
+  QByteArray fContentHash;
+  qint64 fSize;
+};
+
+// True when the file at path already has this content, its mtime is then set to the one of the client
+static bool matchesHash( const QString &path, const QDateTime &mtime, qint64 size, const QByteArray &hash )
+{
+  QFileInfo fileInfo( path );
+  if( !fileInfo.isFile() || hash.size() != ContentHasher::HashSize || (size >= 0 && size != fileInfo.size()) )
+    return false;
+
+  QByteArray localHash;
+  if( !s_HashCache.lookup(path, fileInfo.lastModified().toMSecsSinceEpoch(), fileInfo.size(), localHash) )
+  {
+    qint64 hashedSize;
+    localHash = ContentHasher::hashFile( path, false, hashedSize );
+    if( !localHash.isEmpty() )
+      s_HashCache.insert( path, fileInfo.lastModified().toMSecsSinceEpoch(), fileInfo.size(), localHash );
+  }
+  if( localHash != hash )
+    return false;
+
+  struct timeval times[2];
+  times[0].tv_sec = times[1].tv_sec = mtime.toTime_t();
+  times[0].tv_usec = times[1].tv_usec = 0;
+  if( utimes(QFile::encodeName(path).constData(), times) != 0 )
+  {
+    qWarning() << "Could not set times on file \"" << path << "\"";
+    return false;
+  }
+  s_HashCache.insert( path, static_cast<qint64>(mtime.toTime_t()) * 1000, fileInfo.size(), localHash );
+  return true;
+}
+
+//! Checks whether the file already has the content the client has. With materialize the content
+//! is copied from another file in the store when it doesn't. The copy shares its blocks with the
+//! source when the file system supports reflinks, hardlinks are not used since the files are
+//! changed independently later
+class HashCheckJob : public DiskJob
+{
+public:
+  HashCheckJob( const QString &path, const QString &filename, const QDateTime &mtime, qint64 size, const QByteArray &hash, bool materialize, bool executable ) :
+    DiskJob( path, filename, mtime ), fSize( size ), fContentHash( hash ), fMaterialize( materialize ), fExecutable( executable ) {}
+
+protected:
+  virtual bool execute()
+  {
+    if( matchesHash(path(), mtime(), fSize, fContentHash) )
+      return true;
+    return fMaterialize && materialize();
+  }
+
+private:
+  bool materialize()
+  {
+    if( fContentHash.size() != ContentHasher::HashSize )
+      return false;
+
+    s_HashCache.remove( path() );
+    foreach( const QString &candidate, s_HashCache.paths(fContentHash) )
+    {
+      //only trust entries that still describe the file on disk
+      QFileInfo candidateInfo( candidate );
+      QByteArray candidateHash;
+      if( candidate == path() || !candidateInfo.isFile() || (fSize >= 0 && fSize != candidateInfo.size()) ||
+          !s_HashCache.lookup(candidate, candidateInfo.lastModified().toMSecsSinceEpoch(), candidateInfo.size(), candidateHash) )
+        continue;
+
+      QFile source( candidate );
+      QFile file( DiskQueue::tempPath(path()) );
+      if( !source.open(QIODevice::ReadOnly) || !openFile(file) )
+        continue;
+
+      bool copied = false;
+#ifdef FICLONE
+      copied = ioctl( file.handle(), FICLONE, source.handle() ) == 0;
+#endif
+      qint64 size = source.size();
+      qint64 remaining = size;
+      while( !copied && remaining > 0 )
+      {
+        ssize_t sent = ::sendfile( file.handle(), source.handle(), NULL, static_cast<size_t>(qMin<qint64>(remaining, 1<<30)) );
+        if( sent <= 0 )
+        {
+          if( sent < 0 && errno == EINTR )
+            continue;
+          break;
+        }
+        remaining -= sent;
+      }
+      copied = copied || remaining == 0;
+
+      if( !copied || !finishFile(file, mtime(), fExecutable) || !commit(file) )
+      {
+        qWarning() << "Could not copy \"" << candidate << "\" to \"" << filename() << "\": " << strerror(errno);
+        file.close();
+        file.remove();
+        return false;
+      }
+      qDebug() << "Materialized " << path() << " from " << candidate;
+      setHash( fContentHash, static_cast<qint64>(mtime().toTime_t()) * 1000, size );
+      return true;
+    }
+    return false;
+  }
+
+  qint64 fSize;
+  QByteArray fContentHash;
+  bool fMaterialize;
+  bool fExecutable;
+};
+
+class DeleteJob : public DiskJob
+{
+public:
+  DeleteJob( const QString &path, const QString &filename ) :
+    DiskJob( path, filename, QDateTime() ) {}
+
+protected:
+  virtual bool execute()
+  {
+    if( !QFile::remove(path()) )
+    {
+      qDebug() << "Could not remove " << path();
+      return false;
+    }
+    return true;
+  }
+};
+
+//! Mtime and size of a file from the metadata index, after the writes queued before it
+class StatJob : public DiskJob
+{
+public:
+  StatJob( const QString &path, const QString &filename ) :
+    DiskJob( path, filename, QDateTime() ), fStatMtime( 0 ), fStatSize( 0 ) {}
+
+  qint64 statMtime() const { return fStatMtime; }
+
+protected:
+  virtual bool changesFiles() const { return false; }
+  virtual bool execute()
+  {
+    return MetadataIndex::instance()->stat( path(), fStatMtime, fStatSize );
+  }
+
+private:
+  qint64 fStatMtime;
+  qint64 fStatSize;
+};
+
+//! Mtimes and sizes of the files of a stat batch, -1 for the ones that don't exist
+class StatBatchJob : public DiskJob
+{
+public:
+  StatBatchJob( quint32 id, const QStringList &paths ) :
+    DiskJob( paths.value(0), QString(), QDateTime() ), fId( id ), fMtimes( paths.size(), -1 ), fSizes( paths.size(), -1 )
+  {
+    for( int i=1; i<paths.size(); ++i )
+      addPath( paths.at(i) );
+  }
+
+  quint32 id() const { return fId; }
+  const QVector<qint64> &mtimes() const { return fMtimes; }
+  const QVector<qint64> &sizes() const { return fSizes; }
+
+protected:
+  virtual bool changesFiles() const { return false; }
+  virtual bool execute()
+  {
+    for( int i=0; i<paths().size(); ++i )
+    {
+      qint64 mtime, size;
+      if( MetadataIndex::instance()->stat(paths().at(i), mtime, size) )
+      {
+        fMtimes[i] = mtime;
+        fSizes[i] = size;
+      }
+    }
+    return true;
+  }
+
+private:
+  quint32 fId;
+  QVector<qint64> fMtimes;
+  QVector<qint64> fSizes;
+};
+
+//! Block signature of the current copy of a file for a delta
+class SignatureJob : public DiskJob
+{
+public:
+  SignatureJob( const QString &path, const QString &filename, int blockSize ) :
+    DiskJob( path, filename, QDateTime() ), fBlockSize( blockSize ) {}
+
+  const DeltaSignature &signature() const { return fSignature; }
+
+protected:
+  virtual bool changesFiles() const { return false; }
+  virtual bool execute()
+  {
+    fSignature.fBlockSize = fBlockSize;
+    QFile file( path() );
+    if( !file.open(QIODevice::ReadOnly) )
+      return false;
+    fSignature = computeDeltaSignature( file, fBlockSize );
+    return true;
+  }
+
+private:
+  int fBlockSize;
+  DeltaSignature fSignature;
+};
+
+//! Moves a file or a directory, a directory rename waits for everything queued below both names
+class RenameJob : public DiskJob
+{
+public:
+  RenameJob( const QString &oldPath, const QString &newPath, const QString &oldName, const QString &newName, bool directory ) :
+    DiskJob( oldPath, oldName, QDateTime() ), fNewPath( newPath ), fNewName( newName )
+  {
+    addPath( newPath );
+    setDirectory( directory );
+  }
+
+  const QString &newName() const { return fNewName; }
+
+protected:
+  virtual bool changesFiles() const { return false; }
+  virtual bool execute()
+  {
+    QFileInfo oldInfo( path() );
+    bool result = oldInfo.exists() && oldInfo.isDir() == isDirectory();
+    if( result )
+    {
+      QString newDir = fNewPath.section( '/', 0, -2 );
+      QDir dir( newDir );
+      if( !dir.exists() && !dir.mkpath(newDir) )
+      {
+        qWarning() << "Could not create path \"" << newDir << "\"";
+        result = false;
+      }
+    }
+    if( result && ::rename(QFile::encodeName(path()).constData(), QFile::encodeName(fNewPath).constData()) != 0 )
+    {
+      qWarning() << "Could not rename " << path() << " to " << fNewPath << ": " << strerror(errno);
+      result = false;
+    }
+
+    if( isDirectory() )
+    {
+      s_HashCache.removeDirectory( path() );
+      s_HashCache.removeDirectory( fNewPath );
+      MetadataIndex::instance()->removeDirectory( path() );
+      MetadataIndex::instance()->removeDirectory( fNewPath );
+    }
+    else
+    {
+      s_HashCache.remove( path() );
+      s_HashCache.remove( fNewPath );
+      MetadataIndex::instance()->refresh( path() );
+      MetadataIndex::instance()->refresh( fNewPath );
+    }
+    return result;
+  }
+
+private:
+  QString fNewPath;
+  QString fNewName;
+};
+
+//-----------------------------------------------------------------------------
+
+ManifestJob::ManifestJob( const QString &root ) :
+  DiskJob( root, QString(), QDateTime() ), fCount( 0 )
+{
+}
+
+bool ManifestJob::execute()
+{
+  //Entries are sent in batches so the client can start merging before the walk is done
+  static const int batchSize = 4096;
+  QStringList paths;
+  QVector<qint64> mtimes;
+  QVector<qint64> sizes;
+
+  QDirIterator it( path(), QDir::Files|QDir::NoDotAndDotDot, QDirIterator::Subdirectories );
+  while( it.hasNext() )
+  {
+    it.next();
+    if( DiskQueue::isTempPath(it.filePath()) )
+      continue;
+    QFileInfo fileInfo = it.fileInfo();
+    paths.append( joinPath(".", it.filePath().mid(path().length()+1)) );
+    mtimes.append( fileInfo.lastModified().toMSecsSinceEpoch() );
+    sizes.append( fileInfo.size() );
+    if( paths.size() == batchSize )
+    {
+      emit entries( paths, mtimes, sizes );
+      fCount += paths.size();
+      paths.clear();
+      mtimes.clear();
+      sizes.clear();
+    }
+  }
+  if( !paths.isEmpty() )
+  {
+    emit entries( paths, mtimes, sizes );
+    fCount += paths.size();
+  }
+  return true;
+}
 
 //-----------------------------------------------------------------------------
 
@@ -10,110 +683,373 @@ ServerConnection::ServerConnection( const QString &sourcedir, QTcpSocket *socket
   RemoteObjectConnection( socket )
 {
   fDefaultSourceDir = sourcedir;
-  fSourceDir = sourcedir;
+  fSession = QSharedPointer<ServerSession>( new ServerSession );
+  fSession->setSourceDir( sourcedir );
+  fStreamExecutable = false;
+  fStreamSize = 0;
+  fDeltaExecutable = false;
+  setReceiveWindow( s_ReceiveWindow );
   
   connect( this, SIGNAL(recvTargetDirectory(const QString &)), SLOT(recvTargetDirectory(const QString &)) );
+  connect( this, SIGNAL(recvJoinSession(const QByteArray &)), SLOT(recvJoinSession(const QByteArray &)) );
   connect( this, SIGNAL(recvStatFileReq(const QString &)), SLOT(recvStatFileReq(const QString &)) );
+  connect( this, SIGNAL(recvStatFileBatchReq(quint32, const QString &, const QStringList &)), SLOT(recvStatFileBatchReq(quint32, const QString &, const QStringList &)) );
+  connect( this, SIGNAL(recvManifestReq()), SLOT(recvManifestReq()) );
   connect( this, SIGNAL(recvSendFile(const QString &, const QDateTime &, const QByteArray &, bool)), SLOT(recvSendFile(const QString &, const QDateTime &, const QByteArray &, bool)) );
+  connect( this, SIGNAL(recvSendFileBegin(const QString &, const QDateTime &, bool)), SLOT(recvSendFileBegin(const QString &, const QDateTime &, bool)) );
+  connect( this, SIGNAL(recvSendFileChunk(const QByteArray &)), SLOT(recvSendFileChunk(const QByteArray &)) );
+  connect( this, SIGNAL(recvSendFileEnd(bool)), SLOT(recvSendFileEnd(bool)) );
+  connect( this, SIGNAL(recvSignatureReq(const QString &, int)), SLOT(recvSignatureReq(const QString &, int)) );
+  connect( this, SIGNAL(recvSendDelta(const QString &, const QDateTime &, int, const QByteArray &, bool)), SLOT(recvSendDelta(const QString &, const QDateTime &, int, const QByteArray &, bool)) );
+  connect( this, SIGNAL(recvSendDeltaBegin(const QString &, const QDateTime &, int, bool)), SLOT(recvSendDeltaBegin(const QString &, const QDateTime &, int, bool)) );
+  connect( this, SIGNAL(recvSendDeltaChunk(const QByteArray &)), SLOT(recvSendDeltaChunk(const QByteArray &)) );
+  connect( this, SIGNAL(recvSendDeltaEnd(bool)), SLOT(recvSendDeltaEnd(bool)) );
+  connect( this, SIGNAL(recvHashCheckReq(const QString &, const QDateTime &, qint64, const QByteArray &)), SLOT(recvHashCheckReq(const QString &, const QDateTime &, qint64, const QByteArray &)) );
+  connect( this, SIGNAL(recvMaterializeReq(const QString &, const QDateTime &, qint64, const QByteArray &, bool)), SLOT(recvMaterializeReq(const QString &, const QDateTime &, qint64, const QByteArray &, bool)) );
   connect( this, SIGNAL(recvDeleteFile(const QString &)), SLOT(recvDeleteFile(const QString &)) );
+  connect( this, SIGNAL(recvRename(const QString &, const QString &, bool)), SLOT(recvRename(const QString &, const QString &, bool)) );
+  //nothing else owns the connection, it goes away with its client
+  connect( fSocket, SIGNAL(disconnected()), SLOT(deleteLater()) );
 
   sendVersion();
 }
 
+ServerConnection::~ServerConnection()
+{
+  //a stream cut off by the disconnect leaves the target file as it was, its temporary file is
+  //removed once the jobs still queued on it are done
+  fStream.clear();
+  fDelta.clear();
+
+  //the session ends with its last connection
+  QMutexLocker lock( &s_SessionsMutex );
+  fSession.clear();
+  dropEndedSessions();
+}
+
 void ServerConnection::recvTargetDirectory(const QString &path)
 {
 	if(path.isEmpty())
 	{
-		fSourceDir = fDefaultSourceDir;
+		fSession->setSourceDir( fDefaultSourceDir );
 	}
 	else
 	{
-		fSourceDir = path;
+		fSession->setSourceDir( path );
 	}
+  DiskQueue::instance()->sweep( fSession->sourceDir() );
 }
 
+// The first connection to join a session registers its state, the ones that follow share it
+void ServerConnection::recvJoinSession( const QByteArray &sessionId )
+{
+  QMutexLocker lock( &s_SessionsMutex );
+  QSharedPointer<ServerSession> session = s_Sessions.value( sessionId ).toStrongRef();
+  if( session )
+  {
+    fSession = session;
+  }
+  else
+  {
+    dropEndedSessions();
+    s_Sessions.insert( sessionId, fSession );
+  }
+}
+
+// Stats wait for the jobs queued before them on the file, the reply is sent from statDone()
 void ServerConnection::recvStatFileReq( const QString &filename )
 {
-  QString absfilepath = fSourceDir+"/"+filename;
-  QFileInfo fileInfo( absfilepath );
-  if( fileInfo.isFile() )
+  StatJob *job = new StatJob( joinPath(fSession->sourceDir(), filename), filename );
+  connect( job, SIGNAL(finished()), SLOT(statDone()) );
+  DiskQueue::instance()->start( job );
+}
+
+void ServerConnection::statDone()
+{
+  StatJob *job = dynamic_cast<StatJob*>( sender() );
+  if( !job )
+    return;
+  if( job->result() )
   {
-    QDateTime time = fileInfo.lastModified();
-    sendStatFileReply( filename, time );
+    sendStatFileReply( job->filename(), QDateTime::fromMSecsSinceEpoch(job->statMtime()) );
   }
   else
   {
-    qWarning() << "Could not get mtime for \"" << filename << "\"";
-    sendStatFileReply( filename, QDateTime() );
+    qWarning() << "Could not get mtime for \"" << job->filename() << "\"";
+    sendStatFileReply( job->filename(), QDateTime() );
   }
-  
+}
+
+void ServerConnection::recvStatFileBatchReq( quint32 id, const QString &dir, const QStringList &names )
+{
+  if( names.isEmpty() )
+  {
+    sendStatFileBatchReply( id, QVector<qint64>(), QVector<qint64>() );
+    return;
+  }
+
+  QString absdir = joinPath( fSession->sourceDir(), dir );
+  QStringList paths;
+  foreach( const QString &name, names )
+    paths.append( joinPath(absdir, name) );
+  StatBatchJob *job = new StatBatchJob( id, paths );
+  connect( job, SIGNAL(finished()), SLOT(statBatchDone()) );
+  DiskQueue::instance()->start( job );
+}
+
+void ServerConnection::statBatchDone()
+{
+  StatBatchJob *job = dynamic_cast<StatBatchJob*>( sender() );
+  if( job )
+    sendStatFileBatchReply( job->id(), job->mtimes(), job->sizes() );
+}
+
+// The walk runs on the disk pool, the entries are sent from manifestEntries() as they come in
+void ServerConnection::recvManifestReq()
+{
+  qDebug() << "Manifest request for " << fSession->sourceDir();
+
+  ManifestJob *job = new ManifestJob( QDir(fSession->sourceDir()).absolutePath() );
+  connect( job, SIGNAL(entries(const QStringList &, const QVector<qint64> &, const QVector<qint64> &)),
+           SLOT(manifestEntries(const QStringList &, const QVector<qint64> &, const QVector<qint64> &)) );
+  connect( job, SIGNAL(finished()), SLOT(manifestDone()) );
+  DiskQueue::instance()->start( job );
+}
+
+void ServerConnection::manifestEntries( const QStringList &paths, const QVector<qint64> &mtimes, const QVector<qint64> &sizes )
+{
+  sendManifestEntries( paths, mtimes, sizes );
+}
+
+void ServerConnection::manifestDone()
+{
+  ManifestJob *job = dynamic_cast<ManifestJob*>( sender() );
+  if( job )
+    sendManifestEnd( job->count() );
 }
 
 void ServerConnection::recvSendFile( const QString &filename, const QDateTime &mtime, const QByteArray &data, bool executable )
 {
-  qDebug() << "File " << fSourceDir << filename << " datasize " << data.size() << " date: " << mtime;
+  qDebug() << "File " << fSession->sourceDir() << filename << " datasize " << data.size() << " date: " << mtime;
 
-  QFile file( joinPath(fSourceDir,filename) );
-  if( !file.open(QIODevice::WriteOnly) )
+  //the result is sent from fileWritten() once the pool has written the file
+  QString path = joinPath( fSession->sourceDir(), filename );
+  s_HashCache.remove( path );
+  WriteFileJob *job = new WriteFileJob( path, filename, mtime, data, executable );
+  connect( job, SIGNAL(finished()), SLOT(fileWritten()) );
+  //the client gets credit for the data once it is on disk, not when it is queued
+  fHeldCredit.insert( job, holdCredit() );
+  DiskQueue::instance()->start( job );
+}
+
+void ServerConnection::fileWritten()
+{
+  DiskJob *job = qobject_cast<DiskJob*>( sender() );
+  if( !job )
+    return;
+  storeHash( job );
+  releaseCredit( fHeldCredit.take(job) );
+  sendSendFileResult( job->filename(), job->mtime(), job->result() );
+}
+
+
+void ServerConnection::recvSendFileBegin( const QString &filename, const QDateTime &mtime, bool executable )
+{
+  qDebug() << "Streamed file " << fSession->sourceDir() << filename << " date: " << mtime;
+
+  if( fStream )
   {
-    // maybe we are missing some directories
-    QString filedir = joinPath( fSourceDir, filename ).section( '/', 0, -2 );
-    QDir dir(filedir);
-    bool result = true;
-    if(!dir.exists())
-    {
-      result = dir.mkpath(filedir);
-    }
+    //the previous stream never got its end packet, it can not be trusted
+    qWarning() << "Streamed file \"" << fStreamFilename << "\" was not completed";
+    recvSendFileEnd( false );
+  }
 
-    if( !result )
-    {
-      qWarning() << "Could not create path \"" << filedir << "\"";
-    }
-    else
-    {
-      file.open( QIODevice::WriteOnly );
-    }
+  fStreamPath = joinPath( fSession->sourceDir(), filename );
+  fStreamFilename = filename;
+  fStreamMtime = mtime;
+  fStreamExecutable = executable;
+  fStreamHasher = ContentHasher();
+  fStreamSize = 0;
+  s_HashCache.remove( fStreamPath );
+  //the file is created by the first job on it, the event loop never waits for the disk
+  fStream = QSharedPointer<FileStream>( new FileStream(fStreamPath) );
+}
+
+// The chunks are hashed as they arrive and written on the pool in order, the client gets credit
+// for a chunk once it is written
+void ServerConnection::recvSendFileChunk( const QByteArray &data )
+{
+  if( !fStream )
+    return;
+  fStreamHasher.update( data );
+  fStreamSize += data.size();
+  FileChunkJob *job = new FileChunkJob( fStreamPath, fStreamFilename, fStream, data );
+  connect( job, SIGNAL(finished()), SLOT(chunkWritten()) );
+  fHeldCredit.insert( job, holdCredit() );
+  DiskQueue::instance()->start( job );
+}
+
+void ServerConnection::chunkWritten()
+{
+  releaseCredit( fHeldCredit.take(sender()) );
+}
+
+void ServerConnection::recvSendFileEnd( bool complete )
+{
+  if( !fStream )
+  {
+    qWarning() << "Got the end of a streamed file that was never started";
+    return;
   }
-  
-  if( !file.isOpen() )
+  if( !complete )
   {
-    sendSendFileResult( filename, mtime, false );
-    qWarning() << "Could not create file \"" << filename << "\"";
+    qWarning() << "Streamed file \"" << fStreamFilename << "\" was aborted by the client";
   }
-  else
+
+  //queued behind the chunks, the result is sent from fileWritten()
+  CommitJob *job = new CommitJob( fStreamPath, fStreamFilename, fStreamMtime, fStream, fStreamExecutable, complete,
+                                  fStreamHasher.result(), fStreamSize );
+  connect( job, SIGNAL(finished()), SLOT(fileWritten()) );
+  DiskQueue::instance()->start( job );
+  fStream.clear();
+}
+
+void ServerConnection::recvSignatureReq( const QString &filename, int blockSize )
+{
+  if( blockSize < 512 || blockSize > (1<<20) )
   {
-    file.write( data );
-    if(executable)
-    {
-      file.setPermissions(file.permissions()|QFile::ExeOwner|QFile::ExeGroup|QFile::ExeOther);
-    }
-    file.flush();
-    
-    // For some reason QFileInfo is lacking setLastModified()
-    struct timeval times[2];
-    times[0].tv_sec = times[1].tv_sec = mtime.toTime_t();
-    times[0].tv_usec = times[1].tv_usec = 0;
-    if( futimes(file.handle(), times) != 0 )
-    {
-      sendSendFileResult( filename, mtime, false );
-      qWarning() << "Could not set times on file \"" << filename << "\"";
-    }
-    else
-    {
-      sendSendFileResult( filename, mtime, true );
-    }
+    qWarning() << "Refusing signature of \"" << filename << "\" with block size " << blockSize;
+    DeltaSignature signature;
+    signature.fBlockSize = blockSize;
+    sendSignatureReply( filename, signature );
+    return;
   }
+
+  //the file is read on the pool, the reply is sent from signatureDone()
+  SignatureJob *job = new SignatureJob( joinPath(fSession->sourceDir(), filename), filename, blockSize );
+  connect( job, SIGNAL(finished()), SLOT(signatureDone()) );
+  DiskQueue::instance()->start( job );
 }
 
-void ServerConnection::recvDeleteFile( const QString &filename )
+void ServerConnection::signatureDone()
+{
+  SignatureJob *job = dynamic_cast<SignatureJob*>( sender() );
+  if( job )
+    sendSignatureReply( job->filename(), job->signature() );
+}
+
+void ServerConnection::recvSendDelta( const QString &filename, const QDateTime &mtime, int blockSize, const QByteArray &delta, bool executable )
+{
+  qDebug() << "Delta " << fSession->sourceDir() << filename << " deltasize " << delta.size() << " date: " << mtime;
+
+  QString path = joinPath( fSession->sourceDir(), filename );
+  s_HashCache.remove( path );
+  DeltaJob *job = new DeltaJob( path, filename, mtime, blockSize, delta, executable );
+  connect( job, SIGNAL(finished()), SLOT(fileWritten()) );
+  fHeldCredit.insert( job, holdCredit() );
+  DiskQueue::instance()->start( job );
+}
+
+// The pieces of a streamed delta are applied on the pool in the order they arrive, each one holds
+// its credit until it is written. The result is sent from fileWritten()
+void ServerConnection::recvSendDeltaBegin( const QString &filename, const QDateTime &mtime, int blockSize, bool executable )
 {
-  qDebug() << "DeleteFile request for " << fSourceDir << filename;
+  qDebug() << "Streamed delta " << fSession->sourceDir() << filename << " date: " << mtime;
 
-  QFile file( joinPath(fSourceDir,filename) );
-  if(!file.remove())
+  if( fDelta )
   {
-    qDebug() << "Could not remove " << fSourceDir << filename;
+    qWarning() << "Streamed delta of \"" << fDeltaFilename << "\" was not completed";
+    recvSendDeltaEnd( false );
+    sendSendFileResult( fDeltaFilename, fDeltaMtime, false );
   }
+
+  fDeltaPath = joinPath( fSession->sourceDir(), filename );
+  fDeltaFilename = filename;
+  fDeltaMtime = mtime;
+  fDeltaExecutable = executable;
+  s_HashCache.remove( fDeltaPath );
+  fDelta = QSharedPointer<DeltaStream>( new DeltaStream(fDeltaPath, blockSize) );
+}
+
+void ServerConnection::recvSendDeltaChunk( const QByteArray &ops )
+{
+  if( !fDelta )
+    return;
+  DeltaChunkJob *job = new DeltaChunkJob( fDeltaPath, fDeltaFilename, fDelta, ops );
+  connect( job, SIGNAL(finished()), SLOT(chunkWritten()) );
+  fHeldCredit.insert( job, holdCredit() );
+  DiskQueue::instance()->start( job );
+}
+
+// An incomplete delta is dropped without a result, the client sends the whole file instead
+void ServerConnection::recvSendDeltaEnd( bool complete )
+{
+  if( !fDelta )
+  {
+    qWarning() << "Got the end of a streamed delta that was never started";
+    return;
+  }
+
+  DeltaEndJob *job = new DeltaEndJob( fDeltaPath, fDeltaFilename, fDeltaMtime, fDelta, fDeltaExecutable, complete );
+  if( complete )
+    connect( job, SIGNAL(finished()), SLOT(fileWritten()) );
+  DiskQueue::instance()->start( job );
+  fDelta.clear();
+}
+
+// The client has a file with a new mtime, if the content is the same as ours only the mtime is updated.
+// The file is hashed on the pool, the reply is sent from hashChecked()
+void ServerConnection::recvHashCheckReq( const QString &filename, const QDateTime &mtime, qint64 size, const QByteArray &hash )
+{
+  HashCheckJob *job = new HashCheckJob( joinPath(fSession->sourceDir(), filename), filename, mtime, size, hash, false, false );
+  connect( job, SIGNAL(finished()), SLOT(hashChecked()) );
+  DiskQueue::instance()->start( job );
+}
+
+// A hash check that falls back to copying the content from another file in the store
+void ServerConnection::recvMaterializeReq( const QString &filename, const QDateTime &mtime, qint64 size, const QByteArray &hash, bool executable )
+{
+  HashCheckJob *job = new HashCheckJob( joinPath(fSession->sourceDir(), filename), filename, mtime, size, hash, true, executable );
+  connect( job, SIGNAL(finished()), SLOT(hashChecked()) );
+  DiskQueue::instance()->start( job );
+}
+
+void ServerConnection::hashChecked()
+{
+  DiskJob *job = qobject_cast<DiskJob*>( sender() );
+  if( !job )
+    return;
+  storeHash( job );
+  sendHashCheckReply( job->filename(), job->mtime(), job->result() );
+}
+
+void ServerConnection::recvDeleteFile( const QString &filename )
+{
+  qDebug() << "DeleteFile request for " << fSession->sourceDir() << filename;
+
+  QString path = joinPath( fSession->sourceDir(), filename );
+  s_HashCache.remove( path );
+  DiskQueue::instance()->start( new DeleteJob(path, filename) );
+}
+
+// Moves a file or directory in place, the client sends the data again when this fails. A directory
+// is moved once the jobs below it are done, the reply is sent from renameDone()
+void ServerConnection::recvRename( const QString &oldName, const QString &newName, bool directory )
+{
+  qDebug() << "Rename request for " << fSession->sourceDir() << oldName << " to " << newName;
+
+  QString oldPath = joinPath( fSession->sourceDir(), oldName );
+  QString newPath = joinPath( fSession->sourceDir(), newName );
+  RenameJob *job = new RenameJob( oldPath, newPath, oldName, newName, directory );
+  connect( job, SIGNAL(finished()), SLOT(renameDone()) );
+  DiskQueue::instance()->start( job );
+}
+
+void ServerConnection::renameDone()
+{
+  RenameJob *job = dynamic_cast<RenameJob*>( sender() );
+  if( job )
+    sendRenameResult( job->filename(), job->newName(), job->isDirectory(), job->result() );
 }
 
 
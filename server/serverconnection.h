@@ -4,6 +4,48 @@
 #define QUICKSYNC_SERVERCONNECTION_H
 
 #include "shared/remoteobjectconnection.h"
+#include "shared/contenthash.h"
+#include "diskqueue.h"
+
+//-----------------------------------------------------------------------------
+
+//! State shared by all connections of a client session, they may run on different threads
+class ServerSession
+{
+public:
+  QString sourceDir() const { QMutexLocker lock( &fMutex ); return fSourceDir; }
+  void setSourceDir( const QString &dir ) { QMutexLocker lock( &fMutex ); fSourceDir = dir; }
+
+private:
+  mutable QMutex fMutex;
+  QString fSourceDir;
+};
+
+//-----------------------------------------------------------------------------
+
+class FileStream;
+class DeltaStream;
+
+//! Walks a target directory on the disk pool. The entries are posted back in batches while the
+//! walk goes on, finished() follows the last batch
+class ManifestJob : public DiskJob
+{
+  Q_OBJECT
+public:
+  ManifestJob( const QString &root );
+
+  qint64 count() const { return fCount; }
+
+signals:
+  void entries( const QStringList &paths, const QVector<qint64> &mtimes, const QVector<qint64> &sizes );
+
+protected:
+  virtual bool changesFiles() const { return false; }
+  virtual bool execute();
+
+private:
+  qint64 fCount;
+};
 
 //-----------------------------------------------------------------------------
 
@@ -12,17 +54,61 @@ class ServerConnection : public RemoteObjectConnection
   Q_OBJECT
 public:
   ServerConnection( const QString &sourcedir, QTcpSocket *socket );
+  virtual ~ServerConnection();
 
 private slots:
   void recvTargetDirectory(const QString &path);
+  void recvJoinSession( const QByteArray &sessionId );
   void recvStatFileReq( const QString &filename );
+  void recvStatFileBatchReq( quint32 id, const QString &dir, const QStringList &names );
+  void recvManifestReq();
   void recvSendFile( const QString &filename, const QDateTime &mtime, const QByteArray &data, bool executable );
+  void recvSendFileBegin( const QString &filename, const QDateTime &mtime, bool executable );
+  void recvSendFileChunk( const QByteArray &data );
+  void recvSendFileEnd( bool complete );
+  void recvSignatureReq( const QString &filename, int blockSize );
+  void recvSendDelta( const QString &filename, const QDateTime &mtime, int blockSize, const QByteArray &delta, bool executable );
+  void recvSendDeltaBegin( const QString &filename, const QDateTime &mtime, int blockSize, bool executable );
+  void recvSendDeltaChunk( const QByteArray &ops );
+  void recvSendDeltaEnd( bool complete );
+  void recvHashCheckReq( const QString &filename, const QDateTime &mtime, qint64 size, const QByteArray &hash );
+  void recvMaterializeReq( const QString &filename, const QDateTime &mtime, qint64 size, const QByteArray &hash, bool executable );
   void recvDeleteFile( const QString &filename );
+  void recvRename( const QString &oldName, const QString &newName, bool directory );
+  //Replies to the jobs started on the disk queue
+  void statDone();
+  void statBatchDone();
+  void fileWritten();
+  void signatureDone();
+  void hashChecked();
+  void renameDone();
+  void chunkWritten();
+  void manifestEntries( const QStringList &paths, const QVector<qint64> &mtimes, const QVector<qint64> &sizes );
+  void manifestDone();
 private:
   QString fDefaultSourceDir;
-  QString fSourceDir;
+  QSharedPointer<ServerSession> fSession;
 
   QSet<QString> fFiles;
+  //Credit held for the data of write jobs until they are done
+  QHash<QObject*, qint64> fHeldCredit;
+
+  //State of the streamed transfer in progress, only one file is streamed at a time on a connection
+  QSharedPointer<FileStream> fStream;
+  QString fStreamPath;
+  QString fStreamFilename;
+  QDateTime fStreamMtime;
+  bool fStreamExecutable;
+  //Hash of the chunks received so far
+  ContentHasher fStreamHasher;
+  qint64 fStreamSize;
+
+  //State of the streamed delta in progress
+  QSharedPointer<DeltaStream> fDelta;
+  QString fDeltaPath;
+  QString fDeltaFilename;
+  QDateTime fDeltaMtime;
+  bool fDeltaExecutable;
 };
 
 //-----------------------------------------------------------------------------
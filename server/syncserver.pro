@@ -10,6 +10,6 @@ INCLUDEPATH += ..
 
 PRECOMPILED_HEADER = ../prefix.h
 
-HEADERS		= serverapp.h serverconnection.h ../shared/remoteobjectconnection.h
-SOURCES		= serverapp.cpp serverconnection.cpp \
-	../shared/utils.cpp ../shared/remoteobjectconnection.cpp
+HEADERS		= serverapp.h serverconnection.h diskqueue.h metadataindex.h ../shared/remoteobjectconnection.h ../shared/wireformat.h ../shared/contenthash.h ../shared/deltasync.h
+SOURCES		= serverapp.cpp serverconnection.cpp diskqueue.cpp metadataindex.cpp \
+	../shared/utils.cpp ../shared/remoteobjectconnection.cpp ../shared/wireformat.cpp ../shared/contenthash.cpp ../shared/deltasync.cpp
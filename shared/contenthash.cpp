@@ -0,0 +1,313 @@
+#include "PreCompile.h"
+#include "contenthash.h"
+
+//-----------------------------------------------------------------------------
+// Straight port of the BLAKE3 reference implementation, hash mode only
+
+namespace
+{
+  const quint32 IV[8] = { 0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19 };
+  const int MSG_PERMUTATION[16] = { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 };
+
+  enum
+  {
+    CHUNK_START = 1<<0,
+    CHUNK_END   = 1<<1,
+    PARENT      = 1<<2,
+    ROOT        = 1<<3
+  };
+
+  const quint32 BLOCK_LEN = 64;
+  const quint32 CHUNK_LEN = 1024;
+
+  inline quint32 rotr( quint32 x, int n ) { return (x >> n) | (x << (32 - n)); }
+
+  inline void g( quint32 state[16], int a, int b, int c, int d, quint32 mx, quint32 my )
+  {
+    state[a] = state[a] + state[b] + mx;
+    state[d] = rotr( state[d] ^ state[a], 16 );
+    state[c] = state[c] + state[d];
+    state[b] = rotr( state[b] ^ state[c], 12 );
+    state[a] = state[a] + state[b] + my;
+    state[d] = rotr( state[d] ^ state[a], 8 );
+    state[c] = state[c] + state[d];
+    state[b] = rotr( state[b] ^ state[c], 7 );
+  }
+
+  inline void round( quint32 state[16], const quint32 m[16] )
+  {
+    //columns
+    g( state, 0, 4, 8, 12, m[0], m[1] );
+    g( state, 1, 5, 9, 13, m[2], m[3] );
+    g( state, 2, 6, 10, 14, m[4], m[5] );
+    g( state, 3, 7, 11, 15, m[6], m[7] );
+    //diagonals
+    g( state, 0, 5, 10, 15, m[8], m[9] );
+    g( state, 1, 6, 11, 12, m[10], m[11] );
+    g( state, 2, 7, 8, 13, m[12], m[13] );
+    g( state, 3, 4, 9, 14, m[14], m[15] );
+  }
+
+  void compress( const quint32 cv[8], const quint32 blockWords[16], quint64 counter, quint32 blockLen, quint32 flags, quint32 out[16] )
+  {
+    quint32 state[16] = {
+      cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+      IV[0], IV[1], IV[2], IV[3],
+      static_cast<quint32>(counter), static_cast<quint32>(counter >> 32), blockLen, flags
+    };
+    quint32 block[16];
+    memcpy( block, blockWords, sizeof(block) );
+
+    for( int r=0; r<7; ++r )
+    {
+      round( state, block );
+      if( r < 6 )
+      {
+        quint32 permuted[16];
+        for( int i=0; i<16; ++i )
+          permuted[i] = block[MSG_PERMUTATION[i]];
+        memcpy( block, permuted, sizeof(block) );
+      }
+    }
+
+    for( int i=0; i<8; ++i )
+    {
+      out[i] = state[i] ^ state[i+8];
+      out[i+8] = state[i+8] ^ cv[i];
+    }
+  }
+
+  void wordsFromBlock( const uchar block[64], quint32 words[16] )
+  {
+    for( int i=0; i<16; ++i )
+    {
+      const uchar *p = block + i*4;
+      words[i] = quint32(p[0]) | (quint32(p[1]) << 8) | (quint32(p[2]) << 16) | (quint32(p[3]) << 24);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+void ContentHasher::Output::chainingValue( quint32 cv[8] ) const
+{
+  quint32 out[16];
+  compress( fInputCv, fBlockWords, fCounter, fBlockLen, fFlags, out );
+  memcpy( cv, out, 8*sizeof(quint32) );
+}
+
+ContentHasher::ContentHasher()
+{
+  memcpy( fChunkCv, IV, sizeof(fChunkCv) );
+  fChunkCounter = 0;
+  memset( fBlock, 0, sizeof(fBlock) );
+  fBlockLen = 0;
+  fBlocksCompressed = 0;
+  fCvStackLen = 0;
+}
+
+void ContentHasher::compressChunkBlock()
+{
+  quint32 words[16];
+  wordsFromBlock( fBlock, words );
+  quint32 out[16];
+  compress( fChunkCv, words, fChunkCounter, BLOCK_LEN, fBlocksCompressed == 0 ? CHUNK_START : 0, out );
+  memcpy( fChunkCv, out, sizeof(fChunkCv) );
+  fBlocksCompressed++;
+  memset( fBlock, 0, sizeof(fBlock) );
+  fBlockLen = 0;
+}
+
+ContentHasher::Output ContentHasher::chunkOutput() const
+{
+  Output output;
+  memcpy( output.fInputCv, fChunkCv, sizeof(output.fInputCv) );
+  wordsFromBlock( fBlock, output.fBlockWords );
+  output.fCounter = fChunkCounter;
+  output.fBlockLen = fBlockLen;
+  output.fFlags = (fBlocksCompressed == 0 ? CHUNK_START : 0) | CHUNK_END;
+  return output;
+}
+
+static void parentOutput( const quint32 left[8], const quint32 right[8], quint32 inputCv[8], quint32 blockWords[16] )
+{
+  memcpy( inputCv, IV, 8*sizeof(quint32) );
+  memcpy( blockWords, left, 8*sizeof(quint32) );
+  memcpy( blockWords+8, right, 8*sizeof(quint32) );
+}
+
+void ContentHasher::addChunkChainingValue( quint32 cv[8], quint64 totalChunks )
+{
+  //every completed subtree is merged with its left sibling, the number of trailing zero bits is the number of merges
+  while( (totalChunks & 1) == 0 )
+  {
+    Output parent;
+    parentOutput( fCvStack[--fCvStackLen], cv, parent.fInputCv, parent.fBlockWords );
+    parent.fCounter = 0;
+    parent.fBlockLen = BLOCK_LEN;
+    parent.fFlags = PARENT;
+    parent.chainingValue( cv );
+    totalChunks >>= 1;
+  }
+  memcpy( fCvStack[fCvStackLen++], cv, 8*sizeof(quint32) );
+}
+
+void ContentHasher::update( const char *data, qint64 len )
+{
+  const uchar *input = reinterpret_cast<const uchar*>( data );
+  while( len > 0 )
+  {
+    if( fBlocksCompressed * BLOCK_LEN + fBlockLen == CHUNK_LEN )
+    {
+      //the chunk is full and there is more input, so it is not the last one
+      quint32 cv[8];
+      chunkOutput().chainingValue( cv );
+      quint64 totalChunks = fChunkCounter + 1;
+      addChunkChainingValue( cv, totalChunks );
+      memcpy( fChunkCv, IV, sizeof(fChunkCv) );
+      fChunkCounter = totalChunks;
+      memset( fBlock, 0, sizeof(fBlock) );
+      fBlockLen = 0;
+      fBlocksCompressed = 0;
+    }
+    if( fBlockLen == BLOCK_LEN )
+    {
+      compressChunkBlock();
+    }
+    quint32 take = static_cast<quint32>( qMin<qint64>(BLOCK_LEN - fBlockLen, len) );
+    memcpy( fBlock + fBlockLen, input, take );
+    fBlockLen += take;
+    input += take;
+    len -= take;
+  }
+}
+
+QByteArray ContentHasher::result() const
+{
+  Output output = chunkOutput();
+  for( int i=fCvStackLen-1; i>=0; --i )
+  {
+    quint32 cv[8];
+    output.chainingValue( cv );
+    parentOutput( fCvStack[i], cv, output.fInputCv, output.fBlockWords );
+    output.fCounter = 0;
+    output.fBlockLen = BLOCK_LEN;
+    output.fFlags = PARENT;
+  }
+
+  quint32 words[16];
+  compress( output.fInputCv, output.fBlockWords, 0, output.fBlockLen, output.fFlags | ROOT, words );
+  QByteArray hash( HashSize, Qt::Uninitialized );
+  for( int i=0; i<8; ++i )
+  {
+    hash[i*4] = char(words[i]);
+    hash[i*4+1] = char(words[i] >> 8);
+    hash[i*4+2] = char(words[i] >> 16);
+    hash[i*4+3] = char(words[i] >> 24);
+  }
+  return hash;
+}
+
+QByteArray ContentHasher::hashFile( const QString &path, bool stripCarriageReturns, qint64 &size )
+{
+  size = 0;
+  QFile file( path );
+  if( !file.open(QIODevice::ReadOnly) )
+    return QByteArray();
+
+  ContentHasher hasher;
+  QByteArray buffer( 1<<20, Qt::Uninitialized );
+  for(;;)
+  {
+    qint64 read = file.read( buffer.data(), buffer.size() );
+    if( read < 0 )
+      return QByteArray();
+    if( read == 0 )
+      break;
+
+    if( stripCarriageReturns )
+    {
+      char *dst = buffer.data();
+      for( const char *src = buffer.constData(); src != buffer.constData() + read; ++src )
+      {
+        if( *src != 0x0d )
+          *dst++ = *src;
+      }
+      read = dst - buffer.data();
+    }
+    hasher.update( buffer.constData(), read );
+    size += read;
+  }
+  return hasher.result();
+}
+
+//-----------------------------------------------------------------------------
+
+void ContentHashCache::clear()
+{
+  QMutexLocker lock( &fMutex );
+  fEntries.clear();
+  fPaths.clear();
+}
+
+QList<QString> ContentHashCache::paths( const QByteArray &hash ) const
+{
+  QMutexLocker lock( &fMutex );
+  return fPaths.values( hash );
+}
+
+bool ContentHashCache::lookup( const QString &path, qint64 mtime, qint64 size, QByteArray &hash ) const
+{
+  QMutexLocker lock( &fMutex );
+  QHash<QString, Entry>::const_iterator i = fEntries.find( path );
+  if( i == fEntries.end() || i.value().fMtime != mtime || i.value().fSize != size )
+    return false;
+  hash = i.value().fHash;
+  return true;
+}
+
+void ContentHashCache::insert( const QString &path, qint64 mtime, qint64 size, const QByteArray &hash )
+{
+  QMutexLocker lock( &fMutex );
+  Entry &entry = fEntries[path];
+  if( entry.fHash != hash )
+  {
+    if( !entry.fHash.isEmpty() )
+      fPaths.remove( entry.fHash, path );
+    fPaths.insert( hash, path );
+  }
+  entry.fMtime = mtime;
+  entry.fSize = size;
+  entry.fHash = hash;
+}
+
+void ContentHashCache::remove( const QString &path )
+{
+  QMutexLocker lock( &fMutex );
+  QHash<QString, Entry>::iterator i = fEntries.find( path );
+  if( i != fEntries.end() )
+  {
+    fPaths.remove( i.value().fHash, path );
+    fEntries.erase( i );
+  }
+}
+
+void ContentHashCache::removeDirectory( const QString &dir )
+{
+  QMutexLocker lock( &fMutex );
+  QString prefix = dir.endsWith('/') ? dir : dir + '/';
+  for( QHash<QString, Entry>::iterator i = fEntries.begin(); i != fEntries.end(); )
+  {
+    if( i.key().startsWith(prefix) )
+    {
+      fPaths.remove( i.value().fHash, i.key() );
+      i = fEntries.erase( i );
+    }
+    else
+    {
+      ++i;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
@@ -0,0 +1,77 @@
+#ifndef QUICKSYNC_CONTENTHASH_H
+#define QUICKSYNC_CONTENTHASH_H
+
+//-----------------------------------------------------------------------------
+// BLAKE3 content hashing, used to detect files that have a new mtime but
+// the same content as the copy on the other side.
+//-----------------------------------------------------------------------------
+
+class ContentHasher
+{
+public:
+  enum { HashSize = 32 };
+
+  ContentHasher();
+
+  void update( const char *data, qint64 len );
+  void update( const QByteArray &data ) { update( data.constData(), data.size() ); }
+  QByteArray result() const;
+
+  //! Hash of the file contents, with \r removed when stripCarriageReturns is set so it matches what
+  //! the server stores for text files. size is set to the number of bytes hashed. Returns an empty array on errors
+  static QByteArray hashFile( const QString &path, bool stripCarriageReturns, qint64 &size );
+
+private:
+  struct Output
+  {
+    quint32 fInputCv[8];
+    quint32 fBlockWords[16];
+    quint64 fCounter;
+    quint32 fBlockLen;
+    quint32 fFlags;
+    void chainingValue( quint32 cv[8] ) const;
+  };
+
+  void compressChunkBlock();
+  Output chunkOutput() const;
+  void addChunkChainingValue( quint32 cv[8], quint64 totalChunks );
+
+  //current chunk
+  quint32 fChunkCv[8];
+  quint64 fChunkCounter;
+  uchar fBlock[64];
+  quint32 fBlockLen;
+  quint32 fBlocksCompressed;
+
+  //chaining values of completed subtrees
+  quint32 fCvStack[54][8];
+  int fCvStackLen;
+};
+
+//-----------------------------------------------------------------------------
+
+//! Hashes remembered by path, only valid while the file keeps the same mtime and size.
+//! Also indexes the paths by hash so files with a given content can be found. Safe to share
+//! between threads
+class ContentHashCache
+{
+public:
+  bool lookup( const QString &path, qint64 mtime, qint64 size, QByteArray &hash ) const;
+  void insert( const QString &path, qint64 mtime, qint64 size, const QByteArray &hash );
+  void remove( const QString &path );
+  //! Forget all files below the directory dir
+  void removeDirectory( const QString &dir );
+  void clear();
+  //! Paths that had this content when they were inserted, check them with lookup before use
+  QList<QString> paths( const QByteArray &hash ) const;
+
+private:
+  struct Entry { qint64 fMtime; qint64 fSize; QByteArray fHash; };
+  QHash<QString, Entry> fEntries;
+  QMultiHash<QByteArray, QString> fPaths;
+  mutable QMutex fMutex;
+};
+
+//-----------------------------------------------------------------------------
+
+#endif //QUICKSYNC_CONTENTHASH_H
@@ -0,0 +1,290 @@
+#include "PreCompile.h"
+#include "deltasync.h"
+#include "wireformat.h"
+#include <QtCore/QtEndian>
+
+//-----------------------------------------------------------------------------
+
+enum { DELTA_LITERAL, DELTA_COPY };
+
+//Literals are split so a single op never needs a huge contiguous write
+static const int s_MaxLiteral = 1<<20;
+
+PacketWriter &operator<<( PacketWriter &stream, const DeltaSignature &signature )
+{
+  stream << signature.fBlockSize << signature.fWeak << signature.fStrong;
+  return stream;
+}
+
+PacketReader &operator>>( PacketReader &stream, DeltaSignature &signature )
+{
+  stream >> signature.fBlockSize >> signature.fWeak >> signature.fStrong;
+  return stream;
+}
+
+//-----------------------------------------------------------------------------
+
+int deltaBlockSize( qint64 fileSize )
+{
+  int blockSize = static_cast<int>( sqrt(static_cast<double>(fileSize)) );
+  blockSize = (blockSize + 1023) & ~1023;
+  return qBound( 2048, blockSize, 1<<16 );
+}
+
+quint32 deltaWeakChecksum( const uchar *data, int len )
+{
+  quint32 a = 0;
+  quint32 b = 0;
+  for( int i=0; i<len; ++i )
+  {
+    a += data[i];
+    b += static_cast<quint32>(len - i) * data[i];
+  }
+  return (a & 0xffff) | (b << 16);
+}
+
+QByteArray deltaStrongChecksum( const uchar *data, int len )
+{
+  return QCryptographicHash::hash( QByteArray::fromRawData(reinterpret_cast<const char*>(data), len), QCryptographicHash::Md5 );
+}
+
+//-----------------------------------------------------------------------------
+
+DeltaSignature computeDeltaSignature( QIODevice &device, int blockSize )
+{
+  DeltaSignature signature;
+  signature.fBlockSize = blockSize;
+
+  QByteArray block( blockSize, Qt::Uninitialized );
+  for(;;)
+  {
+    qint64 read = device.read( block.data(), blockSize );
+    if( read != blockSize )
+      break;
+    const uchar *data = reinterpret_cast<const uchar*>( block.constData() );
+    signature.fWeak.append( deltaWeakChecksum(data, blockSize) );
+    signature.fStrong.append( deltaStrongChecksum(data, blockSize) );
+  }
+  return signature;
+}
+
+//-----------------------------------------------------------------------------
+
+DeltaComputer::DeltaComputer( const uchar *data, qint64 size, const DeltaSignature &signature ) :
+  fData( data ), fSize( size ), fSignature( signature ), fBlockSize( signature.fBlockSize ),
+  fPos( 0 ), fLiteralStart( 0 ), fA( 0 ), fB( 0 ), fRolling( false ), fDone( false ),
+  fRunStart( 0 ), fRunCount( 0 ), fLiteralBytes( 0 )
+{
+  fWeakToBlock.reserve( signature.blockCount() );
+  for( int i=0; i<signature.blockCount(); ++i )
+  {
+    fWeakToBlock.insert( signature.fWeak.at(i), i );
+  }
+  if( fBlockSize <= 0 || fWeakToBlock.isEmpty() || fSize < fBlockSize )
+    fPos = fSize;
+}
+
+// Runs the scan until chunkSize bytes of ops are ready or the file is done
+QByteArray DeltaComputer::next( int chunkSize )
+{
+  while( fOps.size() < chunkSize && !fDone )
+  {
+    if( fPos + fBlockSize > fSize || fBlockSize <= 0 )
+    {
+      //the tail goes out as literals, one op at a time so the pending ops stay small
+      if( fSize > fLiteralStart )
+      {
+        qint64 len = qMin<qint64>( fSize-fLiteralStart, s_MaxLiteral );
+        literal( fData+fLiteralStart, len );
+        fLiteralStart += len;
+        continue;
+      }
+      flush();
+      fDone = true;
+      break;
+    }
+
+    //a and b are the two halves of the rolling checksum over [pos, pos+blockSize)
+    if( !fRolling )
+    {
+      fA = 0;
+      fB = 0;
+      for( qint64 i=0; i<fBlockSize; ++i )
+      {
+        fA += fData[fPos+i];
+        fB += static_cast<quint32>(fBlockSize - i) * fData[fPos+i];
+      }
+      fRolling = true;
+    }
+
+    quint32 weak = (fA & 0xffff) | (fB << 16);
+    int match = -1;
+    QMultiHash<quint32, int>::const_iterator i = fWeakToBlock.constFind( weak );
+    if( i != fWeakToBlock.constEnd() )
+    {
+      QByteArray strong = deltaStrongChecksum( fData+fPos, fBlockSize );
+      for( ; i != fWeakToBlock.constEnd() && i.key() == weak; ++i )
+      {
+        if( fSignature.fStrong.at(i.value()) == strong )
+        {
+          match = i.value();
+          break;
+        }
+      }
+    }
+
+    if( match >= 0 )
+    {
+      if( fPos > fLiteralStart )
+        literal( fData+fLiteralStart, fPos-fLiteralStart );
+      copy( static_cast<quint32>(match) );
+      fPos += fBlockSize;
+      fLiteralStart = fPos;
+      fRolling = false;
+    }
+    else
+    {
+      if( fPos + fBlockSize < fSize )
+      {
+        quint32 out = fData[fPos];
+        quint32 in = fData[fPos+fBlockSize];
+        fA = fA - out + in;
+        fB = fB - static_cast<quint32>(fBlockSize) * out + fA;
+      }
+      fPos++;
+      //long runs without a match are handed out before they are complete
+      if( fPos - fLiteralStart >= s_MaxLiteral )
+      {
+        literal( fData+fLiteralStart, fPos-fLiteralStart );
+        fLiteralStart = fPos;
+      }
+    }
+  }
+
+  QByteArray chunk = fOps.left( chunkSize );
+  fOps.remove( 0, chunk.size() );
+  return chunk;
+}
+
+// References to consecutive blocks are merged into a single copy
+void DeltaComputer::copy( quint32 block )
+{
+  if( fRunCount > 0 && fRunStart + fRunCount == block )
+  {
+    fRunCount++;
+    return;
+  }
+  flush();
+  fRunStart = block;
+  fRunCount = 1;
+}
+
+void DeltaComputer::literal( const uchar *data, qint64 len )
+{
+  flush();
+  fLiteralBytes += len;
+  while( len > 0 )
+  {
+    int part = static_cast<int>( qMin<qint64>(len, s_MaxLiteral) );
+    uchar header[5];
+    header[0] = DELTA_LITERAL;
+    qToBigEndian<quint32>( part, header+1 );
+    fOps.append( reinterpret_cast<const char*>(header), sizeof(header) );
+    fOps.append( reinterpret_cast<const char*>(data), part );
+    data += part;
+    len -= part;
+  }
+}
+
+void DeltaComputer::flush()
+{
+  if( fRunCount > 0 )
+  {
+    uchar op[9];
+    op[0] = DELTA_COPY;
+    qToBigEndian<quint32>( fRunStart, op+1 );
+    qToBigEndian<quint32>( fRunCount, op+5 );
+    fOps.append( reinterpret_cast<const char*>(op), sizeof(op) );
+    fRunCount = 0;
+  }
+}
+
+QByteArray computeDelta( const uchar *data, qint64 size, const DeltaSignature &signature, qint64 &literalBytes )
+{
+  DeltaComputer computer( data, size, signature );
+  QByteArray delta;
+  for( QByteArray chunk = computer.next(1<<20); !chunk.isEmpty(); chunk = computer.next(1<<20) )
+    delta.append( chunk );
+  literalBytes = computer.literalBytes();
+  return delta;
+}
+
+//-----------------------------------------------------------------------------
+
+DeltaApplier::DeltaApplier( QIODevice &base, int blockSize, QIODevice &out ) :
+  fBase( base ), fBlockSize( blockSize ), fOut( out ), fFailed( false )
+{
+}
+
+// Ops that are cut off at the end of data are kept until the rest of them arrives
+bool DeltaApplier::feed( const QByteArray &data )
+{
+  if( fFailed )
+    return false;
+  fPending.append( data );
+
+  int pos = 0;
+  while( pos < fPending.size() )
+  {
+    const uchar *op = reinterpret_cast<const uchar*>( fPending.constData() ) + pos;
+    int left = fPending.size() - pos;
+    if( op[0] == DELTA_COPY )
+    {
+      if( left < 9 )
+        break;
+      quint32 block = qFromBigEndian<quint32>( op+1 );
+      quint32 count = qFromBigEndian<quint32>( op+5 );
+      if( !fBase.seek(static_cast<qint64>(block) * fBlockSize) )
+        fFailed = true;
+      for( quint32 i=0; i<count && !fFailed; ++i )
+      {
+        fBuffer = fBase.read( fBlockSize );
+        fFailed = fBuffer.size() != fBlockSize || fOut.write(fBuffer) != fBlockSize;
+      }
+      pos += 9;
+    }
+    else if( op[0] == DELTA_LITERAL )
+    {
+      if( left < 5 )
+        break;
+      quint32 len = qFromBigEndian<quint32>( op+1 );
+      if( len > static_cast<quint32>(s_MaxLiteral) )
+      {
+        fFailed = true;
+      }
+      else
+      {
+        if( static_cast<quint32>(left - 5) < len )
+          break;
+        fFailed = fOut.write( reinterpret_cast<const char*>(op+5), len ) != static_cast<qint64>(len);
+        pos += 5 + static_cast<int>(len);
+      }
+    }
+    else
+    {
+      fFailed = true;
+    }
+    if( fFailed )
+      return false;
+  }
+  fPending.remove( 0, pos );
+  return true;
+}
+
+bool applyDelta( QIODevice &base, int blockSize, const QByteArray &delta, QIODevice &out )
+{
+  DeltaApplier applier( base, blockSize, out );
+  return applier.feed( delta ) && applier.atOpBoundary();
+}
+
+//-----------------------------------------------------------------------------
@@ -0,0 +1,104 @@
+#ifndef QUICKSYNC_DELTASYNC_H
+#define QUICKSYNC_DELTASYNC_H
+
+//-----------------------------------------------------------------------------
+// rsync style delta transfer. The receiver sends the rolling and strong
+// checksums of every full block in its copy of the file, the sender scans
+// its file with the rolling checksum and sends block references for the
+// blocks the receiver already has and literal data for everything else.
+//-----------------------------------------------------------------------------
+
+struct DeltaSignature
+{
+  DeltaSignature() : fBlockSize(0) {}
+
+  int blockCount() const { return fWeak.size(); }
+
+  qint32 fBlockSize;
+  QVector<quint32> fWeak;
+  QList<QByteArray> fStrong;
+};
+
+class PacketWriter;
+class PacketReader;
+PacketWriter &operator<<( PacketWriter &stream, const DeltaSignature &signature );
+PacketReader &operator>>( PacketReader &stream, DeltaSignature &signature );
+
+//! Block size to use for a file of the given size, roughly sqrt(size) like rsync
+extern int deltaBlockSize( qint64 fileSize );
+
+//! rsync rolling checksum of len bytes
+extern quint32 deltaWeakChecksum( const uchar *data, int len );
+extern QByteArray deltaStrongChecksum( const uchar *data, int len );
+
+//! Checksums of all full blocks in the device, the trailing partial block is not included
+extern DeltaSignature computeDeltaSignature( QIODevice &device, int blockSize );
+
+//! Computes the delta of data against a signature a piece at a time, so it can be sent while the
+//! rest is computed. data has to stay valid as long as the computer is used
+class DeltaComputer
+{
+public:
+  DeltaComputer( const uchar *data, qint64 size, const DeltaSignature &signature );
+
+  //! The next chunkSize bytes of the delta, less at the end and empty once it is done. An op may
+  //! continue in the next piece
+  QByteArray next( int chunkSize );
+  //! Bytes of the file that had to be sent as is so far
+  qint64 literalBytes() const { return fLiteralBytes; }
+
+private:
+  void copy( quint32 block );
+  void literal( const uchar *data, qint64 len );
+  void flush();
+
+  const uchar *fData;
+  qint64 fSize;
+  DeltaSignature fSignature;
+  int fBlockSize;
+  QMultiHash<quint32, int> fWeakToBlock;
+
+  //scan state
+  qint64 fPos;
+  qint64 fLiteralStart;
+  quint32 fA;
+  quint32 fB;
+  bool fRolling;
+  bool fDone;
+
+  //ops that are not handed out yet and the run of copied blocks that is not written yet
+  QByteArray fOps;
+  quint32 fRunStart;
+  quint32 fRunCount;
+  qint64 fLiteralBytes;
+};
+
+//! Delta of data against signature, literalBytes is set to the number of bytes that had to be sent as is
+extern QByteArray computeDelta( const uchar *data, qint64 size, const DeltaSignature &signature, qint64 &literalBytes );
+
+//! Rebuilds a file from the old copy in base and a delta that arrives in pieces, written to out
+class DeltaApplier
+{
+public:
+  DeltaApplier( QIODevice &base, int blockSize, QIODevice &out );
+
+  //! Applies the ops in data. Returns false on a malformed delta or io errors, the applier stays failed after that
+  bool feed( const QByteArray &data );
+  //! True when no op is left cut off, the delta is complete only then
+  bool atOpBoundary() const { return !fFailed && fPending.isEmpty(); }
+
+private:
+  QIODevice &fBase;
+  int fBlockSize;
+  QIODevice &fOut;
+  QByteArray fPending;
+  QByteArray fBuffer;
+  bool fFailed;
+};
+
+//! Rebuild the file from the old copy in base and the delta, written to out. Returns false on a malformed delta or io errors
+extern bool applyDelta( QIODevice &base, int blockSize, const QByteArray &delta, QIODevice &out );
+
+//-----------------------------------------------------------------------------
+
+#endif //QUICKSYNC_DELTASYNC_H
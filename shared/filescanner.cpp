@@ -28,89 +28,36 @@ bool FileScanner::scanStep()
   {
     DirRules dir = fUnscannedDirs.front();
     fUnscannedDirs.pop_front();
-    scanDir(dir.m_Path, dir.m_Rules);
+    scanDir(dir);
     return true;
   }
   return false;
 }
 
-void FileScanner::scanDir(const QString& path, QSharedPointer<SyncRules> rules)
+//Adds what a directory holds straight to the totals
+class FileScanner::Sink : public ScanSink
 {
-  fDirNumber++;
-  QString search = joinPath(fRootDir, path);
-  QDir searchDir(search);
-  QFileInfoList dirList = searchDir.entryInfoList(QDir::AllEntries | QDir::NoDotAndDotDot);
-
-  for (auto info : dirList)
+public:
+  Sink(FileScanner* scanner) : m_Scanner(scanner) {}
+  virtual void ruleFile(const QString& dir, QSharedPointer<SyncRules> rules) { emit m_Scanner->signalSyncRuleFile(dir, rules); }
+  virtual void file(const QString& path, const FileInfo& info)
   {
-#define WRITE_DEBUG_LOG 0
-#if WRITE_DEBUG_LOG == 1
-    QFile tmp("filelist");
-    tmp.open(QIODevice::ReadWrite | QIODevice::Append);
-    QTextStream stream(&tmp);
-#endif
-    QString dir = joinPath(path, info.fileName());
-    if (info.isDir())
-    {
-      //if ((fileData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
-      //{
-      //  emit signalReparsePoint(dir);
-      //}
-
-      QString rulePath = joinPath(fRootDir, dir, "syncrules.xml");
-      if (QFile::exists(rulePath))
-      {
-        QSharedPointer<SyncRules> loadRules(new SyncRules);
-        if (loadRules->loadXmlRules(rulePath))
-        {
-          rules = loadRules;
-          emit signalSyncRuleFile(dir, loadRules);
-        }
-      }
-      SyncRuleFlags_e flags;
-      if (rules->CheckFile(dir.toLower(), flags))
-      {
-#if WRITE_DEBUG_LOG == 1
-        stream << dirStr << endl;
-#endif
-        fUnscannedDirs << DirRules(dir, rules);
-        fDirCount++;
-      }
-      else
-      {
-        fDirIgnored++;
-      }
-    }
-    else
-    {
-      QString fileName = info.fileName();
-      if (fileName.endsWith("syncrules.xml"))
-        continue;
+    m_Scanner->fAllFiles[path] = info;
+    m_Scanner->fFileNumber++;
+    m_Scanner->fFileCount++;
+  }
+  virtual void subdir(const QString& dir, QSharedPointer<SyncRules> rules, bool excluded) { m_Scanner->fUnscannedDirs << DirRules(dir, rules, excluded); }
+private:
+  FileScanner* m_Scanner;
+};
 
-      SyncRuleFlags_e flags;
-      if (rules->CheckFile(fileName.toLower(), flags))
-      {
-        QFileInfo fileinfo(joinPath(fRootPath, fileName));
-        FileInfo info;
-        info.mtime = fileinfo.lastModified();
-        info.binary = false;
-        info.executable = false;
-        if ((flags&e_Binary) == e_Binary)
-          info.binary = true;
-        if ((flags&e_Executable) == e_Executable)
-          info.executable = true;
+void FileScanner::scanDir(const DirRules& dir)
+{
+  Sink sink(this);
+  scanDirectory(dir.m_Path, dir.m_Rules, dir.m_Excluded, sink);
 
-        fAllFiles[joinPath(path, fileName)] = info;
-        fFileNumber++;
-        fFileCount++;
-#if WRITE_DEBUG_LOG == 1
-        stream << fileStr << " " << fileinfo.size() / 1024 << " Kb" << endl;
-#endif
-      }
-      else
-      {
-        fFileIgnored++;
-      }
-    }
-  }
+  fDirNumber += sink.fDirsScanned;
+  fDirCount += sink.fDirsFound;
+  fDirIgnored += sink.fDirsIgnored;
+  fFileIgnored += sink.fFilesIgnored;
 }
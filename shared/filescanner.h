@@ -9,9 +9,11 @@ class SyncRules;
 class DirRules
 {
 public:
-  DirRules(const QString& path, QSharedPointer<SyncRules> rules) : m_Path(path), m_Rules(rules) {}
+  DirRules(const QString& path, QSharedPointer<SyncRules> rules, bool excluded = false) : m_Path(path), m_Rules(rules), m_Excluded(excluded) {}
   QString m_Path;
   QSharedPointer<SyncRules> m_Rules;
+  //The parent's rules exclude it, only a syncrules.xml of its own can include it
+  bool m_Excluded;
 };
 
 class FileScanner : public ScannerBase
@@ -21,7 +23,8 @@ public:
 
   virtual bool scanStep();
 private:
-  void scanDir(const QString& path, QSharedPointer<SyncRules> rules);
+  class Sink;
+  void scanDir(const DirRules& dir);
   QString fRootDir;
   QList<DirRules> fUnscannedDirs;
 };
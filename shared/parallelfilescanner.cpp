@@ -0,0 +1,180 @@
+#include "PreCompile.h"
+#include "parallelfilescanner.h"
+#include "utils.h"
+#include "syncrules.h"
+
+//Files a thread collects before it hands them over
+static const int s_BatchSize = 512;
+//Longest scanStep waits for results, the event loop keeps running in between
+static const int s_StepWait = 20;
+
+class ScanWorker : public QThread
+{
+public:
+  ScanWorker(ParallelFileScanner* scanner, int index) : m_Scanner(scanner), m_Index(index) {}
+  virtual void run() { m_Scanner->work(m_Index); }
+private:
+  ParallelFileScanner* m_Scanner;
+  int m_Index;
+};
+
+ParallelFileScanner::ParallelFileScanner(const QString& rootPath, QSharedPointer<SyncRules> rules, int threads) :
+ScannerBase(rootPath, rules)
+, fRunning(0)
+{
+  QString branchRule(joinPath(rootPath, "syncrules.xml"));
+  if (QFile::exists(branchRule))
+  {
+    QSharedPointer<SyncRules> loadRules(new SyncRules);
+    if (loadRules->loadXmlRules(branchRule))
+    {
+      //there is a valid syncrules file in the root of the branch, it replaces the default rules
+      rules = loadRules;
+    }
+  }
+
+  threads = qMax(1, threads);
+  for (int i = 0; i < threads; ++i)
+    fDeques.append(new WorkDeque);
+  fDeques[0]->m_Dirs.append(DirRules(".", rules));
+  fPending = 1;
+  fDirCount++;
+
+  fRunning = threads;
+  for (int i = 0; i < threads; ++i)
+  {
+    ScanWorker* worker = new ScanWorker(this, i);
+    fWorkers.append(worker);
+    worker->start();
+  }
+}
+
+ParallelFileScanner::~ParallelFileScanner()
+{
+  fStop = 1;
+  {
+    QMutexLocker lock(&fIdleMutex);
+    fWorkAvailable.wakeAll();
+  }
+  foreach (ScanWorker* worker, fWorkers)
+  {
+    worker->wait();
+    delete worker;
+  }
+  qDeleteAll(fDeques);
+}
+
+bool ParallelFileScanner::scanStep()
+{
+  QList<Batch> batches;
+  bool running;
+  {
+    QMutexLocker lock(&fResultMutex);
+    if (fResults.isEmpty() && fRunning > 0)
+      fResultReady.wait(&fResultMutex, s_StepWait);
+    batches.swap(fResults);
+    running = fRunning > 0;
+  }
+
+  foreach (const Batch& batch, batches)
+  {
+    for (QMap<QString, FileInfo>::const_iterator i = batch.m_Files.begin(); i != batch.m_Files.end(); ++i)
+      fAllFiles.insert(i.key(), i.value());
+    fFileNumber += batch.m_Files.size();
+    fFileCount += batch.m_Files.size();
+    fFileIgnored += batch.fFilesIgnored;
+    fDirNumber += batch.fDirsScanned;
+    fDirCount += batch.fDirsFound;
+    fDirIgnored += batch.fDirsIgnored;
+    for (int i = 0; i < batch.m_RuleFiles.size(); ++i)
+      emit signalSyncRuleFile(batch.m_RuleFiles.at(i).first, batch.m_RuleFiles.at(i).second);
+  }
+  return running || !batches.isEmpty();
+}
+
+void ParallelFileScanner::work(int index)
+{
+  Batch batch;
+  while (!fStop.load())
+  {
+    DirRules dir(QString(), QSharedPointer<SyncRules>());
+    if (takeWork(index, dir))
+    {
+      scanDirectory(dir.m_Path, dir.m_Rules, dir.m_Excluded, batch);
+      QList<DirRules> subdirs;
+      subdirs.swap(batch.m_Subdirs);
+      if (!subdirs.isEmpty())
+      {
+        fPending.fetchAndAddOrdered(subdirs.size());
+        {
+          WorkDeque* own = fDeques[index];
+          QMutexLocker lock(&own->m_Mutex);
+          own->m_Dirs.append(subdirs);
+        }
+        if (fIdle.load() > 0)
+        {
+          QMutexLocker lock(&fIdleMutex);
+          fWorkAvailable.wakeAll();
+        }
+      }
+      if (batch.m_Files.size() >= s_BatchSize)
+        publish(batch);
+      if (fPending.fetchAndAddOrdered(-1) == 1)
+      {
+        //that was the last directory, let the idle threads exit
+        QMutexLocker lock(&fIdleMutex);
+        fWorkAvailable.wakeAll();
+      }
+      continue;
+    }
+
+    //Nothing to take, hand over what was found while the others finish
+    publish(batch);
+    QMutexLocker lock(&fIdleMutex);
+    if (fPending.load() == 0)
+      break;
+    fIdle.fetchAndAddOrdered(1);
+    fWorkAvailable.wait(&fIdleMutex, 10);
+    fIdle.fetchAndAddOrdered(-1);
+  }
+
+  publish(batch);
+  QMutexLocker lock(&fResultMutex);
+  fRunning--;
+  fResultReady.wakeAll();
+}
+
+bool ParallelFileScanner::takeWork(int index, DirRules& dir)
+{
+  {
+    WorkDeque* own = fDeques[index];
+    QMutexLocker lock(&own->m_Mutex);
+    if (!own->m_Dirs.isEmpty())
+    {
+      dir = own->m_Dirs.takeLast();
+      return true;
+    }
+  }
+  //the oldest entries of the others are closest to the root, they have the most work below them
+  for (int i = 1; i < fDeques.size(); ++i)
+  {
+    WorkDeque* victim = fDeques[(index + i) % fDeques.size()];
+    QMutexLocker lock(&victim->m_Mutex);
+    if (!victim->m_Dirs.isEmpty())
+    {
+      dir = victim->m_Dirs.takeFirst();
+      return true;
+    }
+  }
+  return false;
+}
+
+void ParallelFileScanner::publish(Batch& batch)
+{
+  if (batch.fDirsScanned == 0 && batch.fDirsFound == 0 && batch.fDirsIgnored == 0 && batch.m_Files.isEmpty())
+    return;
+  QMutexLocker lock(&fResultMutex);
+  fResults.append(batch);
+  batch = Batch();
+  fResultReady.wakeAll();
+}
@@ -0,0 +1,63 @@
+#ifndef QUICKSYNC_PARALLELFILESCANNER_H
+#define QUICKSYNC_PARALLELFILESCANNER_H
+
+#include "scannerbase.h"
+#include "filescanner.h"
+#include <QtCore/QAtomicInt>
+#include <QtCore/QWaitCondition>
+
+class ScanWorker;
+
+//! Scans the tree on a pool of threads. Each thread keeps a deque of directories, it works depth
+//! first from the back of its own and steals from the front of the others when it runs out.
+//! scanStep() hands over whatever the threads found since the last call
+class ParallelFileScanner : public ScannerBase
+{
+public:
+  ParallelFileScanner(const QString& rootPath, QSharedPointer<SyncRules> rules, int threads);
+  virtual ~ParallelFileScanner();
+
+  virtual bool scanStep();
+
+private:
+  //What one thread found, merged into the totals on the thread calling scanStep
+  struct Batch : public ScanSink
+  {
+    virtual void ruleFile(const QString& dir, QSharedPointer<SyncRules> rules) { m_RuleFiles.append(qMakePair(dir, rules)); }
+    virtual void file(const QString& path, const FileInfo& info) { m_Files[path] = info; }
+    virtual void subdir(const QString& dir, QSharedPointer<SyncRules> rules, bool excluded) { m_Subdirs << DirRules(dir, rules, excluded); }
+
+    QMap<QString, FileInfo> m_Files;
+    QList<QPair<QString, QSharedPointer<SyncRules> > > m_RuleFiles;
+    //Found by the last directory scanned, the thread queues them before it publishes
+    QList<DirRules> m_Subdirs;
+  };
+
+  struct WorkDeque
+  {
+    QMutex m_Mutex;
+    QList<DirRules> m_Dirs;
+  };
+
+  friend class ScanWorker;
+  void work(int index);
+  bool takeWork(int index, DirRules& dir);
+  void publish(Batch& batch);
+
+  QList<ScanWorker*> fWorkers;
+  QVector<WorkDeque*> fDeques;
+  //Directories queued or being scanned, the scan is done when it drops to 0
+  QAtomicInt fPending;
+  QAtomicInt fStop;
+
+  QMutex fIdleMutex;
+  QWaitCondition fWorkAvailable;
+  QAtomicInt fIdle;
+
+  QMutex fResultMutex;
+  QWaitCondition fResultReady;
+  QList<Batch> fResults;
+  int fRunning;
+};
+
+#endif //QUICKSYNC_PARALLELFILESCANNER_H
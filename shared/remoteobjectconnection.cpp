@@ -2,12 +2,66 @@
 // Content of this file is subject to the GPL v2
 #include "PreCompile.h"
 #include "remoteobjectconnection.h"
-#include <assert.h>
+#include "wireformat.h"
+#include <QtCore/QtEndian>
+#ifdef Q_OS_LINUX
+#include <QtCore/QSocketNotifier>
+#include <sys/sendfile.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 //-----------------------------------------------------------------------------
 
-enum { RO_STATFILE, RO_STATFILEREPLY, RO_SENDFILE, RO_SENDFILERESULT, RO_TARGETDIRECTORY, RO_VERSION, RO_DELETEFILE };
+enum { RO_STATFILE, RO_STATFILEREPLY, RO_SENDFILE, RO_SENDFILERESULT, RO_TARGETDIRECTORY, RO_VERSION, RO_DELETEFILE,
+       RO_SENDFILEBEGIN, RO_SENDFILECHUNK, RO_SENDFILEEND, RO_STATFILEBATCH, RO_STATFILEBATCHREPLY,
+       RO_MANIFESTREQ, RO_MANIFESTENTRIES, RO_MANIFESTEND, RO_SIGNATUREREQ, RO_SIGNATUREREPLY, RO_SENDDELTA,
+       RO_HASHCHECK, RO_HASHCHECKREPLY, RO_SENDFILERAW, RO_JOINSESSION, RO_CREDIT,
+       RO_RENAMEFILE, RO_RENAMEDIR, RO_RENAMERESULT, RO_MATERIALIZE, RO_COMPACT, RO_RAWSLICE,
+       RO_DELTABEGIN, RO_DELTACHUNK, RO_DELTAEND };
+
+// Set in the command id when the payload is compressed with the negotiated codec
+static const int RO_COMPRESSED = 1<<30;
+
+// Codecs announced in RO_VERSION, the bits are the codecs the sender can decode
+enum { RO_CODEC_ZLIB = 1<<0 };
+static const quint32 s_SupportedCodecs = RO_CODEC_ZLIB;
+
+// version is the baseline protocol every peer speaks, older peers reject anything but an exact match so it
+// stays at 2. Everything newer is announced with the capability bits and limits that follow it in RO_VERSION
 const int RemoteObjectConnection::version = 2;
+const quint32 RemoteObjectConnection::s_Capabilities = CapStreaming | CapStatBatch | CapManifest | CapDelta |
+                                                       CapHashCheck | CapRawSlices | CapSessions | CapCredit | CapRename |
+                                                       CapMaterialize | CapCompact | CapDirIds | CapDeltaStream;
+const qint32 RemoteObjectConnection::s_MaxPacketSize = 1<<28; //256MB
+const qint32 RemoteObjectConnection::s_MaxStreams = 16;
+const int RemoteObjectConnection::streamChunkSize = 1<<18; //256KB
+
+//Payloads smaller than this are not worth the compression overhead
+static const int s_MinCompressSize = 512;
+//Larger payloads are only compressed when a sample of them shrinks to at most 7/8 of its size
+static const int s_SampleSize = 4096;
+//The fastest level, most of what the stronger ones save is not worth the CPU time on a fast link
+static const int s_CompressionLevel = 1;
+//While compression is slower than the link it is still tried on every this many compressible payloads
+//so a changed link or load is noticed
+static const int s_CompressProbe = 64;
+//Most bytes handed to the socket in one go during a raw file transfer
+static const qint64 s_RawSlice = 1<<20;
+//The receive buffer is released after frames larger than this instead of being kept for the next one
+static const int s_MaxKeptFrame = 1<<22;
+//Qt's read buffer is kept this small during a raw transfer so most of the data stays in the kernel for splice
+static const qint64 s_RawReadBuffer = 1<<14;
+
+//Credit is handed back once this much has been consumed, or when the socket has been drained
+static const qint64 s_CreditStep = 1<<18;
+//Bounds of the send window, it grows to twice the measured bandwidth-delay product
+static const qint64 s_InitialWindow = 1<<23;
+static const qint64 s_MinWindow = 1<<20;
+static const qint64 s_MaxWindow = 1<<28;
+//Round trip samples are taken at most this often (ms)
+static const qint64 s_RttSampleInterval = 10;
 
 //-----------------------------------------------------------------------------
 
@@ -15,7 +69,42 @@ RemoteObjectConnection::RemoteObjectConnection( QTcpSocket *socket )
 {
   fHash = -1;
   fSize = -1;
+  fHeaderSize = 0;
+  fCompactSend = false;
+  fCompactRecv = false;
   isVersionKnown = false;
+  isVersionSent = false;
+  fPeerCapabilities = 0;
+  fPeerCodecs = 0;
+  fPeerMaxPacketSize = INT_MAX;
+  fPeerMaxStreams = 1;
+  fCompressionEnabled = true;
+  fStreamCompressible = true;
+  fDeltaCompressible = true;
+  fRawFile = NULL;
+  fRawSize = 0;
+  fRawOffset = 0;
+  fRawSliceEnd = 0;
+  fRawComplete = true;
+  fRawNotifier = NULL;
+  fRawRemaining = 0;
+  fRawPipe[0] = -1;
+  fRawPipe[1] = -1;
+  fBytesSent = 0;
+  fBytesReceived = 0;
+  fReceiveWindow = 0;
+  fCreditConsumed = 0;
+  fBytesHeld = 0;
+  fFrameBytes = 0;
+  fPeerConsumed = 0;
+  fCreditLimit = -1;
+  fWindow = s_InitialWindow;
+  fMinRtt = -1;
+  fDeliveryRate = 0;
+  fCompressRate = 0;
+  fCompressSkipped = 0;
+  fLastCreditTime = -1;
+  fClock.start();
   
   if( socket )
   {
@@ -27,14 +116,22 @@ RemoteObjectConnection::RemoteObjectConnection( QTcpSocket *socket )
   }
   
   connect( fSocket, SIGNAL(readyRead()), SLOT(readyRead()) );
+  connect( fSocket, SIGNAL(bytesWritten(qint64)), SLOT(writeRaw()) );
 //  connect( fSocket, SIGNAL(disconnected()), SLOT(disconnected()) );
 //  connect( fSocket, SIGNAL(connected()), SLOT(connected()) );
-  
-  fStream.setDevice( fSocket );
 }
 
 RemoteObjectConnection::~RemoteObjectConnection()
 {
+  delete fRawFile;
+  fRawFile = NULL;
+#ifdef Q_OS_LINUX
+  if( fRawPipe[0] >= 0 )
+  {
+    ::close( fRawPipe[0] );
+    ::close( fRawPipe[1] );
+  }
+#endif
   delete fSocket;
   fSocket = NULL;
 }
@@ -43,16 +140,17 @@ RemoteObjectConnection::~RemoteObjectConnection()
 
 void RemoteObjectConnection::sendTargetDirectory(const QString &filename)
 {
-  QByteArray data;
-  QDataStream stream(&data, QIODevice::WriteOnly);
+  PacketWriter stream( fCompactSend, sendPaths() );
   stream << filename;
-  sendRemoteObject(RO_TARGETDIRECTORY, data);
+  sendRemoteObject(RO_TARGETDIRECTORY, stream.data());
 }
 
-void RemoteObjectConnection::decodeTargetDirectory( QDataStream &stream )
+void RemoteObjectConnection::decodeTargetDirectory( PacketReader &stream )
 {
   QString filename;
   stream >> filename;
+  if( !stream.isValid() )
+    return;
   emit recvTargetDirectory( filename );
 }
 
@@ -60,16 +158,17 @@ void RemoteObjectConnection::decodeTargetDirectory( QDataStream &stream )
 
 void RemoteObjectConnection::sendStatFileReq( const QString &filename )
 {
-  QByteArray data;
-  QDataStream stream( &data, QIODevice::WriteOnly );
-  stream << filename;
-  sendRemoteObject( RO_STATFILE, data );
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream.path( filename );
+  sendRemoteObject( RO_STATFILE, stream.data() );
 }
 
-void RemoteObjectConnection::decodeStatFileReq( QDataStream &stream )
+void RemoteObjectConnection::decodeStatFileReq( PacketReader &stream )
 {
   QString filename;
-  stream >> filename;
+  stream.path( filename );
+  if( !stream.isValid() )
+    return;
   emit recvStatFileReq( filename );
 }
 
@@ -77,18 +176,19 @@ void RemoteObjectConnection::decodeStatFileReq( QDataStream &stream )
 
 void RemoteObjectConnection::sendStatFileReply( const QString &filename, const QDateTime &mtime )
 {
-  QByteArray data;
-  QDataStream stream( &data, QIODevice::WriteOnly );
-  stream << filename << mtime.toUTC();
-  sendRemoteObject( RO_STATFILEREPLY, data );
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream.path( filename ) << mtime.toUTC();
+  sendRemoteObject( RO_STATFILEREPLY, stream.data() );
 }
 
-void RemoteObjectConnection::decodeStatFileReply( QDataStream &stream )
+void RemoteObjectConnection::decodeStatFileReply( PacketReader &stream )
 {
   //qDebug() << "[RemoteObjectConnection.Debug] decodeStatFileReply ";
   QString filename;
   QDateTime mtime;
-  stream >> filename >> mtime;
+  stream.path( filename ) >> mtime;
+  if( !stream.isValid() )
+    return;
   mtime = mtime.toLocalTime();
   //qDebug() << "[RemoteObjectConnection.Debug] decodeStatFileReply " << filename << " " << mtime;
   emit recvStatFileReply( filename, mtime );
@@ -96,67 +196,808 @@ void RemoteObjectConnection::decodeStatFileReply( QDataStream &stream )
 
 //-----------------------------------------------------------------------------
 
+void RemoteObjectConnection::sendStatFileBatchReq( quint32 id, const QString &dir, const QStringList &names )
+{
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream << id;
+  stream.path( dir ) << names;
+  sendRemoteObject( RO_STATFILEBATCH, stream.data() );
+}
+
+void RemoteObjectConnection::decodeStatFileBatchReq( PacketReader &stream )
+{
+  quint32 id;
+  QString dir;
+  QStringList names;
+  stream >> id;
+  stream.path( dir ) >> names;
+  if( !stream.isValid() )
+    return;
+  emit recvStatFileBatchReq( id, dir, names );
+}
+
+// mtimes are msecs since epoch in UTC and -1 for files the server does not have, both vectors
+// are in the same order as the names in the request
+void RemoteObjectConnection::sendStatFileBatchReply( quint32 id, const QVector<qint64> &mtimes, const QVector<qint64> &sizes )
+{
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream << id << mtimes << sizes;
+  sendRemoteObject( RO_STATFILEBATCHREPLY, stream.data() );
+}
+
+void RemoteObjectConnection::decodeStatFileBatchReply( PacketReader &stream )
+{
+  quint32 id;
+  QVector<qint64> mtimes;
+  QVector<qint64> sizes;
+  stream >> id >> mtimes >> sizes;
+  if( !stream.isValid() )
+    return;
+  emit recvStatFileBatchReply( id, mtimes, sizes );
+}
+
+//-----------------------------------------------------------------------------
+
+void RemoteObjectConnection::sendManifestReq()
+{
+  sendRemoteObject( RO_MANIFESTREQ, QByteArray() );
+}
+
+void RemoteObjectConnection::decodeManifestReq( PacketReader & )
+{
+  emit recvManifestReq();
+}
+
+// paths are relative to the target directory and start with ./ like the names the scanner produces
+void RemoteObjectConnection::sendManifestEntries( const QStringList &paths, const QVector<qint64> &mtimes, const QVector<qint64> &sizes )
+{
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream.paths( paths ) << mtimes << sizes;
+  sendRemoteObject( RO_MANIFESTENTRIES, stream.data() );
+}
+
+void RemoteObjectConnection::decodeManifestEntries( PacketReader &stream )
+{
+  QStringList paths;
+  QVector<qint64> mtimes;
+  QVector<qint64> sizes;
+  stream.paths( paths ) >> mtimes >> sizes;
+  if( !stream.isValid() )
+    return;
+  emit recvManifestEntries( paths, mtimes, sizes );
+}
+
+void RemoteObjectConnection::sendManifestEnd( qint64 count )
+{
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream << count;
+  sendRemoteObject( RO_MANIFESTEND, stream.data() );
+}
+
+void RemoteObjectConnection::decodeManifestEnd( PacketReader &stream )
+{
+  qint64 count;
+  stream >> count;
+  if( !stream.isValid() )
+    return;
+  emit recvManifestEnd( count );
+}
+
+//-----------------------------------------------------------------------------
+
 void RemoteObjectConnection::sendSendFile( const QString &filename, const QDateTime &mtime, const QByteArray &data, bool executable )
 {
-  QByteArray sdata;
-  QDataStream stream( &sdata, QIODevice::WriteOnly );
-  stream << filename << mtime.toUTC() << data << executable;
-  sendRemoteObject( RO_SENDFILE, sdata );
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream.path( filename ) << mtime.toUTC() << data << executable;
+  sendRemoteObject( RO_SENDFILE, stream.data(), isCompressibleFile(filename) );
 }
 
-void RemoteObjectConnection::decodeSendFile( QDataStream &stream )
+void RemoteObjectConnection::decodeSendFile( PacketReader &stream )
 {
   QString filename;
   QDateTime mtime;
   QByteArray data;
   bool executable;
-  stream >> filename >> mtime >> data >> executable;
+  stream.path( filename ) >> mtime >> data >> executable;
+  if( !stream.isValid() )
+    return;
   mtime = mtime.toLocalTime();
   emit recvSendFile( filename, mtime, data, executable );
 }
 
 //-----------------------------------------------------------------------------
 
+void RemoteObjectConnection::sendSendFileBegin( const QString &filename, const QDateTime &mtime, bool executable )
+{
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream.path( filename ) << mtime.toUTC() << executable;
+  fStreamCompressible = isCompressibleFile( filename );
+  sendRemoteObject( RO_SENDFILEBEGIN, stream.data() );
+}
+
+void RemoteObjectConnection::decodeSendFileBegin( PacketReader &stream )
+{
+  QString filename;
+  QDateTime mtime;
+  bool executable;
+  stream.path( filename ) >> mtime >> executable;
+  if( !stream.isValid() )
+    return;
+  mtime = mtime.toLocalTime();
+  emit recvSendFileBegin( filename, mtime, executable );
+}
+
+void RemoteObjectConnection::sendSendFileChunk( const QByteArray &data )
+{
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream << data;
+  sendRemoteObject( RO_SENDFILECHUNK, stream.data(), fStreamCompressible );
+}
+
+void RemoteObjectConnection::decodeSendFileChunk( PacketReader &stream )
+{
+  QByteArray data;
+  stream >> data;
+  if( !stream.isValid() )
+    return;
+  emit recvSendFileChunk( data );
+}
+
+void RemoteObjectConnection::sendSendFileEnd( bool complete )
+{
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream << complete;
+  sendRemoteObject( RO_SENDFILEEND, stream.data() );
+}
+
+void RemoteObjectConnection::decodeSendFileEnd( PacketReader &stream )
+{
+  bool complete;
+  stream >> complete;
+  if( !stream.isValid() )
+    return;
+  emit recvSendFileEnd( complete );
+}
+
+//-----------------------------------------------------------------------------
+
+// The header is followed by RO_RAWSLICE frames whose data is the file itself and then a RO_SENDFILEEND,
+// the receiver handles it like a streamed transfer
+bool RemoteObjectConnection::sendSendFileRaw( const QString &filename, const QString &path, bool executable )
+{
+  Q_ASSERT( fRawFile == NULL );
+  QFile *file = new QFile( path );
+  if( !file->open(QIODevice::ReadOnly) )
+  {
+    delete file;
+    return false;
+  }
+
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream.path( filename ) << QFileInfo(*file).lastModified().toUTC() << executable;
+  sendRemoteObject( RO_SENDFILERAW, stream.data(), false );
+
+  fRawFile = file;
+  fRawFilename = filename;
+  fRawSize = file->size();
+  fRawOffset = 0;
+  fRawSliceEnd = 0;
+  fRawComplete = true;
+  writeRaw();
+  return true;
+}
+
+void RemoteObjectConnection::abortSendFileRaw()
+{
+  if( fRawFile != NULL && fRawComplete )
+  {
+    fRawComplete = false;
+    writeRaw();
+  }
+}
+
+void RemoteObjectConnection::decodeSendFileRaw( PacketReader &stream )
+{
+  QString filename;
+  QDateTime mtime;
+  bool executable;
+  stream.path( filename ) >> mtime >> executable;
+  if( !stream.isValid() )
+    return;
+  mtime = mtime.toLocalTime();
+  emit recvSendFileBegin( filename, mtime, executable );
+}
+
+// The data of a RO_RAWSLICE frame is not read as a packet, it is moved to its destination by receiveRaw
+void RemoteObjectConnection::beginRawSlice()
+{
+  fRawRemaining = fSize;
+  fBytesReceived += fHeaderSize;
+  fSize = -1;
+#ifdef Q_OS_LINUX
+  if( fRawRemaining > 0 && rawReceiveDescriptor() >= 0 )
+    fSocket->setReadBufferSize( s_RawReadBuffer );
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Moves the next part of the raw file data to its destination
+///
+/// When the receiver has a descriptor for the data on Linux, the bytes Qt
+/// has buffered already are written to it and the rest is moved from the
+/// socket with splice(2) through a pipe, never entering user space.
+/// Otherwise the data is emitted as stream chunks.
+/// Returns false when there is nothing to read right now.
+//////////////////////////////////////////////////////////////////////////
+bool RemoteObjectConnection::receiveRaw()
+{
+  qint64 available = fSocket->bytesAvailable();
+#ifdef Q_OS_LINUX
+  int fd = rawReceiveDescriptor();
+  if( fd >= 0 )
+  {
+    //whatever Qt has buffered already has to be written first
+    qint64 buffered = fSocket->QIODevice::bytesAvailable();
+    if( buffered > 0 || !openRawPipe() )
+    {
+      available = buffered > 0 ? buffered : available;
+    }
+    else
+    {
+      ssize_t in = ::splice( static_cast<int>(fSocket->socketDescriptor()), NULL, fRawPipe[1], NULL,
+                             static_cast<size_t>(qMin(fRawRemaining, s_RawSlice)), SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+      if( in <= 0 )
+      {
+        //the kernel buffer is empty, errors and eof show up on the socket
+        return false;
+      }
+
+      ssize_t out = 0;
+      while( out < in )
+      {
+        ssize_t moved = ::splice( fRawPipe[0], NULL, fd, NULL, static_cast<size_t>(in - out), SPLICE_F_MOVE );
+        if( moved <= 0 )
+          break;
+        out += moved;
+      }
+      if( out < in )
+      {
+        //whatever is stuck in the pipe still belongs to this file, throw it away
+        rawReceiveFailed();
+        char discard[4096];
+        for( ssize_t left = in - out; left > 0; )
+        {
+          ssize_t r = ::read( fRawPipe[0], discard, static_cast<size_t>(qMin<ssize_t>(left, sizeof(discard))) );
+          if( r <= 0 )
+            break;
+          left -= r;
+        }
+      }
+      fRawRemaining -= in;
+      fBytesReceived += in;
+      if( fRawRemaining == 0 )
+        fSocket->setReadBufferSize( 0 );
+      return true;
+    }
+  }
+#endif
+
+  if( available <= 0 )
+    return false;
+  QByteArray data = fSocket->read( qMin(qMin(available, fRawRemaining), static_cast<qint64>(streamChunkSize)) );
+  fRawRemaining -= data.size();
+  fBytesReceived += data.size();
+  if( fRawRemaining == 0 )
+    fSocket->setReadBufferSize( 0 );
+#ifdef Q_OS_LINUX
+  if( fd >= 0 )
+  {
+    for( const char *p = data.constData(); p != data.constData() + data.size(); )
+    {
+      ssize_t written = ::write( fd, p, static_cast<size_t>(data.constData() + data.size() - p) );
+      if( written <= 0 )
+      {
+        rawReceiveFailed();
+        break;
+      }
+      p += written;
+    }
+    return true;
+  }
+#endif
+  //the receiver may hold the credit for the data like for a chunk frame
+  fFrameBytes = data.size();
+  emit recvSendFileChunk( data );
+  fFrameBytes = 0;
+  return true;
+}
+
+#ifdef Q_OS_LINUX
+bool RemoteObjectConnection::openRawPipe()
+{
+  if( fRawPipe[0] >= 0 )
+    return true;
+  if( ::pipe2(fRawPipe, O_NONBLOCK | O_CLOEXEC) != 0 )
+  {
+    fRawPipe[0] = fRawPipe[1] = -1;
+    return false;
+  }
+  //a bigger pipe means fewer splice calls, the default of 64KB still works
+  ::fcntl( fRawPipe[1], F_SETPIPE_SZ, static_cast<int>(s_RawSlice) );
+  return true;
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+/// Hands the next part of the raw file to the socket
+///
+/// The file goes out in RO_RAWSLICE frames of at most s_RawSlice bytes,
+/// no larger than the send window. Packets sent while a slice is under way
+/// are queued and written at the end of the slice, an abort takes effect
+/// there too. On Linux the data goes from the page cache to the socket
+/// with sendfile(2), around Qt's write buffer, so that buffer has to be
+/// empty first. Elsewhere one mapped slice at a time is written to the
+/// socket. Called again when the socket has drained or the peer has
+/// granted credit.
+//////////////////////////////////////////////////////////////////////////
+void RemoteObjectConnection::writeRaw()
+{
+  if( fRawFile == NULL )
+    return;
+  if( fRawNotifier != NULL )
+    fRawNotifier->setEnabled( false );
+
+  for(;;)
+  {
+    if( fRawOffset == fRawSliceEnd )
+    {
+      //between slices, the packets that came up during the last one go first
+      if( !fRawQueue.isEmpty() )
+      {
+        fSocket->write( fRawQueue );
+        bytesSent( fRawQueue.size() );
+        fRawQueue.clear();
+      }
+      if( fRawOffset >= fRawSize || !fRawComplete )
+        break;
+
+      qint64 len = qMin( qMin(fRawSize - fRawOffset, s_RawSlice), sendWindow() );
+      if( len <= 0 )
+        return;
+      char header[2*MaxVarintSize];
+      int headerSize = encodeFrameHeader( RO_RAWSLICE, len, header );
+      fSocket->write( header, headerSize );
+      bytesSent( headerSize );
+      fRawSliceEnd = fRawOffset + len;
+    }
+    if( fSocket->bytesToWrite() != 0 )
+      return;
+
+    qint64 len = fRawSliceEnd - fRawOffset;
+#ifdef Q_OS_LINUX
+    off_t offset = fRawOffset;
+    ssize_t sent = ::sendfile( static_cast<int>(fSocket->socketDescriptor()), fRawFile->handle(), &offset, static_cast<size_t>(len) );
+    if( sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+    {
+      if( fRawNotifier == NULL )
+      {
+        fRawNotifier = new QSocketNotifier( fSocket->socketDescriptor(), QSocketNotifier::Write, this );
+        connect( fRawNotifier, SIGNAL(activated(int)), SLOT(writeRaw()) );
+      }
+      fRawNotifier->setEnabled( true );
+      return;
+    }
+    if( sent > 0 )
+    {
+      fRawOffset += sent;
+      bytesSent( sent );
+      continue;
+    }
+#else
+    uchar *map = fRawFile->map( fRawOffset, len );
+    if( map != NULL )
+    {
+      fSocket->write( reinterpret_cast<const char*>(map), len );
+      fRawFile->unmap( map );
+      fRawOffset += len;
+      bytesSent( len );
+      continue;
+    }
+#endif
+    //The file shrank or could not be read. Zeros fill up the announced slice and the end
+    //that follows it marks the file incomplete
+    qWarning() << "[RemoteObjectConnection.Warning] Could not send file " << fRawFilename;
+    fRawComplete = false;
+    fSocket->write( QByteArray(static_cast<int>(len), 0) );
+    fRawOffset += len;
+    bytesSent( len );
+  }
+
+  delete fRawFile;
+  fRawFile = NULL;
+  sendSendFileEnd( fRawComplete );
+  emit sendFileRawDone();
+}
+
+//-----------------------------------------------------------------------------
+
+void RemoteObjectConnection::sendSignatureReq( const QString &filename, int blockSize )
+{
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream.path( filename ) << qint32(blockSize);
+  sendRemoteObject( RO_SIGNATUREREQ, stream.data() );
+}
+
+void RemoteObjectConnection::decodeSignatureReq( PacketReader &stream )
+{
+  QString filename;
+  qint32 blockSize;
+  stream.path( filename ) >> blockSize;
+  if( !stream.isValid() )
+    return;
+  emit recvSignatureReq( filename, blockSize );
+}
+
+// A signature without blocks means the server has nothing to diff against
+void RemoteObjectConnection::sendSignatureReply( const QString &filename, const DeltaSignature &signature )
+{
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream.path( filename ) << signature;
+  sendRemoteObject( RO_SIGNATUREREPLY, stream.data() );
+}
+
+void RemoteObjectConnection::decodeSignatureReply( PacketReader &stream )
+{
+  QString filename;
+  DeltaSignature signature;
+  stream.path( filename ) >> signature;
+  if( !stream.isValid() )
+    return;
+  emit recvSignatureReply( filename, signature );
+}
+
+void RemoteObjectConnection::sendSendDelta( const QString &filename, const QDateTime &mtime, int blockSize, const QByteArray &delta, bool executable )
+{
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream.path( filename ) << mtime.toUTC() << qint32(blockSize) << delta << executable;
+  sendRemoteObject( RO_SENDDELTA, stream.data(), isCompressibleFile(filename) );
+}
+
+void RemoteObjectConnection::decodeSendDelta( PacketReader &stream )
+{
+  QString filename;
+  QDateTime mtime;
+  qint32 blockSize;
+  QByteArray delta;
+  bool executable;
+  stream.path( filename ) >> mtime >> blockSize >> delta >> executable;
+  if( !stream.isValid() )
+    return;
+  mtime = mtime.toLocalTime();
+  emit recvSendDelta( filename, mtime, blockSize, delta, executable );
+}
+
+// A delta sent while it is computed, the ops follow in RO_DELTACHUNK packets that may split an op.
+// An incomplete end means the sender gave up on the delta, the receiver drops it without a result
+void RemoteObjectConnection::sendSendDeltaBegin( const QString &filename, const QDateTime &mtime, int blockSize, bool executable )
+{
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream.path( filename ) << mtime.toUTC() << qint32(blockSize) << executable;
+  fDeltaCompressible = isCompressibleFile( filename );
+  sendRemoteObject( RO_DELTABEGIN, stream.data() );
+}
+
+void RemoteObjectConnection::decodeSendDeltaBegin( PacketReader &stream )
+{
+  QString filename;
+  QDateTime mtime;
+  qint32 blockSize;
+  bool executable;
+  stream.path( filename ) >> mtime >> blockSize >> executable;
+  if( !stream.isValid() )
+    return;
+  mtime = mtime.toLocalTime();
+  emit recvSendDeltaBegin( filename, mtime, blockSize, executable );
+}
+
+void RemoteObjectConnection::sendSendDeltaChunk( const QByteArray &ops )
+{
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream << ops;
+  sendRemoteObject( RO_DELTACHUNK, stream.data(), fDeltaCompressible );
+}
+
+void RemoteObjectConnection::decodeSendDeltaChunk( PacketReader &stream )
+{
+  QByteArray ops;
+  stream >> ops;
+  if( !stream.isValid() )
+    return;
+  emit recvSendDeltaChunk( ops );
+}
+
+void RemoteObjectConnection::sendSendDeltaEnd( bool complete )
+{
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream << complete;
+  sendRemoteObject( RO_DELTAEND, stream.data() );
+}
+
+void RemoteObjectConnection::decodeSendDeltaEnd( PacketReader &stream )
+{
+  bool complete;
+  stream >> complete;
+  if( !stream.isValid() )
+    return;
+  emit recvSendDeltaEnd( complete );
+}
+
+//-----------------------------------------------------------------------------
+
+// Asks the server to compare its copy against the content hash of the local file, on a match the
+// server only takes over mtime and no upload is needed
+void RemoteObjectConnection::sendHashCheckReq( const QString &filename, const QDateTime &mtime, qint64 size, const QByteArray &hash )
+{
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream.path( filename ) << mtime.toUTC() << size << hash;
+  sendRemoteObject( RO_HASHCHECK, stream.data() );
+}
+
+void RemoteObjectConnection::decodeHashCheckReq( PacketReader &stream )
+{
+  QString filename;
+  QDateTime mtime;
+  qint64 size;
+  QByteArray hash;
+  stream.path( filename ) >> mtime >> size >> hash;
+  if( !stream.isValid() )
+    return;
+  mtime = mtime.toLocalTime();
+  emit recvHashCheckReq( filename, mtime, size, hash );
+}
+
+void RemoteObjectConnection::sendMaterializeReq( const QString &filename, const QDateTime &mtime, qint64 size, const QByteArray &hash, bool executable )
+{
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream.path( filename ) << mtime.toUTC() << size << hash << executable;
+  sendRemoteObject( RO_MATERIALIZE, stream.data() );
+}
+
+void RemoteObjectConnection::decodeMaterializeReq( PacketReader &stream )
+{
+  QString filename;
+  QDateTime mtime;
+  qint64 size;
+  QByteArray hash;
+  bool executable;
+  stream.path( filename ) >> mtime >> size >> hash >> executable;
+  if( !stream.isValid() )
+    return;
+  mtime = mtime.toLocalTime();
+  emit recvMaterializeReq( filename, mtime, size, hash, executable );
+}
+
+void RemoteObjectConnection::sendHashCheckReply( const QString &filename, const QDateTime &mtime, bool match )
+{
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream.path( filename ) << mtime.toUTC() << match;
+  sendRemoteObject( RO_HASHCHECKREPLY, stream.data() );
+}
+
+void RemoteObjectConnection::decodeHashCheckReply( PacketReader &stream )
+{
+  QString filename;
+  QDateTime mtime;
+  bool match;
+  stream.path( filename ) >> mtime >> match;
+  if( !stream.isValid() )
+    return;
+  mtime = mtime.toLocalTime();
+  emit recvHashCheckReply( filename, mtime, match );
+}
+
+//-----------------------------------------------------------------------------
+
 void RemoteObjectConnection::sendSendFileResult( const QString &filename, const QDateTime &mtime, int result )
 {
-  QByteArray sdata;
-  QDataStream stream( &sdata, QIODevice::WriteOnly );
-  stream << filename << mtime.toUTC() << result;
-  sendRemoteObject( RO_SENDFILERESULT, sdata );
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream.path( filename ) << mtime.toUTC() << result;
+  sendRemoteObject( RO_SENDFILERESULT, stream.data() );
 }
 
-void RemoteObjectConnection::decodeSendFileResult( QDataStream &stream )
+void RemoteObjectConnection::decodeSendFileResult( PacketReader &stream )
 {
   QString filename;
   QDateTime mtime;
   int result;
-  stream >> filename >> mtime >> result;
+  stream.path( filename ) >> mtime >> result;
+  if( !stream.isValid() )
+    return;
   mtime = mtime.toLocalTime();
   emit recvSendFileResult( filename, mtime, result );
 }
 
 //-----------------------------------------------------------------------------
 
+// All connections of a client that send the same session id share the target directory on the server
+void RemoteObjectConnection::sendJoinSession( const QByteArray &sessionId )
+{
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream << sessionId;
+  sendRemoteObject( RO_JOINSESSION, stream.data() );
+}
+
+void RemoteObjectConnection::decodeJoinSession( PacketReader &stream )
+{
+  QByteArray sessionId;
+  stream >> sessionId;
+  if( !stream.isValid() )
+    return;
+  emit recvJoinSession( sessionId );
+}
+
+//-----------------------------------------------------------------------------
+
+// consumed is the number of bytes the receiver has processed so far, the sender may send until
+// its own count of sent bytes reaches limit
+void RemoteObjectConnection::sendCredit( qint64 consumed, qint64 limit )
+{
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream << consumed << limit;
+  sendRemoteObject( RO_CREDIT, stream.data() );
+}
+
+void RemoteObjectConnection::decodeCredit( PacketReader &stream )
+{
+  qint64 consumed;
+  qint64 limit;
+  stream >> consumed >> limit;
+  if( !stream.isValid() )
+    return;
+  updateWindow( consumed );
+  fPeerConsumed = consumed;
+  fCreditLimit = limit;
+  //a raw transfer waiting for credit goes on
+  writeRaw();
+  emit recvCredit();
+}
+
+// Hands out more credit when enough has been consumed since the last grant. Bytes held by the
+// receiver are not consumed until they are released
+void RemoteObjectConnection::grantCredit( bool force )
+{
+  if( fReceiveWindow <= 0 || !isVersionKnown || !peerSupports(CapCredit) )
+    return;
+  qint64 consumed = fBytesReceived - fBytesHeld;
+  qint64 unacknowledged = consumed - fCreditConsumed;
+  if( force || unacknowledged >= s_CreditStep || (unacknowledged > 0 && fSocket->bytesAvailable() == 0) )
+  {
+    fCreditConsumed = consumed;
+    sendCredit( consumed, consumed + fReceiveWindow );
+  }
+}
+
+qint64 RemoteObjectConnection::holdCredit()
+{
+  qint64 bytes = fFrameBytes;
+  fFrameBytes = 0;
+  fBytesHeld += bytes;
+  return bytes;
+}
+
+void RemoteObjectConnection::releaseCredit( qint64 bytes )
+{
+  if( bytes <= 0 )
+    return;
+  fBytesHeld -= bytes;
+  grantCredit( false );
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Adapts the send window to the bandwidth-delay product
+///
+/// The round trip is the time from sending a byte until credit for it
+/// comes back, the smallest one seen is used so queueing does not inflate
+/// it. The delivery rate is the rate at which the peer consumes data,
+/// taken as a slowly decaying maximum.
+//////////////////////////////////////////////////////////////////////////
+void RemoteObjectConnection::updateWindow( qint64 consumed )
+{
+  qint64 now = fClock.elapsed();
+  while( !fRttSamples.isEmpty() && fRttSamples.first().first <= consumed )
+  {
+    qint64 rtt = now - fRttSamples.takeFirst().second;
+    fMinRtt = fMinRtt < 0 ? rtt : qMin( fMinRtt, rtt );
+  }
+
+  if( fLastCreditTime >= 0 && now > fLastCreditTime && consumed > fPeerConsumed )
+  {
+    double rate = static_cast<double>(consumed - fPeerConsumed) / (now - fLastCreditTime);
+    fDeliveryRate = qMax( rate, fDeliveryRate * 0.9 );
+  }
+  fLastCreditTime = now;
+
+  if( fMinRtt >= 0 && fDeliveryRate > 0 )
+  {
+    qint64 bdp = static_cast<qint64>( fDeliveryRate * qMax<qint64>(fMinRtt, 1) );
+    fWindow = qBound( s_MinWindow, 2*bdp, s_MaxWindow );
+  }
+}
+
+qint64 RemoteObjectConnection::sendWindow() const
+{
+  //without credit from the peer only what is still in our own buffer is known to be in flight
+  qint64 inFlight = fCreditLimit < 0 ? fSocket->bytesToWrite() : fBytesSent - fPeerConsumed;
+  qint64 room = fWindow - inFlight;
+  if( fCreditLimit >= 0 )
+    room = qMin( room, fCreditLimit - fBytesSent );
+  return qMax<qint64>( room, 0 );
+}
+
+void RemoteObjectConnection::bytesSent( qint64 count )
+{
+  fBytesSent += count;
+  qint64 now = fClock.elapsed();
+  if( fRttSamples.isEmpty() || (now - fRttSamples.last().second >= s_RttSampleInterval && fRttSamples.size() < 256) )
+    fRttSamples.append( qMakePair(fBytesSent, now) );
+}
+
+//-----------------------------------------------------------------------------
+
+// RO_VERSION is always in the baseline format, the compact format is only used once both sides know of it
 void RemoteObjectConnection::sendVersion()
 {
-  QByteArray sdata;
-  QDataStream stream( &sdata, QIODevice::WriteOnly );
-  stream << RemoteObjectConnection::version;
+  PacketWriter stream( false );
+  stream << RemoteObjectConnection::version << s_Capabilities << s_SupportedCodecs << s_MaxPacketSize << s_MaxStreams;
   isVersionKnown = true;
-  sendRemoteObject( RO_VERSION, sdata );
+  isVersionSent = true;
+  sendRemoteObject( RO_VERSION, stream.data() );
 }
 
-void RemoteObjectConnection::decodeVersion( QDataStream &stream )
+void RemoteObjectConnection::decodeVersion( PacketReader &stream )
 {
   int version;
   stream >> version;
-  if(version != RemoteObjectConnection::version)
+  if( !stream.isValid() )
+    return;
+  if( version < RemoteObjectConnection::version )
   {
     emit recvVersionMismatch();
   }
   else
   {
     isVersionKnown = true;
+    //baseline peers end the packet after the version
+    if( !stream.atEnd() )
+    {
+      qint32 maxPacketSize;
+      qint32 maxStreams;
+      stream >> fPeerCapabilities >> fPeerCodecs >> maxPacketSize >> maxStreams;
+      if( stream.isValid() )
+      {
+        fPeerMaxPacketSize = qMax( maxPacketSize, streamChunkSize );
+        fPeerMaxStreams = qBound( 1, maxStreams, int(s_MaxStreams) );
+      }
+      else
+      {
+        qWarning() << "[RemoteObjectConnection.Warning] Malformed capabilities in version packet, using the baseline protocol";
+        fPeerCapabilities = 0;
+        fPeerCodecs = 0;
+      }
+    }
+    //answer with our own version so the peer knows what we support
+    if( !isVersionSent )
+    {
+      sendVersion();
+    }
+    if( peerSupports(CapCompact) && !fCompactSend )
+    {
+      //the last packet in the baseline format, the peer switches its parser when it gets it
+      sendRemoteObject( RO_COMPACT, QByteArray(), false );
+      fCompactSend = true;
+    }
+    grantCredit( true );
+    emit recvVersion();
   }
 }
 
@@ -164,22 +1005,206 @@ void RemoteObjectConnection::decodeVersion( QDataStream &stream )
 
 void RemoteObjectConnection::sendDeleteFile( const QString &filename )
 {
-  QByteArray sdata;
-  QDataStream stream( &sdata, QIODevice::WriteOnly );
-  stream << filename;
-  sendRemoteObject( RO_DELETEFILE, sdata );
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream.path( filename );
+  sendRemoteObject( RO_DELETEFILE, stream.data() );
 }
 
-void RemoteObjectConnection::decodeDeleteFile( QDataStream &stream )
+void RemoteObjectConnection::decodeDeleteFile( PacketReader &stream )
 {
   QString filename;
-  stream >> filename;
+  stream.path( filename );
+  if( !stream.isValid() )
+    return;
   emit recvDeleteFile( filename );
 }
 
+void RemoteObjectConnection::sendRename( const QString &oldName, const QString &newName, bool directory )
+{
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream.path( oldName ).path( newName );
+  sendRemoteObject( directory ? RO_RENAMEDIR : RO_RENAMEFILE, stream.data() );
+}
+
+void RemoteObjectConnection::decodeRename( PacketReader &stream, bool directory )
+{
+  QString oldName;
+  QString newName;
+  stream.path( oldName ).path( newName );
+  if( !stream.isValid() )
+    return;
+  emit recvRename( oldName, newName, directory );
+}
+
+void RemoteObjectConnection::sendRenameResult( const QString &oldName, const QString &newName, bool directory, bool result )
+{
+  PacketWriter stream( fCompactSend, sendPaths() );
+  stream.path( oldName ).path( newName ) << directory << result;
+  sendRemoteObject( RO_RENAMERESULT, stream.data() );
+}
+
+void RemoteObjectConnection::decodeRenameResult( PacketReader &stream )
+{
+  QString oldName;
+  QString newName;
+  bool directory;
+  bool result;
+  stream.path( oldName ).path( newName ) >> directory >> result;
+  if( !stream.isValid() )
+    return;
+  emit recvRenameResult( oldName, newName, directory, result );
+}
+
 //-----------------------------------------------------------------------------
 
-void RemoteObjectConnection::sendRemoteObject( int commandid, const QByteArray &data )
+// Extensions of formats that are compressed already, zlib only burns cpu on them
+static const char *s_CompressedExtensions[] = {
+  "7z", "apk", "bz2", "cab", "docx", "flac", "gif", "gz", "jar", "jpeg", "jpg", "lz4", "mkv", "mov", "mp3", "mp4",
+  "ogg", "png", "pptx", "rar", "tgz", "webm", "webp", "xlsx", "xz", "zip", "zst", NULL
+};
+
+bool RemoteObjectConnection::isCompressibleFile( const QString &filename )
+{
+  QString suffix = QFileInfo( filename ).suffix().toLower();
+  for( const char **ext = s_CompressedExtensions; *ext; ++ext )
+  {
+    if( suffix == QLatin1String(*ext) )
+      return false;
+  }
+  return true;
+}
+
+bool RemoteObjectConnection::compressesFile( const QString &filename ) const
+{
+  return fCompressionEnabled && (fPeerCodecs & RO_CODEC_ZLIB) && isCompressibleFile( filename );
+}
+
+// qUncompress allocates whatever size the payload claims, more than a packet may carry is refused
+static QByteArray uncompressPayload( const QByteArray &data, qint32 limit )
+{
+  if( data.size() < 4 )
+    return QByteArray();
+  quint32 expected = qFromBigEndian<quint32>( reinterpret_cast<const uchar*>(data.constData()) );
+  if( expected > quint32(limit) )
+    return QByteArray();
+  return qUncompress( data );
+}
+
+// Compresses a few slices of the payload, data that is random or compressed already hardly shrinks
+static bool sampleCompresses( const QByteArray &data )
+{
+  if( data.size() < 4*s_SampleSize )
+    return true;
+
+  QByteArray sample;
+  sample.reserve( 3*s_SampleSize );
+  sample.append( data.constData(), s_SampleSize );
+  sample.append( data.constData() + data.size()/2, s_SampleSize );
+  sample.append( data.constData() + data.size() - s_SampleSize, s_SampleSize );
+  QByteArray packed = qCompress( sample, 1 );
+  return packed.size() <= sample.size() - sample.size()/8;
+}
+
+// Baseline frames are a 32 bit command id and size, compact frames a varint command id with the
+// compressed flag in the lowest bit and a varint size
+int RemoteObjectConnection::encodeFrameHeader( int commandid, qint64 size, char *header ) const
+{
+  if( !fCompactSend )
+  {
+    qToBigEndian<qint32>( commandid, reinterpret_cast<uchar*>(header) );
+    qToBigEndian<qint32>( static_cast<qint32>(size), reinterpret_cast<uchar*>(header + 4) );
+    return 8;
+  }
+  quint64 command = (quint64(commandid & ~RO_COMPRESSED) << 1) | ((commandid & RO_COMPRESSED) ? 1 : 0);
+  int len = encodeVarint( command, header );
+  return len + encodeVarint( static_cast<quint64>(size), header + len );
+}
+
+// Packets sent during a slice of a raw file transfer are held back until the slice is done
+void RemoteObjectConnection::writePacket( int commandid, const QByteArray &data )
+{
+  char header[2*MaxVarintSize];
+  int headerSize = encodeFrameHeader( commandid, data.size(), header );
+  if( fRawFile != NULL && fRawOffset < fRawSliceEnd )
+  {
+    fRawQueue.append( header, headerSize );
+    fRawQueue.append( data );
+    return;
+  }
+
+  fSocket->write( header, headerSize );
+  fSocket->write( data );
+  bytesSent( headerSize + data.size() );
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Reads the header of the next frame into fHash and fSize
+///
+/// The header is peeked first so nothing is consumed until it is complete.
+/// Returns false when more data is needed or the header is malformed, in
+/// which case the connection is aborted.
+//////////////////////////////////////////////////////////////////////////
+bool RemoteObjectConnection::readFrameHeader()
+{
+  char header[2*MaxVarintSize];
+  if( !fCompactRecv )
+  {
+    if( fSocket->bytesAvailable() < 8 || fSocket->read(header, 8) != 8 )
+      return false;
+    fHash = qFromBigEndian<qint32>( reinterpret_cast<const uchar*>(header) );
+    fSize = qFromBigEndian<qint32>( reinterpret_cast<const uchar*>(header + 4) );
+    fHeaderSize = 8;
+  }
+  else
+  {
+    int peeked = static_cast<int>( fSocket->peek(header, sizeof(header)) );
+    quint64 command;
+    quint64 size;
+    int commandLen = decodeVarint( header, qMax(peeked, 0), command );
+    int sizeLen = commandLen > 0 ? decodeVarint( header + commandLen, peeked - commandLen, size ) : commandLen;
+    if( sizeLen == 0 )
+      return false;
+    //only peers that know our limit send compact frames, it holds for every one of them
+    if( sizeLen < 0 || command > quint64(RO_COMPRESSED - 1) << 1 || size > quint64(s_MaxPacketSize) )
+    {
+      qWarning() << "[RemoteObjectConnection.Warning] Malformed frame header";
+      fSocket->abort();
+      return false;
+    }
+    fSocket->read( header, commandLen + sizeLen );
+    fHash = static_cast<qint32>( command >> 1 ) | ((command & 1) ? RO_COMPRESSED : 0);
+    fSize = static_cast<qint64>( size );
+    fHeaderSize = commandLen + sizeLen;
+  }
+
+  //the size of a baseline frame always fits in an int
+  if( fSize < 0 || (fSize > s_MaxPacketSize && (fCompactRecv || fPeerCapabilities != 0)) )
+  {
+    //the peer knows our limit, a larger packet means the stream is corrupt
+    qWarning() << "[RemoteObjectConnection.Warning] Packet of " << fSize << " bytes exceeds the limit of " << s_MaxPacketSize;
+    fSize = -1;
+    fSocket->abort();
+    return false;
+  }
+  return true;
+}
+
+// Compressing only pays while zlib takes data in faster than the link carries it away, otherwise
+// the link waits for the compressor
+bool RemoteObjectConnection::compressionKeepsUp()
+{
+  if( fCompressRate <= 0 || fDeliveryRate <= 0 || fCompressRate > fDeliveryRate )
+  {
+    fCompressSkipped = 0;
+    return true;
+  }
+  if( ++fCompressSkipped < s_CompressProbe )
+    return false;
+  fCompressSkipped = 0;
+  return true;
+}
+
+void RemoteObjectConnection::sendRemoteObject( int commandid, const QByteArray &data, bool compressible )
 {
   if(!isVersionKnown)
   {
@@ -187,10 +1212,22 @@ void RemoteObjectConnection::sendRemoteObject( int commandid, const QByteArray &
     return;
   }
 
-  fStream << commandid;
-  fStream << data.size();
-  //fStream << data;
-  fSocket->write( data );
+  if( compressible && fCompressionEnabled && (fPeerCodecs & RO_CODEC_ZLIB) && data.size() >= s_MinCompressSize &&
+      compressionKeepsUp() && sampleCompresses(data) )
+  {
+    QElapsedTimer timer;
+    timer.start();
+    QByteArray packed = qCompress( data, s_CompressionLevel );
+    double rate = data.size() * 1e6 / qMax<qint64>( timer.nsecsElapsed(), 1 );
+    fCompressRate = fCompressRate > 0 ? 0.9 * fCompressRate + 0.1 * rate : rate;
+    if( packed.size() < data.size() )
+    {
+      writePacket( commandid | RO_COMPRESSED, packed );
+      return;
+    }
+  }
+
+  writePacket( commandid, data );
 }
 
 void RemoteObjectConnection::readyRead()
@@ -199,23 +1236,57 @@ void RemoteObjectConnection::readyRead()
   
   for(;;)
   {
-    if( fSize==-1 && fSocket->bytesAvailable()>=8 )
+    if( fRawRemaining > 0 )
     {
-      fStream >> fHash >> fSize;
-      //qDebug() << "[RemoteObjectConnection.Debug] ServerSocket::readyRead: " << fHash << " " << fSize;
+      //file data following a RO_SENDFILERAW header
+      if( !receiveRaw() )
+        break;
+      continue;
     }
-    if( fSize==-1 || (int)fSocket->bytesAvailable()<fSize )
+
+    if( fSize==-1 && !readFrameHeader() )
+    {
+      break;
+    }
+    if( fHash == RO_RAWSLICE )
+    {
+      //file data following a RO_SENDFILERAW header
+      beginRawSlice();
+      continue;
+    }
+    if( fSocket->bytesAvailable()<fSize )
     {
       break;
     }
 
-    //qDebug() << "[RemoteObjectConnection.Debug] ServerSocket::readyRead: read command";
-    
-    QByteArray data = fSocket->read( fSize );
-    assert( data.size() ==fSize );
-    QDataStream stream( &data, QIODevice::ReadOnly );
-
+    //the frame is read into a buffer that is kept between frames
+    fFrame.resize( static_cast<int>(fSize) );
+    qint64 read = fFrame.size() == fSize ? fSocket->read( fFrame.data(), fFrame.size() ) : -1;
+    if( read != fFrame.size() )
+    {
+      qWarning() << "[RemoteObjectConnection.Warning] Short read of packet " << fHash;
+      fSocket->abort();
+      break;
+    }
     fSize = -1;
+    fBytesReceived += fHeaderSize + read;
+    fFrameBytes = fHeaderSize + read;
+
+    const QByteArray *payload = &fFrame;
+    QByteArray unpacked;
+    if( fHash & RO_COMPRESSED )
+    {
+      fHash &= ~RO_COMPRESSED;
+      unpacked = uncompressPayload( fFrame, s_MaxPacketSize );
+      if( unpacked.isEmpty() )
+      {
+        qWarning() << "[RemoteObjectConnection.Warning] Could not decompress packet " << fHash;
+        emit recvUnknownPacket();
+        continue;
+      }
+      payload = &unpacked;
+    }
+    PacketReader stream( payload->constData(), payload->size(), fCompactRecv, receivePaths() );
     
     switch( fHash )
     {
@@ -226,10 +1297,55 @@ void RemoteObjectConnection::readyRead()
       case RO_SENDFILERESULT: decodeSendFileResult( stream ); break;
       case RO_VERSION: decodeVersion( stream ); break;
       case RO_DELETEFILE: decodeDeleteFile( stream ); break;
+      case RO_SENDFILEBEGIN: decodeSendFileBegin( stream ); break;
+      case RO_SENDFILECHUNK: decodeSendFileChunk( stream ); break;
+      case RO_SENDFILEEND: decodeSendFileEnd( stream ); break;
+      case RO_STATFILEBATCH: decodeStatFileBatchReq( stream ); break;
+      case RO_STATFILEBATCHREPLY: decodeStatFileBatchReply( stream ); break;
+      case RO_MANIFESTREQ: decodeManifestReq( stream ); break;
+      case RO_MANIFESTENTRIES: decodeManifestEntries( stream ); break;
+      case RO_MANIFESTEND: decodeManifestEnd( stream ); break;
+      case RO_SIGNATUREREQ: decodeSignatureReq( stream ); break;
+      case RO_SIGNATUREREPLY: decodeSignatureReply( stream ); break;
+      case RO_SENDDELTA: decodeSendDelta( stream ); break;
+      case RO_DELTABEGIN: decodeSendDeltaBegin( stream ); break;
+      case RO_DELTACHUNK: decodeSendDeltaChunk( stream ); break;
+      case RO_DELTAEND: decodeSendDeltaEnd( stream ); break;
+      case RO_HASHCHECK: decodeHashCheckReq( stream ); break;
+      case RO_HASHCHECKREPLY: decodeHashCheckReply( stream ); break;
+      case RO_SENDFILERAW: decodeSendFileRaw( stream ); break;
+      case RO_JOINSESSION: decodeJoinSession( stream ); break;
+      case RO_CREDIT: decodeCredit( stream ); break;
+      case RO_RENAMEFILE: decodeRename( stream, false ); break;
+      case RO_RENAMEDIR: decodeRename( stream, true ); break;
+      case RO_RENAMERESULT: decodeRenameResult( stream ); break;
+      case RO_MATERIALIZE: decodeMaterializeReq( stream ); break;
+      case RO_COMPACT:
+        //only a peer that announced the compact format may switch to it
+        if( !peerSupports(CapCompact) )
+        {
+          qWarning() << "[RemoteObjectConnection.Warning] Compact format was not announced, closing the connection";
+          fSocket->abort();
+          return;
+        }
+        fCompactRecv = true;
+        break;
       default:
         emit recvUnknownPacket();
     }
+    if( !stream.isValid() )
+    {
+      //nothing was passed on, the stream can not be trusted to be in sync anymore
+      qWarning() << "[RemoteObjectConnection.Warning] Malformed packet " << fHash << ", closing the connection";
+      fSocket->abort();
+      return;
+    }
+    if( fFrame.capacity() > s_MaxKeptFrame )
+    {
+      fFrame = QByteArray();
+    }
   }
+  grantCredit( false );
 }
 
 void RemoteObjectConnection::disconnected()
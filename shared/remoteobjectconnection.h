@@ -3,10 +3,15 @@
 #ifndef QUICKSYNC_ROCONNECTION_H
 #define QUICKSYNC_ROCONNECTION_H
 
+#include "deltasync.h"
+#include "wireformat.h"
+#include <QtCore/QElapsedTimer>
+
 
 //-----------------------------------------------------------------------------
 
 class RemoteObject;
+class QSocketNotifier;
 
 //-----------------------------------------------------------------------------
 
@@ -21,44 +26,251 @@ public:
   void sendTargetDirectory(const QString &targetdirectory);
   void sendStatFileReq( const QString &filename );
   void sendStatFileReply( const QString &filename, const QDateTime &mtime );
+  void sendStatFileBatchReq( quint32 id, const QString &dir, const QStringList &names );
+  void sendStatFileBatchReply( quint32 id, const QVector<qint64> &mtimes, const QVector<qint64> &sizes );
+  void sendManifestReq();
+  void sendManifestEntries( const QStringList &paths, const QVector<qint64> &mtimes, const QVector<qint64> &sizes );
+  void sendManifestEnd( qint64 count );
   void sendSendFile( const QString &filename, const QDateTime &mtime, const QByteArray &data, bool executable );
+  void sendSendFileBegin( const QString &filename, const QDateTime &mtime, bool executable );
+  void sendSendFileChunk( const QByteArray &data );
+  void sendSendFileEnd( bool complete );
+  //! Send the file at path without copying it through packets: sendfile(2) on Linux, mapped slices elsewhere.
+  //! Other packets go out between the slices of the file, sendFileRawDone is emitted once it is done.
+  //! Returns false if the file could not be opened
+  bool sendSendFileRaw( const QString &filename, const QString &path, bool executable );
+  //! Stop the raw transfer in progress at the end of the current slice, the receiver gets an incomplete file
+  void abortSendFileRaw();
+  bool isSendingRaw() const { return fRawFile != NULL; }
+  void sendSignatureReq( const QString &filename, int blockSize );
+  void sendSignatureReply( const QString &filename, const DeltaSignature &signature );
+  void sendSendDelta( const QString &filename, const QDateTime &mtime, int blockSize, const QByteArray &delta, bool executable );
+  //! A delta in pieces of at most streamChunkSize, sendSendDeltaEnd(false) drops it on the peer
+  void sendSendDeltaBegin( const QString &filename, const QDateTime &mtime, int blockSize, bool executable );
+  void sendSendDeltaChunk( const QByteArray &ops );
+  void sendSendDeltaEnd( bool complete );
+  void sendHashCheckReq( const QString &filename, const QDateTime &mtime, qint64 size, const QByteArray &hash );
+  //! Like sendHashCheckReq, but the peer also looks for another file with this content to copy from.
+  //! Answered with RO_HASHCHECKREPLY, a match means the file now has the content
+  void sendMaterializeReq( const QString &filename, const QDateTime &mtime, qint64 size, const QByteArray &hash, bool executable );
+  void sendHashCheckReply( const QString &filename, const QDateTime &mtime, bool match );
   void sendSendFileResult( const QString &filename, const QDateTime &mtime, int result );
   void sendVersion();
+  void sendJoinSession( const QByteArray &sessionId );
+  void sendCredit( qint64 consumed, qint64 limit );
   void sendDeleteFile( const QString &filename );
+  //! Move a file or a whole directory on the peer, answered with RO_RENAMERESULT
+  void sendRename( const QString &oldName, const QString &newName, bool directory );
+  void sendRenameResult( const QString &oldName, const QString &newName, bool directory, bool result );
+
+  //! Protocol features announced in RO_VERSION. Peers that send none only speak the baseline protocol
+  enum Capability
+  {
+    CapStreaming   = 1<<0,   //!< RO_SENDFILEBEGIN/CHUNK/END streamed transfer
+    CapStatBatch   = 1<<1,   //!< RO_STATFILEBATCH
+    CapManifest    = 1<<2,   //!< walking the target directory into a RO_MANIFESTENTRIES stream
+    CapDelta       = 1<<3,   //!< block signatures and files rebuilt from a delta
+    CapHashCheck   = 1<<4,   //!< comparing a content hash against the local copy of a file
+    CapRawSend     = 1<<5,   //!< RO_SENDFILERAW followed by the whole file outside of a packet, no longer announced
+    CapSessions    = 1<<6,   //!< several connections joining one session with RO_JOINSESSION
+    CapCredit      = 1<<7,   //!< RO_CREDIT flow control
+    CapRename      = 1<<8,   //!< RO_RENAMEFILE and RO_RENAMEDIR applied in place
+    CapMaterialize = 1<<9,   //!< RO_MATERIALIZE, files created from a local copy with the same content hash
+    CapCompact     = 1<<10,  //!< compact wire format: varints, UTF-8 strings, nanosecond times and 64 bit frame sizes
+    CapDirIds      = 1<<11,  //!< paths in compact packets sent as a registered directory id and the file name
+    CapRawSlices   = 1<<12,  //!< RO_SENDFILERAW followed by the file in RO_RAWSLICE frames of raw data
+    CapDeltaStream = 1<<13   //!< RO_DELTABEGIN/CHUNK/END, a delta sent while it is computed
+  };
+  bool peerSupports( Capability capability ) const { return (fPeerCapabilities & capability) != 0; }
+
+  bool peerSupportsStreaming() const { return peerSupports( CapStreaming ); }
+  bool peerSupportsStatBatch() const { return peerSupports( CapStatBatch ); }
+  bool peerSupportsManifest() const { return peerSupports( CapManifest ); }
+  bool peerSupportsDelta() const { return peerSupports( CapDelta ); }
+  bool peerSupportsDeltaStream() const { return peerSupports( CapDeltaStream ); }
+  bool peerSupportsHashCheck() const { return peerSupports( CapHashCheck ); }
+  bool peerSupportsRawSend() const { return peerSupports( CapRawSlices ); }
+  bool peerSupportsSessions() const { return peerSupports( CapSessions ); }
+  bool peerSupportsRename() const { return peerSupports( CapRename ); }
+  bool peerSupportsMaterialize() const { return peerSupports( CapMaterialize ); }
+  //! Largest packet payload the peer accepts
+  qint32 peerMaxPacketSize() const { return fPeerMaxPacketSize; }
+  //! Most connections the peer accepts in one session
+  int peerMaxStreams() const { return fPeerMaxStreams; }
+
+  //! Hand out RO_CREDIT so the peer never has more than window bytes in flight, 0 (the default) grants none
+  void setReceiveWindow( qint64 window ) { fReceiveWindow = window; }
+  //! Bytes that can be sent now, limited by the credit from the peer and the send window
+  qint64 sendWindow() const;
+
+  //! Compress payloads when the peer can decode them, on by default. Receiving compressed packets always works
+  void setCompressionEnabled( bool enabled ) { fCompressionEnabled = enabled; }
+  //! False for file names with extensions of formats that are compressed already
+  static bool isCompressibleFile( const QString &filename );
+  //! True when the data of this file would be compressed on the way to the peer
+  bool compressesFile( const QString &filename ) const;
+
+  //! Largest payload put in a single RO_SENDFILECHUNK packet
+  static const int streamChunkSize;
+
   QTcpSocket *fSocket;
 
+protected:
+  //! Descriptor the data of a raw file transfer is written to directly instead of being emitted
+  //! with recvSendFileChunk, -1 for none. Only used on Linux
+  virtual int rawReceiveDescriptor() { return -1; }
+  //! Writing to the rawReceiveDescriptor failed, the rest of the data is emitted as usual
+  virtual void rawReceiveFailed() {}
+  //! Keeps the frame being decoded out of the credit handed back, for receivers that pass its data
+  //! on to be written later. Returns its size on the wire, to be given to releaseCredit once written
+  qint64 holdCredit();
+  void releaseCredit( qint64 bytes );
+
 signals:
   void recvTargetDirectory(const QString &filename);
   void recvStatFileReq( const QString &filename );
   void recvStatFileReply( const QString &filename, const QDateTime &mtime );
+  void recvStatFileBatchReq( quint32 id, const QString &dir, const QStringList &names );
+  void recvStatFileBatchReply( quint32 id, const QVector<qint64> &mtimes, const QVector<qint64> &sizes );
+  void recvManifestReq();
+  void recvManifestEntries( const QStringList &paths, const QVector<qint64> &mtimes, const QVector<qint64> &sizes );
+  void recvManifestEnd( qint64 count );
   void recvSendFile( const QString &filename, const QDateTime &mtime, const QByteArray &data, bool executable );
+  void recvSendFileBegin( const QString &filename, const QDateTime &mtime, bool executable );
+  void recvSendFileChunk( const QByteArray &data );
+  void recvSendFileEnd( bool complete );
+  void recvSignatureReq( const QString &filename, int blockSize );
+  void recvSignatureReply( const QString &filename, const DeltaSignature &signature );
+  void recvSendDelta( const QString &filename, const QDateTime &mtime, int blockSize, const QByteArray &delta, bool executable );
+  void recvSendDeltaBegin( const QString &filename, const QDateTime &mtime, int blockSize, bool executable );
+  void recvSendDeltaChunk( const QByteArray &ops );
+  void recvSendDeltaEnd( bool complete );
+  void recvHashCheckReq( const QString &filename, const QDateTime &mtime, qint64 size, const QByteArray &hash );
+  void recvMaterializeReq( const QString &filename, const QDateTime &mtime, qint64 size, const QByteArray &hash, bool executable );
+  void recvHashCheckReply( const QString &filename, const QDateTime &mtime, bool match );
   void recvSendFileResult( const QString &filename, const QDateTime &mtime, int result );
+  void recvVersion();
   void recvVersionMismatch();
+  void recvJoinSession( const QByteArray &sessionId );
+  void recvCredit();
   void recvDeleteFile( const QString &filename );
+  void recvRename( const QString &oldName, const QString &newName, bool directory );
+  void recvRenameResult( const QString &oldName, const QString &newName, bool directory, bool result );
   void recvUnknownPacket();
+  void sendFileRawDone();
 private:
-  void decodeTargetDirectory( QDataStream &stream );
-  void decodeStatFileReq( QDataStream &stream );
-  void decodeStatFileReply( QDataStream &stream );
-  void decodeSendFile( QDataStream &stream );
-  void decodeSendFileResult( QDataStream &stream );
-  void decodeVersion( QDataStream &stream );
-  void decodeDeleteFile( QDataStream &stream );
+  void decodeTargetDirectory( PacketReader &stream );
+  void decodeStatFileReq( PacketReader &stream );
+  void decodeStatFileReply( PacketReader &stream );
+  void decodeStatFileBatchReq( PacketReader &stream );
+  void decodeStatFileBatchReply( PacketReader &stream );
+  void decodeManifestReq( PacketReader &stream );
+  void decodeManifestEntries( PacketReader &stream );
+  void decodeManifestEnd( PacketReader &stream );
+  void decodeSendFile( PacketReader &stream );
+  void decodeSendFileBegin( PacketReader &stream );
+  void decodeSendFileChunk( PacketReader &stream );
+  void decodeSendFileEnd( PacketReader &stream );
+  void decodeSignatureReq( PacketReader &stream );
+  void decodeSignatureReply( PacketReader &stream );
+  void decodeSendDelta( PacketReader &stream );
+  void decodeSendDeltaBegin( PacketReader &stream );
+  void decodeSendDeltaChunk( PacketReader &stream );
+  void decodeSendDeltaEnd( PacketReader &stream );
+  void decodeHashCheckReq( PacketReader &stream );
+  void decodeMaterializeReq( PacketReader &stream );
+  void decodeHashCheckReply( PacketReader &stream );
+  void decodeSendFileRaw( PacketReader &stream );
+  void decodeSendFileResult( PacketReader &stream );
+  void decodeVersion( PacketReader &stream );
+  void decodeJoinSession( PacketReader &stream );
+  void decodeCredit( PacketReader &stream );
+  void decodeDeleteFile( PacketReader &stream );
+  void decodeRename( PacketReader &stream, bool directory );
+  void decodeRenameResult( PacketReader &stream );
 
 private slots:
   void readyRead();
   void disconnected();
   void connected();
+  void writeRaw();
   
 private:
-  void sendRemoteObject( int commandid, const QByteArray &data );
+  void sendRemoteObject( int commandid, const QByteArray &data, bool compressible=true );
+  bool compressionKeepsUp();
+  void writePacket( int commandid, const QByteArray &data );
+  int encodeFrameHeader( int commandid, qint64 size, char *header ) const;
+  bool readFrameHeader();
+  void beginRawSlice();
+  bool receiveRaw();
+  void grantCredit( bool force );
+  void updateWindow( qint64 consumed );
+  void bytesSent( qint64 count );
+#ifdef Q_OS_LINUX
+  bool openRawPipe();
+#endif
   
-  QDataStream fStream;
   qint32 fHash;
-  qint32 fSize;
+  qint64 fSize;       //-1 until the header of the next frame has been read
+  int fHeaderSize;
+  //payload of the frame being decoded, reused so frames do not allocate
+  QByteArray fFrame;
+  //compact wire format, each direction switches on its own with RO_COMPACT
+  bool fCompactSend;
+  bool fCompactRecv;
+  //directories registered for the paths in each direction
+  PathTable fSendPaths;
+  PathTable fReceivePaths;
+  PathTable *sendPaths() { return peerSupports(CapDirIds) ? &fSendPaths : NULL; }
+  PathTable *receivePaths() { return peerSupports(CapDirIds) ? &fReceivePaths : NULL; }
   bool isVersionKnown;
+  bool isVersionSent;
+  quint32 fPeerCapabilities;
+  quint32 fPeerCodecs;
+  qint32 fPeerMaxPacketSize;
+  qint32 fPeerMaxStreams;
+  bool fCompressionEnabled;
+  //compression choice for the chunks of the file being streamed, made from its name in sendSendFileBegin
+  bool fStreamCompressible;
+  //the same for the chunks of the delta being sent
+  bool fDeltaCompressible;
+
+  //raw file transfer in progress
+  QFile *fRawFile;
+  QString fRawFilename;
+  qint64 fRawSize;
+  qint64 fRawOffset;
+  qint64 fRawSliceEnd;  //end of the RO_RAWSLICE frame being written, fRawOffset between slices
+  bool fRawComplete;
+  QSocketNotifier *fRawNotifier;
+  QByteArray fRawQueue;
+  //bytes of raw file data still to be read
+  qint64 fRawRemaining;
+  //pipe the raw data is spliced through on its way from the socket to the file
+  int fRawPipe[2];
+
+  //flow control, all counts are bytes on the wire
+  qint64 fBytesSent;
+  qint64 fBytesReceived;
+  qint64 fReceiveWindow;
+  qint64 fCreditConsumed;  //what was consumed at the last grant
+  qint64 fBytesHeld;       //part of fBytesReceived that is not consumed yet, see holdCredit
+  qint64 fFrameBytes;      //size on the wire of the frame being decoded
+  qint64 fPeerConsumed;    //what the peer has consumed of fBytesSent
+  qint64 fCreditLimit;     //-1 until the peer grants credit
+  qint64 fWindow;
+  qint64 fMinRtt;          //ms, -1 until measured
+  double fDeliveryRate;    //bytes per ms
+  double fCompressRate;    //bytes per ms taken in by zlib, 0 until measured
+  int fCompressSkipped;    //compressible payloads sent uncompressed since the last probe
+  qint64 fLastCreditTime;
+  QElapsedTimer fClock;
+  QList<QPair<qint64, qint64> > fRttSamples; //fBytesSent and the time it was reached
 
   static const int version;
+  static const quint32 s_Capabilities;
+  static const qint32 s_MaxPacketSize;
+  static const qint32 s_MaxStreams;
 };
 
 //-----------------------------------------------------------------------------
@@ -4,6 +4,53 @@
 #include "scannerbase.h"
 #include "utils.h"
 #include "filescanner.h"
+#include "parallelfilescanner.h"
+#include "syncrules.h"
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+//-----------------------------------------------------------------------------
+
+#ifdef Q_OS_LINUX
+//What getdents64 returns, glibc has no declaration of it
+struct LinuxDirent64
+{
+  quint64 d_ino;
+  qint64 d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
+};
+
+// Type, mtime and size of a name in the directory fd, false for anything but files and directories
+static bool statEntry( int dirfd, const char *name, bool &dir, qint64 &mtime, qint64 &size )
+{
+#ifdef STATX_BASIC_STATS
+  struct statx info;
+  if( statx(dirfd, name, AT_STATX_SYNC_AS_STAT, STATX_TYPE | STATX_MTIME | STATX_SIZE, &info) != 0 )
+    return false;
+  dir = S_ISDIR( info.stx_mode );
+  if( !dir && !S_ISREG(info.stx_mode) )
+    return false;
+  mtime = static_cast<qint64>( info.stx_mtime.tv_sec ) * 1000 + info.stx_mtime.tv_nsec / 1000000;
+  size = info.stx_size;
+#else
+  struct stat info;
+  if( fstatat(dirfd, name, &info, 0) != 0 )
+    return false;
+  dir = S_ISDIR( info.st_mode );
+  if( !dir && !S_ISREG(info.st_mode) )
+    return false;
+  mtime = static_cast<qint64>( info.st_mtim.tv_sec ) * 1000 + info.st_mtim.tv_nsec / 1000000;
+  size = info.st_size;
+#endif
+  return true;
+}
+#endif
 
 //-----------------------------------------------------------------------------
 
@@ -25,8 +72,161 @@ ScannerBase::~ScannerBase()
 
 //-----------------------------------------------------------------------------
 
-ScannerBase *ScannerBase::selectScannerForFolder( const QString &rootPath, QSharedPointer<SyncRules> rules )
+// Entries come in the order of the file system, hidden ones are skipped like QDir does without QDir::Hidden
+bool ScannerBase::readDirectory( const QString &path, QList<DirEntry> &entries )
+{
+#ifdef Q_OS_LINUX
+  int fd = ::open( QFile::encodeName(path).constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+  if( fd < 0 )
+    return false;
+
+  char buffer[1<<15] __attribute__((aligned(8)));
+  for( ;; )
+  {
+    long length = syscall( SYS_getdents64, fd, buffer, sizeof(buffer) );
+    if( length <= 0 )
+      break;
+    for( long pos = 0; pos < length; )
+    {
+      const LinuxDirent64 *entry = reinterpret_cast<const LinuxDirent64*>( buffer + pos );
+      pos += entry->d_reclen;
+      if( entry->d_name[0] == '.' )
+        continue;
+
+      DirEntry dirEntry;
+      dirEntry.mtime = 0;
+      dirEntry.size = 0;
+      if( entry->d_type == DT_DIR )
+      {
+        //directories need no metadata, the type is all the listing has to tell
+        dirEntry.dir = true;
+      }
+      else if( entry->d_type == DT_REG || entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN )
+      {
+        if( !statEntry(fd, entry->d_name, dirEntry.dir, dirEntry.mtime, dirEntry.size) )
+          continue;
+      }
+      else
+      {
+        continue;
+      }
+      dirEntry.name = QFile::decodeName( entry->d_name );
+      entries.append( dirEntry );
+    }
+  }
+  ::close( fd );
+  return true;
+#else
+  QDir dir( path );
+  if( !dir.exists() )
+    return false;
+  QFileInfoList list = dir.entryInfoList( QDir::AllEntries | QDir::NoDotAndDotDot, QDir::NoSort );
+  foreach( const QFileInfo &info, list )
+  {
+    DirEntry dirEntry;
+    dirEntry.name = info.fileName();
+    dirEntry.dir = info.isDir();
+    dirEntry.mtime = dirEntry.dir ? 0 : info.lastModified().toMSecsSinceEpoch();
+    dirEntry.size = dirEntry.dir ? 0 : info.size();
+    entries.append( dirEntry );
+  }
+  return true;
+#endif
+}
+
+QSharedPointer<SyncRules> ScannerBase::rulesForDirectory( const QString &path, const QList<DirEntry> &entries, QSharedPointer<SyncRules> rules, bool &loaded )
+{
+  loaded = false;
+  foreach( const DirEntry &entry, entries )
+  {
+    if( entry.dir || entry.name != "syncrules.xml" )
+      continue;
+    QSharedPointer<SyncRules> loadRules( new SyncRules );
+    if( loadRules->loadXmlRules(joinPath(path, entry.name)) )
+    {
+      loaded = true;
+      return loadRules;
+    }
+    break;
+  }
+  return rules;
+}
+
+bool ScannerBase::hasRuleFile( const QString &dir )
+{
+  return QFile::exists( joinPath(dir, "syncrules.xml") );
+}
+
+void ScannerBase::scanDirectory( const QString &path, QSharedPointer<SyncRules> rules, bool excluded, ScanSink &sink ) const
+{
+  QString search = joinPath( fRootPath, path );
+  //one probe instead of the listing, most excluded directories have no rules of their own
+  if( excluded && !hasRuleFile(search) )
+  {
+    sink.fDirsFound--;
+    sink.fDirsIgnored++;
+    return;
+  }
+  QList<DirEntry> entries;
+  readDirectory( search, entries );
+
+  //the rules of a subdirectory apply to it and everything below it, the one in the root is loaded up front
+  if( path != "." )
+  {
+    bool loaded;
+    rules = rulesForDirectory( search, entries, rules, loaded );
+    if( loaded )
+      sink.ruleFile( path, rules );
+    SyncRuleFlags_e flags;
+    if( (loaded || excluded) && !rules->CheckFile(path.toLower(), flags) )
+    {
+      sink.fDirsFound--;
+      sink.fDirsIgnored++;
+      return;
+    }
+  }
+  sink.fDirsScanned++;
+
+  foreach( const DirEntry &entry, entries )
+  {
+    if( entry.dir )
+    {
+      QString dir = joinPath( path, entry.name );
+      SyncRuleFlags_e flags;
+      //decided here, a syncrules.xml of its own can still include an excluded one when it is scanned
+      sink.fDirsFound++;
+      sink.subdir( dir, rules, !rules->CheckFile(dir.toLower(), flags) );
+    }
+    else
+    {
+      if( entry.name.endsWith("syncrules.xml") )
+        continue;
+
+      SyncRuleFlags_e flags;
+      if( rules->CheckFile(entry.name.toLower(), flags) )
+      {
+        //the listing already stat'ed the file
+        FileInfo fileInfo;
+        fileInfo.mtime = QDateTime::fromMSecsSinceEpoch( entry.mtime );
+        fileInfo.size = entry.size;
+        fileInfo.binary = (flags&e_Binary) == e_Binary;
+        fileInfo.executable = (flags&e_Executable) == e_Executable;
+        sink.file( joinPath(path, entry.name), fileInfo );
+      }
+      else
+      {
+        sink.fFilesIgnored++;
+      }
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+ScannerBase *ScannerBase::selectScannerForFolder( const QString &rootPath, QSharedPointer<SyncRules> rules, int threads )
 {
+  if( threads > 1 )
+    return new ParallelFileScanner(rootPath, rules, threads);
   return new FileScanner(rootPath, rules);
 }
 
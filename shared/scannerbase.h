@@ -18,14 +18,36 @@ public:
     QString fError;
   };
 
-  struct FileInfo { QDateTime mtime; bool binary; bool executable;};
+  struct FileInfo { QDateTime mtime; qint64 size; bool binary; bool executable;};
+  //! An entry of a directory listing, mtime in ms and size are only set for files
+  struct DirEntry { QString name; bool dir; qint64 mtime; qint64 size; };
+
+  //! Receives what scanDirectory finds in one directory, the counters are added to
+  class ScanSink
+  {
+  public:
+    ScanSink() : fDirsScanned(0), fDirsFound(0), fDirsIgnored(0), fFilesIgnored(0) {}
+    virtual ~ScanSink() {}
+    //! dir has a valid syncrules.xml, rules apply to it and everything below it
+    virtual void ruleFile( const QString &dir, QSharedPointer<SyncRules> rules ) =0;
+    virtual void file( const QString &path, const FileInfo &info ) =0;
+    //! A subdirectory to scan with rules, it is counted in fDirsFound already. An excluded one
+    //! is dropped when it is scanned unless it has a syncrules.xml
+    virtual void subdir( const QString &dir, QSharedPointer<SyncRules> rules, bool excluded ) =0;
+
+    int fDirsScanned;
+    int fDirsFound;
+    int fDirsIgnored;
+    int fFilesIgnored;
+  };
 
   //-------------------------------------
 
   ScannerBase( const QString &rootPath, QSharedPointer<SyncRules> rules );
   virtual ~ScannerBase();
   
-  static ScannerBase *selectScannerForFolder( const QString &rootPart, QSharedPointer<SyncRules> rules );
+  //! More than one thread selects the parallel scanner
+  static ScannerBase *selectScannerForFolder( const QString &rootPart, QSharedPointer<SyncRules> rules, int threads = 1 );
   
   virtual bool scanStep() =0;
 
@@ -47,6 +69,17 @@ signals:
   void signalSyncRuleFile(const QString& dir, QSharedPointer<SyncRules> rules);
 
 protected:
+  //! Lists path without sorting, each file is stat'ed once. On Linux the entries are read with
+  //! getdents64 and the files stat'ed with statx relative to the directory
+  static bool readDirectory( const QString &path, QList<DirEntry> &entries );
+  //! Rules for the entries of a directory, a syncrules.xml in its listing replaces the inherited ones
+  static QSharedPointer<SyncRules> rulesForDirectory( const QString &path, const QList<DirEntry> &entries, QSharedPointer<SyncRules> rules, bool &loaded );
+  //! True when dir has a syncrules.xml, it decides about dir itself even when the parent's rules exclude it
+  static bool hasRuleFile( const QString &dir );
+  //! Lists path below the root and sorts its entries by rules into sink, the same for every scanner.
+  //! An excluded path is only listed when it has rules of its own
+  void scanDirectory( const QString &path, QSharedPointer<SyncRules> rules, bool excluded, ScanSink &sink ) const;
+
   QString fRootPath;
 
   int fFileCount;
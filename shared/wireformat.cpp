@@ -0,0 +1,573 @@
+#include "PreCompile.h"
+#include "wireformat.h"
+#include <QtCore/QtEndian>
+
+//-----------------------------------------------------------------------------
+
+//Timestamp sent for an invalid QDateTime, a missing file
+static const qint64 s_InvalidTime = Q_INT64_C(-0x7fffffffffffffff) - 1;
+static const qint64 s_NanosPerMsec = 1000000;
+
+int encodeVarint( quint64 value, char *out )
+{
+  int len = 0;
+  while( value >= 0x80 )
+  {
+    out[len++] = char( (value & 0x7f) | 0x80 );
+    value >>= 7;
+  }
+  out[len++] = char( value );
+  return len;
+}
+
+int decodeVarint( const char *data, int size, quint64 &value )
+{
+  value = 0;
+  for( int i=0; i<MaxVarintSize; ++i )
+  {
+    if( i == size )
+      return 0;
+    uchar byte = static_cast<uchar>( data[i] );
+    value |= quint64(byte & 0x7f) << (7*i);
+    if( (byte & 0x80) == 0 )
+      return i + 1;
+  }
+  return -1;
+}
+
+//-----------------------------------------------------------------------------
+
+quint32 PathTable::add( const QString &dir )
+{
+  if( fDirs.size() >= MaxDirs )
+    return 0;
+  fDirs.append( dir );
+  fIds.insert( dir, fDirs.size() );
+  return fDirs.size();
+}
+
+//-----------------------------------------------------------------------------
+
+PacketWriter::PacketWriter( bool compact, PathTable *paths ) :
+  fCompact( compact ),
+  fPaths( compact ? paths : NULL )
+{
+  if( !fCompact )
+  {
+    fBuffer.setBuffer( &fData );
+    fBuffer.open( QIODevice::WriteOnly );
+    fStream.setDevice( &fBuffer );
+  }
+}
+
+void PacketWriter::writeVarint( quint64 value )
+{
+  char buffer[MaxVarintSize];
+  fData.append( buffer, encodeVarint(value, buffer) );
+}
+
+void PacketWriter::writeSigned( qint64 value )
+{
+  //zigzag, small negative numbers stay short
+  writeVarint( (quint64(value) << 1) ^ quint64(value >> 63) );
+}
+
+PacketWriter &PacketWriter::operator<<( bool value )
+{
+  if( fCompact )
+    fData.append( char(value ? 1 : 0) );
+  else
+    fStream << value;
+  return *this;
+}
+
+PacketWriter &PacketWriter::operator<<( qint32 value )
+{
+  if( fCompact )
+    writeSigned( value );
+  else
+    fStream << value;
+  return *this;
+}
+
+PacketWriter &PacketWriter::operator<<( quint32 value )
+{
+  if( fCompact )
+    writeVarint( value );
+  else
+    fStream << value;
+  return *this;
+}
+
+PacketWriter &PacketWriter::operator<<( qint64 value )
+{
+  if( fCompact )
+    writeSigned( value );
+  else
+    fStream << value;
+  return *this;
+}
+
+PacketWriter &PacketWriter::operator<<( const QString &value )
+{
+  if( fCompact )
+    *this << value.toUtf8();
+  else
+    fStream << value;
+  return *this;
+}
+
+PacketWriter &PacketWriter::operator<<( const QByteArray &value )
+{
+  if( fCompact )
+  {
+    writeVarint( static_cast<quint64>(value.size()) );
+    fData.append( value );
+  }
+  else
+  {
+    fStream << value;
+  }
+  return *this;
+}
+
+PacketWriter &PacketWriter::operator<<( const QDateTime &value )
+{
+  if( fCompact )
+    writeSigned( value.isValid() ? value.toMSecsSinceEpoch() * s_NanosPerMsec : s_InvalidTime );
+  else
+    fStream << value;
+  return *this;
+}
+
+PacketWriter &PacketWriter::operator<<( const QStringList &value )
+{
+  if( fCompact )
+  {
+    writeVarint( static_cast<quint64>(value.size()) );
+    foreach( const QString &s, value )
+      *this << s;
+  }
+  else
+  {
+    fStream << value;
+  }
+  return *this;
+}
+
+PacketWriter &PacketWriter::operator<<( const QVector<qint64> &value )
+{
+  if( fCompact )
+  {
+    writeVarint( static_cast<quint64>(value.size()) );
+    for( int i=0; i<value.size(); ++i )
+      writeSigned( value.at(i) );
+  }
+  else
+  {
+    fStream << value;
+  }
+  return *this;
+}
+
+// These are checksums, random bits would only grow as varints
+PacketWriter &PacketWriter::operator<<( const QVector<quint32> &value )
+{
+  if( fCompact )
+  {
+    writeVarint( static_cast<quint64>(value.size()) );
+    int offset = fData.size();
+    fData.resize( offset + 4*value.size() );
+    uchar *out = reinterpret_cast<uchar*>( fData.data() + offset );
+    for( int i=0; i<value.size(); ++i )
+      qToLittleEndian( value.at(i), out + 4*i );
+  }
+  else
+  {
+    fStream << value;
+  }
+  return *this;
+}
+
+PacketWriter &PacketWriter::operator<<( const QList<QByteArray> &value )
+{
+  if( fCompact )
+  {
+    writeVarint( static_cast<quint64>(value.size()) );
+    foreach( const QByteArray &a, value )
+      *this << a;
+  }
+  else
+  {
+    fStream << value;
+  }
+  return *this;
+}
+
+// Interned paths start with a tag: 0 for a plain path, an odd tag for a file in the registered
+// directory tag>>1 and an even tag to register the directory tag>>1 before the file name
+PacketWriter &PacketWriter::path( const QString &value )
+{
+  if( fPaths == NULL )
+    return *this << value;
+
+  int slash = value.lastIndexOf( '/' );
+  if( slash <= 0 )
+  {
+    writeVarint( 0 );
+    return *this << value;
+  }
+
+  QString dir = value.left( slash );
+  quint32 id = fPaths->find( dir );
+  if( id != 0 )
+  {
+    writeVarint( (quint64(id) << 1) | 1 );
+  }
+  else if( (id = fPaths->add(dir)) != 0 )
+  {
+    writeVarint( quint64(id) << 1 );
+    *this << dir;
+  }
+  else
+  {
+    writeVarint( 0 );
+    return *this << value;
+  }
+  return *this << value.mid( slash + 1 );
+}
+
+PacketWriter &PacketWriter::paths( const QStringList &value )
+{
+  if( fPaths == NULL )
+    return *this << value;
+
+  writeVarint( static_cast<quint64>(value.size()) );
+  foreach( const QString &s, value )
+    path( s );
+  return *this;
+}
+
+//-----------------------------------------------------------------------------
+
+PacketReader::PacketReader( const char *data, int size, bool compact, PathTable *paths ) :
+  fCompact( compact ),
+  fPaths( compact ? paths : NULL ),
+  fData( data ),
+  fEnd( data + size ),
+  fValid( true )
+{
+  if( !fCompact )
+  {
+    //QDataStream reads the payload where it is
+    fRaw = QByteArray::fromRawData( data, size );
+    fBuffer.setBuffer( &fRaw );
+    fBuffer.open( QIODevice::ReadOnly );
+    fStream.setDevice( &fBuffer );
+  }
+}
+
+bool PacketReader::atEnd() const
+{
+  return fCompact ? fData == fEnd : fStream.atEnd();
+}
+
+bool PacketReader::isValid() const
+{
+  return fCompact ? fValid : fStream.status() == QDataStream::Ok;
+}
+
+bool PacketReader::readVarint( quint64 &value )
+{
+  int len = fValid ? decodeVarint( fData, static_cast<int>(fEnd - fData), value ) : -1;
+  if( len <= 0 )
+  {
+    fValid = false;
+    value = 0;
+    return false;
+  }
+  fData += len;
+  return true;
+}
+
+bool PacketReader::readSigned( qint64 &value )
+{
+  quint64 raw;
+  bool ok = readVarint( raw );
+  value = qint64( raw >> 1 ) ^ -qint64( raw & 1 );
+  return ok;
+}
+
+bool PacketReader::readLength( int &length, int minSize )
+{
+  quint64 raw;
+  length = 0;
+  if( !readVarint(raw) )
+    return false;
+  if( raw > static_cast<quint64>(fEnd - fData) / static_cast<quint64>(qMax(minSize, 1)) )
+  {
+    fValid = false;
+    return false;
+  }
+  length = static_cast<int>( raw );
+  return true;
+}
+
+PacketReader &PacketReader::operator>>( bool &value )
+{
+  if( !fCompact )
+  {
+    fStream >> value;
+  }
+  else if( fValid && fData != fEnd )
+  {
+    value = *fData++ != 0;
+  }
+  else
+  {
+    fValid = false;
+    value = false;
+  }
+  return *this;
+}
+
+PacketReader &PacketReader::operator>>( qint32 &value )
+{
+  if( fCompact )
+  {
+    qint64 wide;
+    readSigned( wide );
+    value = static_cast<qint32>( wide );
+  }
+  else
+  {
+    fStream >> value;
+  }
+  return *this;
+}
+
+PacketReader &PacketReader::operator>>( quint32 &value )
+{
+  if( fCompact )
+  {
+    quint64 wide;
+    readVarint( wide );
+    value = static_cast<quint32>( wide );
+  }
+  else
+  {
+    fStream >> value;
+  }
+  return *this;
+}
+
+PacketReader &PacketReader::operator>>( qint64 &value )
+{
+  if( fCompact )
+    readSigned( value );
+  else
+    fStream >> value;
+  return *this;
+}
+
+PacketReader &PacketReader::operator>>( QString &value )
+{
+  if( fCompact )
+  {
+    int length;
+    value.clear();
+    if( readLength(length, 1) )
+    {
+      value = QString::fromUtf8( fData, length );
+      fData += length;
+    }
+  }
+  else
+  {
+    fStream >> value;
+  }
+  return *this;
+}
+
+PacketReader &PacketReader::operator>>( QByteArray &value )
+{
+  if( fCompact )
+  {
+    int length;
+    value.clear();
+    if( readLength(length, 1) )
+    {
+      value = QByteArray( fData, length );
+      fData += length;
+    }
+  }
+  else
+  {
+    fStream >> value;
+  }
+  return *this;
+}
+
+PacketReader &PacketReader::operator>>( QDateTime &value )
+{
+  if( fCompact )
+  {
+    qint64 nanos;
+    readSigned( nanos );
+    value = nanos == s_InvalidTime ? QDateTime() : QDateTime::fromMSecsSinceEpoch( nanos / s_NanosPerMsec );
+  }
+  else
+  {
+    fStream >> value;
+  }
+  return *this;
+}
+
+PacketReader &PacketReader::operator>>( QStringList &value )
+{
+  if( fCompact )
+  {
+    int count;
+    value.clear();
+    if( readLength(count, 1) )
+    {
+      value.reserve( count );
+      for( int i=0; i<count && fValid; ++i )
+      {
+        QString s;
+        *this >> s;
+        value.append( s );
+      }
+    }
+  }
+  else
+  {
+    fStream >> value;
+  }
+  return *this;
+}
+
+PacketReader &PacketReader::operator>>( QVector<qint64> &value )
+{
+  if( fCompact )
+  {
+    int count;
+    value.clear();
+    if( readLength(count, 1) )
+    {
+      value.resize( count );
+      for( int i=0; i<count; ++i )
+        readSigned( value[i] );
+    }
+  }
+  else
+  {
+    fStream >> value;
+  }
+  return *this;
+}
+
+PacketReader &PacketReader::operator>>( QVector<quint32> &value )
+{
+  if( fCompact )
+  {
+    int count;
+    value.clear();
+    if( readLength(count, 4) )
+    {
+      value.resize( count );
+      const uchar *in = reinterpret_cast<const uchar*>( fData );
+      for( int i=0; i<count; ++i )
+        value[i] = qFromLittleEndian<quint32>( in + 4*i );
+      fData += 4*count;
+    }
+  }
+  else
+  {
+    fStream >> value;
+  }
+  return *this;
+}
+
+PacketReader &PacketReader::operator>>( QList<QByteArray> &value )
+{
+  if( fCompact )
+  {
+    int count;
+    value.clear();
+    if( readLength(count, 1) )
+    {
+      value.reserve( count );
+      for( int i=0; i<count && fValid; ++i )
+      {
+        QByteArray a;
+        *this >> a;
+        value.append( a );
+      }
+    }
+  }
+  else
+  {
+    fStream >> value;
+  }
+  return *this;
+}
+
+PacketReader &PacketReader::path( QString &value )
+{
+  if( fPaths == NULL )
+    return *this >> value;
+
+  quint64 tag;
+  value.clear();
+  if( !readVarint(tag) )
+    return *this;
+  if( tag == 0 )
+    return *this >> value;
+
+  quint32 id = static_cast<quint32>( tag >> 1 );
+  if( (tag & 1) == 0 )
+  {
+    //ids are registered in order, anything else means the tables are out of step
+    QString dir;
+    *this >> dir;
+    if( !fValid || id != fPaths->nextId() || fPaths->add(dir) != id )
+    {
+      fValid = false;
+      return *this;
+    }
+  }
+
+  const QString *dir = fPaths->dir( id );
+  QString name;
+  *this >> name;
+  if( dir == NULL || !fValid )
+  {
+    fValid = false;
+    return *this;
+  }
+  value = *dir + '/' + name;
+  return *this;
+}
+
+PacketReader &PacketReader::paths( QStringList &value )
+{
+  if( fPaths == NULL )
+    return *this >> value;
+
+  int count;
+  value.clear();
+  if( readLength(count, 1) )
+  {
+    value.reserve( count );
+    for( int i=0; i<count && fValid; ++i )
+    {
+      QString s;
+      path( s );
+      value.append( s );
+    }
+  }
+  return *this;
+}
+
+//-----------------------------------------------------------------------------
@@ -0,0 +1,122 @@
+#ifndef QUICKSYNC_WIREFORMAT_H
+#define QUICKSYNC_WIREFORMAT_H
+
+//-----------------------------------------------------------------------------
+// Packet payload encoding. Baseline peers get QDataStream, peers that agreed
+// on the compact format get varint integers and lengths, UTF-8 strings and
+// timestamps as int64 nanoseconds since the epoch.
+//-----------------------------------------------------------------------------
+
+//! Most bytes a varint takes, enough for 64 bits
+enum { MaxVarintSize = 10 };
+
+//! Writes value as a LEB128 varint to out, returns the number of bytes used
+extern int encodeVarint( quint64 value, char *out );
+//! Reads a varint from data, returns the number of bytes used, 0 when more data is needed and -1 when it is malformed
+extern int decodeVarint( const char *data, int size, quint64 &value );
+
+//-----------------------------------------------------------------------------
+
+//! Directories registered on a connection under small ids, so paths can be sent as the id and
+//! the file name. Each side keeps one for the paths it sends and one for the paths it receives
+class PathTable
+{
+public:
+  enum { MaxDirs = 1<<16 };
+
+  //! Id of a registered directory, 0 if it is not registered
+  quint32 find( const QString &dir ) const { return fIds.value( dir, 0 ); }
+  //! Registers dir under the next id and returns it, 0 when the table is full
+  quint32 add( const QString &dir );
+  //! Directory registered under id, NULL if there is none
+  const QString *dir( quint32 id ) const { return id >= 1 && id <= quint32(fDirs.size()) ? &fDirs.at(id - 1) : NULL; }
+  quint32 nextId() const { return fDirs.size() + 1; }
+
+private:
+  QHash<QString, quint32> fIds;
+  QVector<QString> fDirs;
+};
+
+//-----------------------------------------------------------------------------
+
+class PacketWriter
+{
+public:
+  //! Paths written with path() are interned in the table when there is one and the format is compact
+  explicit PacketWriter( bool compact, PathTable *paths = NULL );
+
+  const QByteArray &data() const { return fData; }
+
+  PacketWriter &operator<<( bool value );
+  PacketWriter &operator<<( qint32 value );
+  PacketWriter &operator<<( quint32 value );
+  PacketWriter &operator<<( qint64 value );
+  PacketWriter &operator<<( const QString &value );
+  PacketWriter &operator<<( const QByteArray &value );
+  PacketWriter &operator<<( const QDateTime &value );
+  PacketWriter &operator<<( const QStringList &value );
+  PacketWriter &operator<<( const QVector<qint64> &value );
+  PacketWriter &operator<<( const QVector<quint32> &value );
+  PacketWriter &operator<<( const QList<QByteArray> &value );
+
+  //! A path relative to the target directory
+  PacketWriter &path( const QString &value );
+  PacketWriter &paths( const QStringList &value );
+
+private:
+  void writeVarint( quint64 value );
+  void writeSigned( qint64 value );
+
+  bool fCompact;
+  PathTable *fPaths;
+  QByteArray fData;
+  QBuffer fBuffer;
+  QDataStream fStream;
+};
+
+//-----------------------------------------------------------------------------
+
+//! Reads a payload in place without copying it. Reading past the end or malformed data
+//! makes isValid() false and yields empty values from then on
+class PacketReader
+{
+public:
+  PacketReader( const char *data, int size, bool compact, PathTable *paths = NULL );
+
+  bool atEnd() const;
+  bool isValid() const;
+
+  PacketReader &operator>>( bool &value );
+  PacketReader &operator>>( qint32 &value );
+  PacketReader &operator>>( quint32 &value );
+  PacketReader &operator>>( qint64 &value );
+  PacketReader &operator>>( QString &value );
+  PacketReader &operator>>( QByteArray &value );
+  PacketReader &operator>>( QDateTime &value );
+  PacketReader &operator>>( QStringList &value );
+  PacketReader &operator>>( QVector<qint64> &value );
+  PacketReader &operator>>( QVector<quint32> &value );
+  PacketReader &operator>>( QList<QByteArray> &value );
+
+  PacketReader &path( QString &value );
+  PacketReader &paths( QStringList &value );
+
+private:
+  bool readVarint( quint64 &value );
+  bool readSigned( qint64 &value );
+  //! Reads a count or length and checks that at least minSize bytes per item are left
+  bool readLength( int &length, int minSize );
+
+  bool fCompact;
+  PathTable *fPaths;
+  const char *fData;
+  const char *fEnd;
+  bool fValid;
+  QByteArray fRaw;
+  QBuffer fBuffer;
+  QDataStream fStream;
+};
+
+//-----------------------------------------------------------------------------
+
+#endif //QUICKSYNC_WIREFORMAT_H